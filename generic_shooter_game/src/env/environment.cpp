@@ -35,6 +35,17 @@ bool gsg::parse_command_line(int argc, char** argv, Environment& store) {
 		("help,h", "Display this help message.")
 		("version,v", "Display the program version.")
 		("directory,D", po::value<fs::path>()->default_value("./"), "Specifies a working directory for the program.")
+		("profile,p", "Start with the frame profiler enabled. F9 toggles it, F10 dumps a trace.\nF11 toggles hardware counters, F12 logs their report.")
+		("profile-frames", po::value<size_t>()->default_value(120), "Number of most recent frames written to profile.json on F10.")
+		("archive", po::value<fs::path>(), "Read resources from this packed archive. Defaults to resources/resources.pak if it exists.")
+		("no-archive", "Read loose resource files even if resources/resources.pak exists.")
+		("hot-reload", "Reload meshes, textures and shaders when their files change. Ignored with an archive.")
+		("resource-stats", po::value<fs::path>(), "Write resource loading statistics to this CSV file every frame. F8 logs a summary.")
+		("resource-budget", po::value<size_t>()->default_value(0), "Memory budget for loaded meshes and textures in MiB, 0 for unlimited.")
+		("worker-threads", po::value<size_t>(), "Number of worker threads. Defaults to one per physical core but the main thread's, or PSI_WORKER_THREADS.")
+		("io-threads", po::value<size_t>(), "Number of threads for file loading. Defaults to 2, or PSI_IO_THREADS.")
+		("no-pin", "Do not pin threads to cores. Same as PSI_PIN_THREADS=0.")
+		("numa-node", po::value<int32_t>(), "Keep all threads on this NUMA node, -1 for all nodes. Defaults to the main thread's node, or PSI_NUMA_NODE.")
 	;
 
 	po::variables_map vm;
@@ -83,5 +94,35 @@ bool gsg::parse_command_line(int argc, char** argv, Environment& store) {
 		return false;
 	}
 
+	if (vm.count("archive")) {
+		store.archive = vm["archive"].as<fs::path>();
+		if (!fs::is_regular_file(store.archive)) {
+			std::cout << "Invalid archive " << store.archive << "." << std::endl;
+			return false;
+		}
+	}
+	else if (!vm.count("no-archive") && fs::is_regular_file(store.resource_dir / "resources.pak")) {
+		store.archive = store.resource_dir / "resources.pak";
+	}
+
+	store.profile = vm.count("profile");
+	store.profile_frames = vm["profile-frames"].as<size_t>();
+
+	store.resource_budget = vm["resource-budget"].as<size_t>() * 1024 * 1024;
+	store.hot_reload = vm.count("hot-reload");
+	if (vm.count("resource-stats"))
+		store.resource_stats = vm["resource-stats"].as<fs::path>();
+
+	// the default worker count depends on the node
+	store.tasks = vm.count("numa-node")
+		? psi_thread::auto_task_manager_args(vm["numa-node"].as<int32_t>())
+		: psi_thread::auto_task_manager_args();
+	if (vm.count("worker-threads"))
+		store.tasks.workers = vm["worker-threads"].as<size_t>();
+	if (vm.count("io-threads"))
+		store.tasks.io_workers = vm["io-threads"].as<size_t>();
+	if (vm.count("no-pin"))
+		store.tasks.pin_threads = false;
+
 	return true;
 }
@@ -22,11 +22,30 @@
 
 #include <boost/filesystem.hpp>
 
+#include <thread/manager.hpp>
+
 
 namespace gsg {
 struct Environment {
 	boost::filesystem::path working_dir;
 	boost::filesystem::path resource_dir;
+	/// Packed resource archive which resources are read from, empty to read loose files from resource_dir.
+	boost::filesystem::path archive;
+
+	/// Whether the frame profiler records from startup.
+	bool profile;
+	/// Number of most recent frames written by a profiler dump.
+	size_t profile_frames;
+
+	/// Memory budget for loaded resources in bytes, 0 for unlimited.
+	size_t resource_budget;
+	/// Whether loose resource files are reloaded when they change.
+	bool hot_reload;
+	/// CSV file which resource statistics are written to every frame, empty for none.
+	boost::filesystem::path resource_stats;
+
+	/// Thread pool configuration, auto-tuned for this machine unless overridden.
+	psi_thread::TaskManagerArgs tasks;
 };
 
 /// Parses command line arguments.
@@ -22,13 +22,103 @@
 #include <string>
 #include <locale>
 
+#include <boost/filesystem/fstream.hpp>
+
 #include <log/log.hpp>
 #include <impl/impl.hpp>
 #include <util/file.hpp>
+#include <util/archive.hpp>
+#include <util/hash.hpp>
+#include <profile/profiler.hpp>
+#include <profile/counters.hpp>
 #include <system/manager.hpp>
 
 #include "env/environment.hpp"
 
+using namespace psi_serv::literals;
+
+
+/// Registers loaders which read loose files from the resource directory.
+static void register_file_loaders(psi_serv::IResourceService& resources, boost::filesystem::path const& dir) {
+	// meshes are mapped and checked on the workers, nothing is copied until the GL upload
+	resources.register_staged_loader<std::shared_ptr<psi_util::MappedFile const>, psi_rndr::MeshView>(u8"mesh"_rid,
+		[=] (std::string const& s) -> auto {
+			return std::make_shared<psi_util::MappedFile const>(dir.string() + s + u8".msh");
+		},
+		[] (std::shared_ptr<psi_util::MappedFile const> const& file) {
+			return psi_rndr::map_mesh(file);
+		},
+		psi_rndr::mesh_view_size,
+		[=] (std::string const& s) -> std::vector<std::string> {
+			return { dir.string() + s + u8".msh" };
+		},
+		[] (std::shared_ptr<psi_util::MappedFile const> const& file) {
+			return psi_rndr::mesh_content_hash(file->data(), file->size());
+		});
+	// textures are read asynchronously and decoded on the workers
+	resources.register_file_loader<psi_rndr::TextureData>(u8"texture"_rid,
+		[=] (std::string const& s) -> std::string {
+			return dir.string() + s + u8".png";
+		},
+		[] (std::vector<char> const& data) {
+			return psi_rndr::decode_texture(data);
+		},
+		psi_rndr::texture_size);
+	// shader sources are read on an I/O thread and parsed on the workers
+	using ShaderSources = std::array<std::vector<std::string>, 6>;
+	resources.register_staged_loader<ShaderSources, psi_gl::GLSLSource>(u8"shader"_rid,
+		[=] (std::string const& s) -> ShaderSources {
+			return {{
+				psi_util::load_text(dir.string() + s + u8".vert"),
+				psi_util::load_text(dir.string() + s + u8".frag"),
+			}};
+		},
+		[] (ShaderSources const& sources) {
+			return psi_gl::parse_glsl_source(sources);
+		},
+		nullptr,
+		[=] (std::string const& s) -> std::vector<std::string> {
+			return { dir.string() + s + u8".vert", dir.string() + s + u8".frag" };
+		});
+}
+
+/// Registers loaders which read from a packed archive, resolving names through its index.
+static void register_archive_loaders(psi_serv::IResourceService& resources, std::shared_ptr<psi_util::Archive const> archive) {
+	// uncompressed meshes are viewed right in the archive's mapping
+	resources.register_staged_loader<psi_util::SharedBytes, psi_rndr::MeshView>(u8"mesh"_rid,
+		[=] (std::string const& s) {
+			return archive->open(s + u8".msh");
+		},
+		[] (psi_util::SharedBytes const& bytes) {
+			return psi_rndr::map_mesh(bytes.owner, bytes.data, bytes.size);
+		},
+		psi_rndr::mesh_view_size,
+		nullptr,
+		[] (psi_util::SharedBytes const& bytes) {
+			return psi_rndr::mesh_content_hash(bytes.data, bytes.size);
+		});
+	resources.register_staged_loader<psi_util::SharedBytes, psi_rndr::TextureData>(u8"texture"_rid,
+		[=] (std::string const& s) {
+			return archive->open(s + u8".png");
+		},
+		[] (psi_util::SharedBytes const& bytes) {
+			return psi_rndr::decode_texture(bytes.data, bytes.size);
+		},
+		psi_rndr::texture_size,
+		nullptr,
+		[] (psi_util::SharedBytes const& bytes) {
+			return psi_util::xxh64(bytes.data, bytes.size);
+		});
+	resources.register_loader<psi_gl::GLSLSource>(u8"shader"_rid,
+		[=] (std::string const& s) -> auto {
+			auto vert = archive->open(s + u8".vert");
+			auto frag = archive->open(s + u8".frag");
+			return psi_gl::parse_glsl_source({{
+				psi_util::split_lines(vert.data, vert.size),
+				psi_util::split_lines(frag.data, frag.size),
+			}});
+		});
+}
 
 int main(int argc, char** argv) {
 	gsg::Environment env;
@@ -37,12 +127,18 @@ int main(int argc, char** argv) {
 
 	psi_log::init(env.working_dir, psi_log::Level::DEBUG);
 
-	psi_thread::TaskManager task_manager;
+	psi_thread::TaskManager task_manager(env.tasks);
+	psi_log::info("gsg") << "Started " << task_manager.worker_count() << " worker and "
+		<< task_manager.io_worker_count() << " I/O threads" << (env.tasks.pin_threads ? ", pinned to cores" : "") << ".\n";
 
 	psi_serv::ServiceManager services;
-	services.set_resource_service(psi_serv::start_resource_loader(psi_serv::ResourceLoaderArgs{
+	psi_serv::ResourceLoaderArgs resource_args{
 		task_manager,
-	}));
+		env.resource_budget,
+	};
+	// an archive is packed offline, there are no loose files to watch
+	resource_args.hot_reload = env.hot_reload && env.archive.empty();
+	services.set_resource_service(psi_serv::start_resource_loader(resource_args));
 
 	services.set_window_service(psi_serv::start_gl_window_service(psi_serv::GLWindowServiceArgs{
 		640,
@@ -55,34 +151,83 @@ int main(int argc, char** argv) {
 	}));
 	services.window_service().set_mouse_block(true);
 
-	std::hash<std::string> hash;
-	services.resource_service().register_loader(hash(u8"mesh"),
-		[=] (std::string const& s) -> auto {
-			return psi_rndr::load_mesh(env.resource_dir.string() + s + u8".msh");
-		});
-	services.resource_service().register_loader(hash(u8"texture"),
-		[=] (std::string const& s) -> auto {
-			return psi_rndr::load_texture(env.resource_dir.string() + s + u8".png");
-		});
-	services.resource_service().register_loader(hash(u8"shader"),
-		[=] (std::string const& s) -> auto {
-			return psi_gl::parse_glsl_source({{
-				psi_util::load_text(env.resource_dir.string() + s + u8".vert"),
-				psi_util::load_text(env.resource_dir.string() + s + u8".frag"),
-			}});
-		});
+	psi_prof::set_enabled(env.profile);
+	services.window_service().register_keyboard_input_callback(
+		[&env, &services] (psi_serv::KeyboardInput k, psi_serv::InputAction a) {
+			if (a != psi_serv::InputAction::PRESSED)
+				return;
+
+			if (k == psi_serv::KeyboardInput::F8) {
+				psi_serv::log_resource_stats(services.resource_service().stats());
+			}
+			else if (k == psi_serv::KeyboardInput::F9) {
+				psi_prof::set_enabled(!psi_prof::is_enabled());
+				psi_log::info("gsg") << "Profiler " << (psi_prof::is_enabled() ? "enabled" : "disabled") << ".\n";
+			}
+			else if (k == psi_serv::KeyboardInput::F10) {
+				try {
+					psi_prof::dump_chrome_trace(env.working_dir / "profile.json", env.profile_frames);
+				}
+				catch (std::exception const& e) {
+					psi_log::error("gsg") << "Failed to dump profile: " << e.what() << "\n";
+				}
+			}
+			else if (k == psi_serv::KeyboardInput::F11) {
+				psi_prof::set_counters_enabled(!psi_prof::counters_enabled());
+				psi_log::info("gsg") << "Hardware counters " << (psi_prof::counters_enabled() ? "enabled" : "disabled") << ".\n";
+			}
+			else if (k == psi_serv::KeyboardInput::F12) {
+				psi_prof::log_counter_report();
+			}
+		}
+	);
+
+	if (env.archive.empty()) {
+		register_file_loaders(services.resource_service(), env.resource_dir);
+	}
+	else {
+		auto archive = std::make_shared<psi_util::Archive const>(env.archive);
+		psi_log::info("gsg") << "Reading resources from " << env.archive.string() << " (" << archive->size() << " blobs).\n";
+		register_archive_loaders(services.resource_service(), archive);
+	}
 
 	psi_sys::SystemManager systems(task_manager);
 	systems.register_component_type(psi_scene::component_type_entity_info);
 	systems.register_component_type(psi_scene::component_type_model_info);
 	systems.register_component_type(psi_scene::component_type_transform_info);
-	systems.register_system(psi_sys::start_gl_renderer(task_manager, services));
+	psi_rndr::PrefetchArgs prefetch;
+	// prefetches must not evict what is visible, so they leave a quarter of the budget to it
+	prefetch.memory_ceiling = env.resource_budget / 4 * 3;
+	systems.register_system(psi_sys::start_gl_renderer(task_manager, services, prefetch));
 	systems.load_scene(nullptr);
 
+	boost::filesystem::ofstream resource_stats;
+	psi_serv::ResourceStats last_resource_stats;
+	if (!env.resource_stats.empty()) {
+		resource_stats.open(env.resource_stats);
+		if (resource_stats)
+			psi_serv::write_resource_stats_header(resource_stats);
+		else
+			psi_log::error("gsg") << "Cannot write resource statistics to " << env.resource_stats.string() << ".\n";
+	}
+
 	// TODO cap FPS
 	auto& window = services.window_service();
-	while(!window.should_close()) {
+	for (uint64_t frame = 0; !window.should_close(); ++frame) {
+		psi_prof::mark_frame();
+		{
+			PSI_PROFILE_ZONE("TaskManager::run_main_tasks");
+			task_manager.run_main_tasks();
+		}
 		systems.update_scene();
+
+		if (resource_stats) {
+			auto stats = services.resource_service().stats();
+			psi_serv::write_resource_stats_row(resource_stats, frame, stats, last_resource_stats);
+			last_resource_stats = std::move(stats);
+		}
+
+		PSI_PROFILE_ZONE("IWindowService::update_window");
 		window.update_window();
 	}
 
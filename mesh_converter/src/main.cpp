@@ -16,6 +16,7 @@
  */
 
 #include <cstdlib>
+#include <cmath>
 #include <string>
 #include <vector>
 #include <cstdint>
@@ -27,6 +28,7 @@
 namespace fs = boost::filesystem;
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
+#include <boost/optional.hpp>
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
@@ -36,6 +38,9 @@ namespace po = boost::program_options;
 
 #include <resource.hpp>
 
+#include "optimize.hpp"
+#include "simplify.hpp"
+
 
 static Assimp::Importer importer;
 
@@ -137,10 +142,175 @@ void calc_tangents(psi_rndr::MeshData& mesh) {
 	}
 }
 
+struct Environment {
+	std::vector<fs::path> meshes;
+	fs::path out_dir;
+	psi_rndr::VertexLayout layout = psi_rndr::VertexLayout::QUANTIZED;
+	bool optimize_vertex_cache = false;
+	/// Set if overdraw is to be optimized, how much the ACMR may grow for it
+	boost::optional<float> overdraw_threshold;
+	bool optimize_vertex_fetch = false;
+	/// Fractions of the triangles to keep in each coarser detail level
+	std::vector<float> lod_ratios;
+	/// How far each coarser detail level may stray from the full detail one, relative to the bounding box diagonal.
+	/// The last one applies to the remaining levels.
+	std::vector<float> lod_errors;
+};
+
+/// Appends the coarser detail levels chosen in the environment to a triangle mesh with a single level.
+/// Stops early once a level cannot be simplified further within its error.
+void generate_levels(psi_rndr::MeshData& mesh, std::string const& name, Environment const& env) {
+	std::vector<uint32_t> const full = mesh.indices;
+	size_t const tri_count = full.size() / 3;
+
+	float diagonal = 0.0f;
+	for (size_t i = 0; i < 3; ++i)
+		diagonal += (mesh.max_pos[i] - mesh.min_pos[i]) * (mesh.max_pos[i] - mesh.min_pos[i]);
+	diagonal = std::sqrt(diagonal);
+
+	for (size_t i_lod = 0; i_lod < env.lod_ratios.size(); ++i_lod) {
+		float rel_error = env.lod_errors.empty() ? 0.05f : env.lod_errors[std::min(i_lod, env.lod_errors.size() - 1)];
+
+		// every level is simplified from the full detail one, so its error is measured against it
+		auto lod = simplify_mesh(full, mesh.vertices, size_t(float(tri_count) * env.lod_ratios[i_lod]), rel_error * diagonal);
+		if (lod.indices.size() >= mesh.levels.back().index_count) {
+			std::cout << "Mesh " << name << " cannot be simplified further than level " << mesh.levels.size() - 1 << ".\n";
+			break;
+		}
+
+		psi_rndr::MeshLevel level;
+		level.first_index = mesh.indices.size();
+		level.index_count = lod.indices.size();
+		level.error = lod.error;
+		mesh.indices.insert(mesh.indices.end(), lod.indices.begin(), lod.indices.end());
+		mesh.levels.push_back(level);
+
+		std::cout
+			<< "Mesh " << name << " level " << mesh.levels.size() - 1
+			<< ": " << level.index_count / 3 << " triangles, error " << level.error << "\n";
+	}
+}
+
+/// Runs the optimization passes chosen in the environment on each level of a triangle mesh and prints
+/// their vertex cache statistics before and after.
+void optimize_mesh(psi_rndr::MeshData& mesh, std::string const& name, Environment const& env) {
+	std::vector<VertexCacheStats> before;
+	for (auto const& level : mesh.levels) {
+		std::vector<uint32_t> indices(mesh.indices.begin() + level.first_index, mesh.indices.begin() + level.first_index + level.index_count);
+		before.push_back(analyze_vertex_cache(indices, mesh.vertices.size()));
+
+		if (env.optimize_vertex_cache)
+			optimize_vertex_cache(indices, mesh.vertices.size());
+		if (env.overdraw_threshold)
+			optimize_overdraw(indices, mesh.vertices, *env.overdraw_threshold);
+
+		std::copy(indices.begin(), indices.end(), mesh.indices.begin() + level.first_index);
+	}
+
+	// the finest level comes first, so the vertices end up in the order it uses them in
+	if (env.optimize_vertex_fetch)
+		optimize_vertex_fetch(mesh);
+
+	for (size_t i_level = 0; i_level < mesh.levels.size(); ++i_level) {
+		auto const& level = mesh.levels[i_level];
+		std::vector<uint32_t> indices(mesh.indices.begin() + level.first_index, mesh.indices.begin() + level.first_index + level.index_count);
+		auto after = analyze_vertex_cache(indices, mesh.vertices.size());
+
+		std::cout << "Mesh " << name;
+		if (mesh.levels.size() > 1)
+			std::cout << " level " << i_level;
+		std::cout
+			<< ": ACMR " << before[i_level].acmr << " -> " << after.acmr
+			<< ", ATVR " << before[i_level].atvr << " -> " << after.atvr << "\n";
+	}
+}
+
+/// Stores the mesh in the Psi Mesh format, version 3.
+void write_mesh(std::ostream& out_stream, psi_rndr::MeshData const& mesh, psi_rndr::VertexLayout layout) {
+	MD5_CTX md5;
+	std::array<unsigned char, 16> md5_digest;
+
+	uint64_t verts = mesh.vertices.size();
+	uint64_t inds = mesh.indices.size();
+
+	MD5_Init(&md5);
+
+	char const magic[8] = { 'P', 'S', 'I', 'M', 'E', 'S', 'H', '\0' };
+	uint32_t version = 3;
+	uint32_t layout_id = uint32_t(layout);
+
+	out_stream.write(magic, sizeof(magic));
+	MD5_Update(&md5, magic, sizeof(magic));
+	out_stream.write((char*)(&version), sizeof(uint32_t));
+	MD5_Update(&md5, &version, sizeof(uint32_t));
+	out_stream.write((char*)(&layout_id), sizeof(uint32_t));
+	MD5_Update(&md5, &layout_id, sizeof(uint32_t));
+
+	out_stream.write((char*)(&verts), sizeof(uint64_t));
+	MD5_Update(&md5, &verts, sizeof(uint64_t));
+	out_stream.write((char*)(&inds), sizeof(uint64_t));
+	MD5_Update(&md5, &inds, sizeof(uint64_t));
+	out_stream.write((char*)(mesh.max_pos.data()), 3 * sizeof(float));
+	MD5_Update(&md5, mesh.max_pos.data(), 3 * sizeof(float));
+	out_stream.write((char*)(mesh.min_pos.data()), 3 * sizeof(float));
+	MD5_Update(&md5, mesh.min_pos.data(), 3 * sizeof(float));
+
+	// a mesh without levels is a single one
+	std::vector<psi_rndr::MeshLevel> levels = mesh.levels;
+	if (levels.empty()) {
+		levels.emplace_back();
+		levels.back().index_count = mesh.indices.size();
+	}
+
+	uint32_t level_count = levels.size();
+	uint32_t reserved = 0;
+	out_stream.write((char*)(&level_count), sizeof(uint32_t));
+	MD5_Update(&md5, &level_count, sizeof(uint32_t));
+	out_stream.write((char*)(&reserved), sizeof(uint32_t));
+	MD5_Update(&md5, &reserved, sizeof(uint32_t));
+
+	for (auto const& level : levels) {
+		uint64_t first = level.first_index;
+		uint64_t count = level.index_count;
+		out_stream.write((char*)(&first), sizeof(uint64_t));
+		MD5_Update(&md5, &first, sizeof(uint64_t));
+		out_stream.write((char*)(&count), sizeof(uint64_t));
+		MD5_Update(&md5, &count, sizeof(uint64_t));
+		out_stream.write((char*)(&level.error), sizeof(float));
+		MD5_Update(&md5, &level.error, sizeof(float));
+		out_stream.write((char*)(&reserved), sizeof(uint32_t));
+		MD5_Update(&md5, &reserved, sizeof(uint32_t));
+	}
+
+	MD5_Final(md5_digest.data(), &md5);
+	out_stream.write((char*)(md5_digest.data()), 16 * sizeof(unsigned char));
+
+	MD5_Init(&md5);
+
+	for (auto const& vert : mesh.vertices) {
+		if (layout == psi_rndr::VertexLayout::QUANTIZED) {
+			auto q = psi_rndr::quantize_vertex(vert, mesh.min_pos, mesh.max_pos);
+			out_stream.write((char*)(&q), sizeof(psi_rndr::QuantizedVertexData));
+			MD5_Update(&md5, &q, sizeof(psi_rndr::QuantizedVertexData));
+		}
+		else {
+			out_stream.write((char*)(&vert), sizeof(psi_rndr::VertexData));
+			MD5_Update(&md5, &vert, sizeof(psi_rndr::VertexData));
+		}
+	}
+	for (auto const& ind : mesh.indices) {
+		out_stream.write((char*)(&ind), sizeof(uint32_t));
+		MD5_Update(&md5, &ind, sizeof(uint32_t));
+	}
+
+	MD5_Final(md5_digest.data(), &md5);
+	out_stream.write((char*)(md5_digest.data()), 16 * sizeof(unsigned char));
+}
+
 /// Tries to load the specified mesh file
 /// and save a converted version to the specified output directory.
 /// @throw if anything goes wrong during the process
-void load_and_serialize_mesh(fs::path const& file, fs::path const& out_dir) {
+void load_and_serialize_mesh(fs::path const& file, Environment const& env) {
 	std::ifstream in_stream(file.string());
 	if (in_stream.fail()) {
 		// exit and declare error if file can't be found
@@ -223,58 +393,39 @@ void load_and_serialize_mesh(fs::path const& file, fs::path const& out_dir) {
 		calc_bounding_box(out_mesh);
 		calc_tangents(out_mesh);
 
-		// create file
-		fs::path out_file = out_dir;
-		out_file += file.filename().replace_extension().string() + "_" + mesh->mName.C_Str() + ".msh";
-
-		std::ofstream out_stream(out_file.string());
-		if (!out_stream.good())
-			throw std::runtime_error("Could not write to file " + out_file.string() + ".");
-
-		// store in Psi Mesh format
-		MD5_CTX md5;
-		std::array<unsigned char, 16> md5_digest;
+		psi_rndr::MeshLevel full_detail;
+		full_detail.index_count = out_mesh.indices.size();
+		out_mesh.levels.push_back(full_detail);
 
-		uint64_t verts = out_mesh.vertices.size();
-		uint64_t inds = out_mesh.indices.size();
-
-		MD5_Init(&md5);
-
-		out_stream.write((char*)(&verts), sizeof(uint64_t));
-		MD5_Update(&md5, &verts, sizeof(uint64_t));
-		out_stream.write((char*)(&inds), sizeof(uint64_t));
-		MD5_Update(&md5, &inds, sizeof(uint64_t));
-		out_stream.write((char*)(out_mesh.max_pos.data()), 3 * sizeof(float));
-		MD5_Update(&md5, out_mesh.max_pos.data(), 3 * sizeof(float));
-		out_stream.write((char*)(out_mesh.min_pos.data()), 3 * sizeof(float));
-		MD5_Update(&md5, out_mesh.min_pos.data(), 3 * sizeof(float));
+		if (mesh->mPrimitiveTypes == aiPrimitiveType_TRIANGLE) {
+			generate_levels(out_mesh, mesh->mName.C_Str(), env);
+			optimize_mesh(out_mesh, mesh->mName.C_Str(), env);
+		}
+		else
+			std::cout << std::string("Mesh ") + mesh->mName.C_Str() + " is not made of triangles only, it is not simplified or optimized.\n";
 
-		MD5_Final(md5_digest.data(), &md5);
-		out_stream.write((char*)(md5_digest.data()), 16 * sizeof(unsigned char));
+		// create file
+		fs::path out_file = env.out_dir;
+		out_file += file.filename().replace_extension().string() + "_" + mesh->mName.C_Str() + ".msh";
 
-		MD5_Init(&md5);
+		// the game maps meshes, rewriting one in place would pull the data from under a running game;
+		// rename() replaces it atomically, the old file lives on as long as it stays mapped
+		fs::path tmp_file = out_file;
+		tmp_file += ".tmp";
 
-		for (auto const& vert : out_mesh.vertices) {
-			out_stream.write((char*)(&vert), sizeof(psi_rndr::VertexData));
-			MD5_Update(&md5, &vert, sizeof(psi_rndr::VertexData));
-		}
-		for (auto const& ind : out_mesh.indices) {
-			out_stream.write((char*)(&ind), sizeof(uint32_t));
-			MD5_Update(&md5, &ind, sizeof(uint32_t));
-		}
+		std::ofstream out_stream(tmp_file.string(), std::ios::binary);
+		if (!out_stream.good())
+			throw std::runtime_error("Could not write to file " + tmp_file.string() + ".");
 
-		MD5_Final(md5_digest.data(), &md5);
-		out_stream.write((char*)(md5_digest.data()), 16 * sizeof(unsigned char));
+		write_mesh(out_stream, out_mesh, env.layout);
 
 		out_stream.close();
+		if (!out_stream.good())
+			throw std::runtime_error("Could not write to file " + tmp_file.string() + ".");
+		fs::rename(tmp_file, out_file);
 	}
 }
 
-struct Environment {
-	std::vector<fs::path> meshes;
-	fs::path out_dir;
-};
-
 constexpr int NO_EXIT = 1337;
 /// Parses the given command line arguments into the specified environment.
 /// @return exit code if program should exit, NO_EXIT otherwise
@@ -286,6 +437,13 @@ int parse_command_line(int argc, char** argv, Environment& env) {
 		("input-directory,i", po::value<fs::path>()->default_value("./"), "Set the directory from which files are read.")
 		("output-directory,o", po::value<fs::path>()->default_value("./"), "Set the directory to which files are saved.")
 		("add-mesh,m", po::value<std::vector<std::string>>(), "Add a mesh file to be converted.")
+		("float-vertices", "Store full precision float vertices instead of quantized ones.")
+		("optimize-vertex-cache", "Reorder triangles to reuse vertices in the post-transform vertex cache.")
+		("optimize-overdraw", po::value<float>()->implicit_value(1.05f), "Draw clusters of triangles facing outwards first to reduce overdraw, letting the ACMR grow by at most the given factor.")
+		("optimize-vertex-fetch", "Store vertices in the order they are first used in.")
+		("optimize-all", "Apply all the optimizations above.")
+		("lod-ratio", po::value<std::vector<float>>()->multitoken(), "Generate a coarser detail level keeping the given fraction of the triangles for each value, e.g. 0.5 0.25 0.125.")
+		("lod-error", po::value<std::vector<float>>()->multitoken(), "Limit how far each coarser detail level may stray from the full detail mesh, relative to its bounding box diagonal. The last value applies to the remaining levels, 0.05 by default.")
 	;
 
 	po::variables_map vm;
@@ -328,6 +486,35 @@ int parse_command_line(int argc, char** argv, Environment& env) {
 		return EXIT_FAILURE;
 	}
 
+	if (vm.count("float-vertices"))
+		env.layout = psi_rndr::VertexLayout::FLOAT;
+
+	bool const optimize_all = vm.count("optimize-all");
+	env.optimize_vertex_cache = optimize_all || vm.count("optimize-vertex-cache");
+	env.optimize_vertex_fetch = optimize_all || vm.count("optimize-vertex-fetch");
+	if (vm.count("optimize-overdraw"))
+		env.overdraw_threshold = vm["optimize-overdraw"].as<float>();
+	else if (optimize_all)
+		env.overdraw_threshold = 1.05f;
+
+	if (vm.count("lod-ratio"))
+		env.lod_ratios = vm["lod-ratio"].as<std::vector<float>>();
+	for (auto r : env.lod_ratios) {
+		if (!(r > 0.0f && r < 1.0f)) {
+			std::cout << "Detail level ratio " << r << " is not between 0 and 1." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (vm.count("lod-error"))
+		env.lod_errors = vm["lod-error"].as<std::vector<float>>();
+	for (auto e : env.lod_errors) {
+		if (!(e >= 0.0f)) {
+			std::cout << "Detail level error " << e << " is negative." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
 	if (!vm.count("add-mesh")) {
 		std::cout << "Please specify at least one mesh file." << std::endl;
 		return EXIT_FAILURE;
@@ -360,7 +547,7 @@ int main(int argc, char** argv) {
 				<< "Parsing mesh file "
 				<< file
 				<< ".." << std::endl;
-			load_and_serialize_mesh(file, env.out_dir);
+			load_and_serialize_mesh(file, env);
 		}
 		catch (std::exception const& e) {
 			std::cout
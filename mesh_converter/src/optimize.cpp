@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "optimize.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <numeric>
+
+
+/// Returns the number of vertices each triangle transforms, drawn with a FIFO cache of the given size.
+static std::vector<uint8_t> triangle_cache_misses(std::vector<uint32_t> const& indices, size_t vertex_count, size_t cache_size) {
+	// a vertex is in the cache if fewer than cache_size vertices were transformed since it was,
+	// the clock starts past the cache size so untouched vertices miss
+	std::vector<size_t> transformed_at(vertex_count, 0);
+	size_t clock = cache_size + 1;
+
+	std::vector<uint8_t> misses(indices.size() / 3, 0);
+	for (size_t i = 0; i < indices.size(); ++i) {
+		uint32_t v = indices[i];
+		if (clock - transformed_at[v] > cache_size) {
+			transformed_at[v] = clock++;
+			++misses[i / 3];
+		}
+	}
+
+	return misses;
+}
+
+VertexCacheStats analyze_vertex_cache(std::vector<uint32_t> const& indices, size_t vertex_count, size_t cache_size) {
+	auto misses = triangle_cache_misses(indices, vertex_count, cache_size);
+	size_t transformed = std::accumulate(misses.begin(), misses.end(), size_t(0));
+
+	std::vector<bool> referenced(vertex_count, false);
+	for (auto v : indices)
+		referenced[v] = true;
+	size_t referenced_count = std::count(referenced.begin(), referenced.end(), true);
+
+	VertexCacheStats stats;
+	stats.acmr = misses.empty() ? 0.0f : float(transformed) / float(misses.size());
+	stats.atvr = referenced_count == 0 ? 0.0f : float(transformed) / float(referenced_count);
+	return stats;
+}
+
+/// The LRU cache size Forsyth's scores are tuned for, larger than real caches so that it plans ahead.
+static constexpr size_t FORSYTH_CACHE_SIZE = 32;
+
+/// Scores a vertex by its position in the LRU cache, -1 if it is not in it,
+/// and the number of triangles still to draw which use it.
+static float forsyth_vertex_score(int cache_pos, uint32_t remaining) {
+	if (remaining == 0)
+		return -1.0f;
+
+	float score = 0.0f;
+	if (cache_pos >= 0) {
+		// the vertices of the last triangle are penalized slightly, so that strips do not go back on themselves
+		if (cache_pos < 3)
+			score = 0.75f;
+		else
+			score = std::pow(1.0f - float(cache_pos - 3) / float(FORSYTH_CACHE_SIZE - 3), 1.5f);
+	}
+
+	// vertices with few triangles left are boosted, so that they are finished and leave the cache
+	score += 2.0f * std::pow(float(remaining), -0.5f);
+	return score;
+}
+
+void optimize_vertex_cache(std::vector<uint32_t>& indices, size_t vertex_count) {
+	size_t const tri_count = indices.size() / 3;
+	if (tri_count == 0)
+		return;
+
+	// triangles not drawn yet using each vertex, those of vertex v are
+	// adjacency[adjacency_start[v]] to adjacency[adjacency_start[v] + remaining[v]]
+	std::vector<uint32_t> adjacency_start(vertex_count + 1, 0);
+	for (auto v : indices)
+		++adjacency_start[v + 1];
+	std::partial_sum(adjacency_start.begin(), adjacency_start.end(), adjacency_start.begin());
+
+	std::vector<uint32_t> remaining(vertex_count, 0);
+	std::vector<uint32_t> adjacency(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i) {
+		uint32_t v = indices[i];
+		adjacency[adjacency_start[v] + remaining[v]++] = uint32_t(i / 3);
+	}
+
+	std::vector<int> cache_pos(vertex_count, -1);
+	std::vector<float> vertex_score(vertex_count);
+	for (size_t v = 0; v < vertex_count; ++v)
+		vertex_score[v] = forsyth_vertex_score(-1, remaining[v]);
+
+	auto score_triangle = [&] (size_t t) {
+		return vertex_score[indices[3 * t]] + vertex_score[indices[3 * t + 1]] + vertex_score[indices[3 * t + 2]];
+	};
+
+	std::vector<float> tri_score(tri_count);
+	for (size_t t = 0; t < tri_count; ++t)
+		tri_score[t] = score_triangle(t);
+	std::vector<bool> drawn(tri_count, false);
+
+	std::vector<uint32_t> cache;
+	std::vector<uint32_t> new_cache;
+	std::vector<uint32_t> out;
+	out.reserve(indices.size());
+
+	// when nothing in the cache is left to draw, continue from the first triangle not drawn yet
+	size_t first_not_drawn = 0;
+	size_t best = std::max_element(tri_score.begin(), tri_score.end()) - tri_score.begin();
+
+	while (out.size() < indices.size()) {
+		if (best == tri_count) {
+			while (drawn[first_not_drawn])
+				++first_not_drawn;
+			best = first_not_drawn;
+		}
+
+		drawn[best] = true;
+		new_cache.clear();
+		for (size_t i_corner = 0; i_corner < 3; ++i_corner) {
+			uint32_t v = indices[3 * best + i_corner];
+			out.push_back(v);
+
+			// a degenerate triangle uses a vertex more than once and is listed as often
+			auto first = adjacency.begin() + adjacency_start[v];
+			auto last = first + remaining[v];
+			std::iter_swap(std::find(first, last, uint32_t(best)), last - 1);
+			--remaining[v];
+
+			if (std::find(new_cache.begin(), new_cache.end(), v) == new_cache.end())
+				new_cache.push_back(v);
+		}
+
+		// the triangle's vertices move to the front of the LRU cache and push the rest back
+		size_t const front = new_cache.size();
+		for (auto v : cache) {
+			if (std::find(new_cache.begin(), new_cache.begin() + front, v) == new_cache.begin() + front)
+				new_cache.push_back(v);
+		}
+		for (size_t i = 0; i < new_cache.size(); ++i)
+			cache_pos[new_cache[i]] = i < FORSYTH_CACHE_SIZE ? int(i) : -1;
+
+		// only the scores of vertices which moved in or out of the cache change, and of their triangles
+		for (auto v : new_cache)
+			vertex_score[v] = forsyth_vertex_score(cache_pos[v], remaining[v]);
+
+		best = tri_count;
+		float best_score = -1.0f;
+		for (auto v : new_cache) {
+			for (uint32_t i = 0; i < remaining[v]; ++i) {
+				uint32_t t = adjacency[adjacency_start[v] + i];
+				tri_score[t] = score_triangle(t);
+				if (tri_score[t] > best_score) {
+					best_score = tri_score[t];
+					best = t;
+				}
+			}
+		}
+
+		if (new_cache.size() > FORSYTH_CACHE_SIZE)
+			new_cache.resize(FORSYTH_CACHE_SIZE);
+		cache.swap(new_cache);
+	}
+
+	indices.swap(out);
+}
+
+using Vec3 = std::array<float, 3>;
+
+static Vec3 sub(Vec3 const& a, Vec3 const& b) {
+	return {{ a[0] - b[0], a[1] - b[1], a[2] - b[2] }};
+}
+
+static Vec3 cross(Vec3 const& a, Vec3 const& b) {
+	return {{ a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] }};
+}
+
+static float dot(Vec3 const& a, Vec3 const& b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+void optimize_overdraw(std::vector<uint32_t>& indices, std::vector<psi_rndr::VertexData> const& vertices, float threshold) {
+	size_t const tri_count = indices.size() / 3;
+	if (tri_count == 0)
+		return;
+
+	auto misses = triangle_cache_misses(indices, vertices.size(), SIMULATED_CACHE_SIZE);
+
+	// a triangle which misses with all its vertices starts a cluster anyway, since the cache has nothing for it
+	std::vector<size_t> hard;
+	for (size_t t = 0; t < tri_count; ++t) {
+		if (t == 0 || misses[t] == 3)
+			hard.push_back(t);
+	}
+	hard.push_back(tri_count);
+
+	// large clusters are split further where a triangle misses mostly anyway,
+	// if the part before it is about as cache efficient as the whole cluster
+	std::vector<size_t> clusters;
+	for (size_t i_hard = 0; i_hard + 1 < hard.size(); ++i_hard) {
+		size_t const begin = hard[i_hard];
+		size_t const end = hard[i_hard + 1];
+		float const cluster_acmr = float(std::accumulate(misses.begin() + begin, misses.begin() + end, size_t(0))) / float(end - begin);
+
+		clusters.push_back(begin);
+		size_t start = begin;
+		size_t start_misses = 0;
+		for (size_t t = begin; t < end; ++t) {
+			if (t > start && misses[t] >= 2 && float(start_misses) / float(t - start) <= threshold * cluster_acmr) {
+				clusters.push_back(t);
+				start = t;
+				start_misses = 0;
+			}
+			start_misses += misses[t];
+		}
+	}
+	clusters.push_back(tri_count);
+
+	// area-weighted centroids and normals of the triangles
+	std::vector<Vec3> centroids(tri_count);
+	std::vector<Vec3> normals(tri_count);
+	std::vector<float> areas(tri_count);
+	Vec3 mesh_centroid = {{ 0.0f, 0.0f, 0.0f }};
+	float mesh_area = 0.0f;
+	for (size_t t = 0; t < tri_count; ++t) {
+		auto const& p0 = vertices[indices[3 * t]].pos;
+		auto const& p1 = vertices[indices[3 * t + 1]].pos;
+		auto const& p2 = vertices[indices[3 * t + 2]].pos;
+
+		normals[t] = cross(sub(p1, p0), sub(p2, p0));
+		areas[t] = 0.5f * std::sqrt(dot(normals[t], normals[t]));
+		for (size_t i = 0; i < 3; ++i) {
+			centroids[t][i] = (p0[i] + p1[i] + p2[i]) / 3.0f;
+			mesh_centroid[i] += centroids[t][i] * areas[t];
+		}
+		mesh_area += areas[t];
+	}
+	if (mesh_area > 0.0f) {
+		for (auto& c : mesh_centroid)
+			c /= mesh_area;
+	}
+
+	// clusters facing away from the centre sort first
+	size_t const cluster_count = clusters.size() - 1;
+	std::vector<float> facing(cluster_count, 0.0f);
+	for (size_t i_cl = 0; i_cl < cluster_count; ++i_cl) {
+		Vec3 centroid = {{ 0.0f, 0.0f, 0.0f }};
+		Vec3 normal = {{ 0.0f, 0.0f, 0.0f }};
+		float area = 0.0f;
+		for (size_t t = clusters[i_cl]; t < clusters[i_cl + 1]; ++t) {
+			for (size_t i = 0; i < 3; ++i) {
+				centroid[i] += centroids[t][i] * areas[t];
+				normal[i] += normals[t][i];
+			}
+			area += areas[t];
+		}
+
+		float const normal_len = std::sqrt(dot(normal, normal));
+		if (area > 0.0f && normal_len > 0.0f) {
+			for (size_t i = 0; i < 3; ++i) {
+				centroid[i] /= area;
+				normal[i] /= normal_len;
+			}
+			facing[i_cl] = dot(sub(centroid, mesh_centroid), normal);
+		}
+	}
+
+	std::vector<size_t> order(cluster_count);
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&facing] (size_t a, size_t b) {
+		return facing[a] > facing[b];
+	});
+
+	std::vector<uint32_t> out;
+	out.reserve(indices.size());
+	for (auto i_cl : order)
+		out.insert(out.end(), indices.begin() + 3 * clusters[i_cl], indices.begin() + 3 * clusters[i_cl + 1]);
+	indices.swap(out);
+}
+
+void optimize_vertex_fetch(psi_rndr::MeshData& mesh) {
+	uint32_t const UNUSED = ~uint32_t(0);
+	std::vector<uint32_t> remap(mesh.vertices.size(), UNUSED);
+
+	std::vector<psi_rndr::VertexData> vertices;
+	vertices.reserve(mesh.vertices.size());
+	for (auto& i : mesh.indices) {
+		if (remap[i] == UNUSED) {
+			remap[i] = uint32_t(vertices.size());
+			vertices.push_back(mesh.vertices[i]);
+		}
+		i = remap[i];
+	}
+
+	mesh.vertices.swap(vertices);
+}
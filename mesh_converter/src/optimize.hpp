@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <resource.hpp>
+
+
+/// The vertex cache size statistics and overdraw clusters are simulated with, typical of GPUs.
+constexpr size_t SIMULATED_CACHE_SIZE = 16;
+
+/// Post-transform vertex cache efficiency of an index buffer, simulated with a FIFO cache.
+struct VertexCacheStats {
+	/// Average cache miss ratio, i.e. transformed vertices per triangle, 0.5 at best and 3 at worst.
+	float acmr;
+	/// Average transformed vertex ratio, i.e. transformed vertices per referenced vertex, 1 at best.
+	float atvr;
+};
+
+/// Simulates drawing the triangles with a FIFO vertex cache of the given size.
+VertexCacheStats analyze_vertex_cache(std::vector<uint32_t> const& indices, size_t vertex_count, size_t cache_size = SIMULATED_CACHE_SIZE);
+
+/// Reorders triangles to reuse transformed vertices, after Tom Forsyth's
+/// "Linear-Speed Vertex Cache Optimisation".
+void optimize_vertex_cache(std::vector<uint32_t>& indices, size_t vertex_count);
+
+/// Splits the triangles into clusters and draws those facing outwards from the mesh centre first,
+/// since they tend to occlude the rest, after Sander et al. "Fast Triangle Reordering for Vertex Locality
+/// and Reduced Overdraw". Run after optimize_vertex_cache, whose order is kept within clusters.
+/// @param[in] threshold how much the ACMR may grow by splitting clusters, e.g. 1.05 for at most 5%
+void optimize_overdraw(std::vector<uint32_t>& indices, std::vector<psi_rndr::VertexData> const& vertices, float threshold);
+
+/// Stores vertices in the order the indices first use them in, drops unused ones and remaps the indices.
+void optimize_vertex_fetch(psi_rndr::MeshData& mesh);
@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "simplify.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
+
+
+using Vec3 = std::array<double, 3>;
+
+static Vec3 sub(Vec3 const& a, Vec3 const& b) {
+	return {{ a[0] - b[0], a[1] - b[1], a[2] - b[2] }};
+}
+
+static Vec3 cross(Vec3 const& a, Vec3 const& b) {
+	return {{ a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] }};
+}
+
+static double dot(Vec3 const& a, Vec3 const& b) {
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/// The sum of squared distances to a set of weighted planes, as a symmetric 4x4 matrix.
+struct Quadric {
+	double a00 = 0.0, a01 = 0.0, a02 = 0.0, a11 = 0.0, a12 = 0.0, a22 = 0.0;
+	double b0 = 0.0, b1 = 0.0, b2 = 0.0;
+	double c = 0.0;
+	/// The total weight of the planes the error is averaged over
+	double weight = 0.0;
+
+	/// Adds the plane dot(n, x) + d = 0 with a unit normal n.
+	void add_plane(Vec3 const& n, double d, double w) {
+		a00 += w * n[0] * n[0];
+		a01 += w * n[0] * n[1];
+		a02 += w * n[0] * n[2];
+		a11 += w * n[1] * n[1];
+		a12 += w * n[1] * n[2];
+		a22 += w * n[2] * n[2];
+		b0 += w * n[0] * d;
+		b1 += w * n[1] * d;
+		b2 += w * n[2] * d;
+		c += w * d * d;
+	}
+
+	Quadric& operator+=(Quadric const& q) {
+		a00 += q.a00; a01 += q.a01; a02 += q.a02; a11 += q.a11; a12 += q.a12; a22 += q.a22;
+		b0 += q.b0; b1 += q.b1; b2 += q.b2;
+		c += q.c;
+		weight += q.weight;
+		return *this;
+	}
+
+	/// Returns the weighted mean squared distance of the point to the planes.
+	double error(Vec3 const& p) const {
+		if (weight <= 0.0)
+			return 0.0;
+
+		double const x = p[0], y = p[1], z = p[2];
+		double const sum =
+			  a00 * x * x + a11 * y * y + a22 * z * z
+			+ 2.0 * (a01 * x * y + a02 * x * z + a12 * y * z)
+			+ 2.0 * (b0 * x + b1 * y + b2 * z)
+			+ c;
+		return std::max(sum, 0.0) / weight;
+	}
+};
+
+/// Open borders are held in place by planes through them, perpendicular to their triangles,
+/// weighted this much more than the triangles.
+static constexpr double BORDER_WEIGHT = 10.0;
+
+/// A collapse may turn a triangle by less than about 75 degrees, more would likely fold the surface.
+static constexpr double MIN_NORMAL_COS = 0.25;
+
+namespace {
+/// Collapses one position onto another. Only valid while neither position changed since it was queued.
+struct Collapse {
+	double cost;
+	uint32_t from;
+	uint32_t to;
+	uint32_t from_version;
+	uint32_t to_version;
+
+	bool operator>(Collapse const& other) const {
+		return cost > other.cost;
+	}
+};
+
+struct PositionHash {
+	size_t operator()(std::array<float, 3> const& p) const {
+		// -0 and 0 are equal, adding 0 turns the former into the latter
+		float const sums[3] = { p[0] + 0.0f, p[1] + 0.0f, p[2] + 0.0f };
+		uint32_t bits[3];
+		std::memcpy(bits, sums, sizeof(bits));
+		return size_t(bits[0]) * 73856093u ^ size_t(bits[1]) * 19349663u ^ size_t(bits[2]) * 83492791u;
+	}
+};
+
+/// Edge collapse state. Collapses work on positions, which carry one vertex per combination of normal and UV,
+/// called its wedges, so that attribute seams do not tear.
+class Simplifier {
+public:
+	Simplifier(std::vector<uint32_t> const& indices, std::vector<psi_rndr::VertexData> const& vertices)
+		: _vertices(vertices)
+		, _tris(indices)
+		, _tri_alive(indices.size() / 3, true)
+		, _pos_of(vertices.size()) {
+		std::unordered_map<std::array<float, 3>, uint32_t, PositionHash> ids;
+		for (size_t v = 0; v < vertices.size(); ++v) {
+			auto it = ids.emplace(vertices[v].pos, uint32_t(_points.size())).first;
+			if (it->second == _points.size()) {
+				auto const& p = vertices[v].pos;
+				_points.push_back({{ p[0], p[1], p[2] }});
+				_wedges.emplace_back();
+			}
+			_pos_of[v] = it->second;
+			_wedges[it->second].push_back(uint32_t(v));
+		}
+
+		size_t const pos_count = _points.size();
+		_pos_tris.resize(pos_count);
+		_pos_alive.assign(pos_count, true);
+		_version.assign(pos_count, 0);
+		_quadrics.resize(pos_count);
+
+		for (size_t t = 0; t < _tri_alive.size(); ++t) {
+			uint32_t p0 = pos(t, 0), p1 = pos(t, 1), p2 = pos(t, 2);
+			// triangles which are degenerate already are invisible and dropped
+			if (p0 == p1 || p1 == p2 || p2 == p0) {
+				_tri_alive[t] = false;
+				continue;
+			}
+
+			++_alive_count;
+			for (size_t i_corner = 0; i_corner < 3; ++i_corner)
+				_pos_tris[pos(t, i_corner)].push_back(uint32_t(t));
+		}
+
+		for (size_t t = 0; t < _tri_alive.size(); ++t) {
+			if (!_tri_alive[t])
+				continue;
+
+			Vec3 n = normal(t);
+			double const len = std::sqrt(dot(n, n));
+			if (len == 0.0)
+				continue;
+			for (auto& c : n)
+				c /= len;
+
+			Quadric q;
+			q.add_plane(n, -dot(n, _points[pos(t, 0)]), 0.5 * len);
+			q.weight = 0.5 * len;
+			for (size_t i_corner = 0; i_corner < 3; ++i_corner)
+				_quadrics[pos(t, i_corner)] += q;
+
+			for (size_t i_corner = 0; i_corner < 3; ++i_corner) {
+				uint32_t a = pos(t, i_corner), b = pos(t, (i_corner + 1) % 3);
+				if (edge_triangles(a, b) != 1)
+					continue;
+
+				Vec3 edge = sub(_points[b], _points[a]);
+				Vec3 border_n = cross(edge, n);
+				double const border_len = std::sqrt(dot(border_n, border_n));
+				if (border_len == 0.0)
+					continue;
+				for (auto& c : border_n)
+					c /= border_len;
+
+				Quadric border;
+				border.add_plane(border_n, -dot(border_n, _points[a]), BORDER_WEIGHT * dot(edge, edge));
+				_quadrics[a] += border;
+				_quadrics[b] += border;
+			}
+		}
+
+		for (size_t t = 0; t < _tri_alive.size(); ++t) {
+			if (!_tri_alive[t])
+				continue;
+			for (size_t i_corner = 0; i_corner < 3; ++i_corner)
+				queue_collapse(pos(t, i_corner), pos(t, (i_corner + 1) % 3));
+		}
+	}
+
+	SimplifiedIndices simplify(size_t target_triangle_count, float max_error) {
+		double const max_cost = double(max_error) * double(max_error);
+		double worst_cost = 0.0;
+
+		while (_alive_count > target_triangle_count && !_queue.empty()) {
+			Collapse c = _queue.top();
+			_queue.pop();
+
+			if (!_pos_alive[c.from] || !_pos_alive[c.to] || _version[c.from] != c.from_version || _version[c.to] != c.to_version)
+				continue;
+			// the queue is ordered by cost, all valid collapses left cost more
+			if (c.cost > max_cost)
+				break;
+
+			if (collapse(c.from, c.to))
+				worst_cost = std::max(worst_cost, c.cost);
+		}
+
+		SimplifiedIndices result;
+		result.error = float(std::sqrt(worst_cost));
+		for (size_t t = 0; t < _tri_alive.size(); ++t) {
+			if (_tri_alive[t])
+				result.indices.insert(result.indices.end(), _tris.begin() + 3 * t, _tris.begin() + 3 * t + 3);
+		}
+		return result;
+	}
+
+private:
+	uint32_t pos(size_t tri, size_t corner) const {
+		return _pos_of[_tris[3 * tri + corner]];
+	}
+
+	bool has_pos(size_t tri, uint32_t p) const {
+		return pos(tri, 0) == p || pos(tri, 1) == p || pos(tri, 2) == p;
+	}
+
+	Vec3 normal(size_t tri) const {
+		auto const& p0 = _points[pos(tri, 0)];
+		return cross(sub(_points[pos(tri, 1)], p0), sub(_points[pos(tri, 2)], p0));
+	}
+
+	/// Drops dead triangles from the list of a position and returns it.
+	std::vector<uint32_t>& alive_tris(uint32_t p) {
+		auto& tris = _pos_tris[p];
+		tris.erase(std::remove_if(tris.begin(), tris.end(), [this] (uint32_t t) { return !_tri_alive[t]; }), tris.end());
+		return tris;
+	}
+
+	size_t edge_triangles(uint32_t a, uint32_t b) {
+		auto const& tris = alive_tris(a);
+		return std::count_if(tris.begin(), tris.end(), [this, b] (uint32_t t) { return has_pos(t, b); });
+	}
+
+	/// Counts how many alive triangles around the position use each neighbouring position, sorted by position.
+	std::vector<std::pair<uint32_t, size_t>> neighbours(uint32_t p) {
+		std::vector<uint32_t> around;
+		for (auto t : alive_tris(p)) {
+			for (size_t i_corner = 0; i_corner < 3; ++i_corner) {
+				if (pos(t, i_corner) != p)
+					around.push_back(pos(t, i_corner));
+			}
+		}
+		std::sort(around.begin(), around.end());
+
+		std::vector<std::pair<uint32_t, size_t>> result;
+		for (auto n : around) {
+			if (!result.empty() && result.back().first == n)
+				++result.back().second;
+			else
+				result.emplace_back(n, 1);
+		}
+		return result;
+	}
+
+	void queue_collapse(uint32_t from, uint32_t to) {
+		Quadric q = _quadrics[from];
+		q += _quadrics[to];
+		_queue.push(Collapse{ q.error(_points[to]), from, to, _version[from], _version[to] });
+	}
+
+	static double attribute_distance(psi_rndr::VertexData const& a, psi_rndr::VertexData const& b) {
+		double d = 0.0;
+		for (size_t i = 0; i < 3; ++i)
+			d += (a.norm[i] - b.norm[i]) * (a.norm[i] - b.norm[i]);
+		for (size_t i = 0; i < 2; ++i)
+			d += (a.uv[i] - b.uv[i]) * (a.uv[i] - b.uv[i]);
+		return d;
+	}
+
+	/// Moves position a onto position b, unless that would fold the surface or change its topology.
+	/// @returns whether it did
+	bool collapse(uint32_t a, uint32_t b) {
+		auto around_a = alive_tris(a);
+
+		// the neighbours of both must be exactly the third positions of the triangles on the edge,
+		// or the collapse would pinch the surface, and an open border must not be pulled inwards
+		auto neighbours_a = neighbours(a);
+		auto neighbours_b = neighbours(b);
+		size_t edge_tris = 0;
+		for (auto t : around_a)
+			edge_tris += has_pos(t, b);
+		if (edge_tris == 0)
+			return false;
+
+		bool a_on_border = false;
+		size_t common = 0;
+		auto it_b = neighbours_b.begin();
+		for (auto const& n : neighbours_a) {
+			a_on_border = a_on_border || n.second == 1;
+			while (it_b != neighbours_b.end() && it_b->first < n.first)
+				++it_b;
+			if (it_b != neighbours_b.end() && it_b->first == n.first)
+				++common;
+		}
+		if (common != edge_tris || (a_on_border && edge_tris != 1))
+			return false;
+
+		// triangles which stay must not turn too far
+		for (auto t : around_a) {
+			if (has_pos(t, b))
+				continue;
+
+			Vec3 before = normal(t);
+			Vec3 const saved = _points[a];
+			_points[a] = _points[b];
+			Vec3 after = normal(t);
+			_points[a] = saved;
+
+			double const lens = std::sqrt(dot(before, before) * dot(after, after));
+			if (lens == 0.0 || dot(before, after) < MIN_NORMAL_COS * lens)
+				return false;
+		}
+
+		// each wedge of a becomes the wedge of b it shares a triangle with, or otherwise the closest one
+		std::vector<std::pair<uint32_t, uint32_t>> wedge_map;
+		for (auto v : _wedges[a]) {
+			uint32_t target = UINT32_MAX;
+			for (auto t : around_a) {
+				for (size_t i_corner = 0; i_corner < 3; ++i_corner) {
+					if (_tris[3 * t + i_corner] != v)
+						continue;
+					for (size_t i_other = 0; i_other < 3; ++i_other) {
+						uint32_t w = _tris[3 * t + i_other];
+						if (_pos_of[w] != b)
+							continue;
+						// a seam which continues differently across the edge would tear
+						if (target != UINT32_MAX && target != w)
+							return false;
+						target = w;
+					}
+				}
+			}
+
+			if (target == UINT32_MAX) {
+				double best = INFINITY;
+				for (auto w : _wedges[b]) {
+					double d = attribute_distance(_vertices[v], _vertices[w]);
+					if (d < best) {
+						best = d;
+						target = w;
+					}
+				}
+			}
+			wedge_map.emplace_back(v, target);
+		}
+
+		for (auto t : around_a) {
+			if (has_pos(t, b)) {
+				_tri_alive[t] = false;
+				--_alive_count;
+				continue;
+			}
+
+			for (size_t i_corner = 0; i_corner < 3; ++i_corner) {
+				auto& v = _tris[3 * t + i_corner];
+				if (_pos_of[v] != a)
+					continue;
+				v = std::find_if(wedge_map.begin(), wedge_map.end(), [v] (std::pair<uint32_t, uint32_t> const& e) { return e.first == v; })->second;
+			}
+			_pos_tris[b].push_back(t);
+		}
+
+		_pos_alive[a] = false;
+		_pos_tris[a].clear();
+		_quadrics[b] += _quadrics[a];
+		++_version[b];
+
+		for (auto const& n : neighbours(b)) {
+			queue_collapse(b, n.first);
+			queue_collapse(n.first, b);
+		}
+
+		return true;
+	}
+
+	std::vector<psi_rndr::VertexData> const& _vertices;
+	/// Vertex indices of the triangles, rewritten by collapses
+	std::vector<uint32_t> _tris;
+	std::vector<bool> _tri_alive;
+	size_t _alive_count = 0;
+
+	/// Position of each vertex
+	std::vector<uint32_t> _pos_of;
+	std::vector<Vec3> _points;
+	std::vector<std::vector<uint32_t>> _wedges;
+	/// Triangles using each position, including ones which died since
+	std::vector<std::vector<uint32_t>> _pos_tris;
+	std::vector<bool> _pos_alive;
+	/// Bumped whenever a collapse changes the quadric of a position, invalidating its queued collapses
+	std::vector<uint32_t> _version;
+	std::vector<Quadric> _quadrics;
+
+	std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> _queue;
+};
+} // namespace
+
+SimplifiedIndices simplify_mesh(std::vector<uint32_t> const& indices, std::vector<psi_rndr::VertexData> const& vertices, size_t target_triangle_count, float max_error) {
+	return Simplifier(indices, vertices).simplify(target_triangle_count, max_error);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <resource.hpp>
+
+
+/// Triangles of a simplified mesh, which index its original vertices.
+struct SimplifiedIndices {
+	std::vector<uint32_t> indices;
+	/// How far the simplified surface strays from the original one in model space, at most
+	float error;
+};
+
+/// Simplifies a triangle mesh by collapsing edges in the order of their quadric error, after Garland and Heckbert
+/// "Surface Simplification Using Quadric Error Metrics". Vertices are only ever collapsed onto other vertices,
+/// so every detail level can index the same vertices. Open borders stay in place and vertices which only split
+/// the normals or UVs of one position move together.
+/// @param[in] target_triangle_count stops once there are no more triangles than this
+/// @param[in] max_error stops before a collapse would move the surface by more than this
+SimplifiedIndices simplify_mesh(std::vector<uint32_t> const& indices, std::vector<psi_rndr::VertexData> const& vertices, size_t target_triangle_count, float max_error);
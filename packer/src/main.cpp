@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <zlib.h>
+
+#include <util/archive.hpp>
+#include <util/hash.hpp>
+
+
+/// A file on its way into the archive.
+struct Blob {
+	std::string name;
+	fs::path file;
+	psi_util::ArchiveEntry entry;
+};
+
+static uint64_t align_up(uint64_t n) {
+	return (n + psi_util::ARCHIVE_ALIGNMENT - 1) / psi_util::ARCHIVE_ALIGNMENT * psi_util::ARCHIVE_ALIGNMENT;
+}
+
+static std::vector<char> read_file(fs::path const& file) {
+	std::ifstream in(file.string(), std::ios::in | std::ios::binary);
+	if (!in.good())
+		throw std::runtime_error("Could not read file " + file.string() + ".");
+	return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+/// Collects every regular file below the directory, named by its path relative to it.
+static std::vector<Blob> collect_blobs(fs::path const& in_dir, fs::path const& out_file) {
+	std::vector<Blob> blobs;
+	std::unordered_map<uint64_t, std::string> names;
+
+	for (fs::recursive_directory_iterator it(in_dir), end; it != end; ++it) {
+		if (!fs::is_regular_file(it->path()) || fs::equivalent(it->path(), out_file))
+			continue;
+
+		// names are what the game asks for, e.g. "meshes/cone.msh"
+		Blob blob;
+		blob.name = fs::relative(it->path(), in_dir).generic_string();
+		blob.file = it->path();
+		std::memset(&blob.entry, 0, sizeof(blob.entry));
+		blob.entry.name_hash = psi_util::fnv1a_64(blob.name);
+
+		auto existing = names.emplace(blob.entry.name_hash, blob.name);
+		if (!existing.second)
+			throw std::runtime_error("Names " + existing.first->second + " and " + blob.name + " have the same hash, please rename one.");
+
+		blobs.push_back(std::move(blob));
+	}
+
+	// the game binary searches the index
+	std::sort(blobs.begin(), blobs.end(), [] (Blob const& a, Blob const& b) {
+		return a.entry.name_hash < b.entry.name_hash;
+	});
+	return blobs;
+}
+
+void pack(fs::path const& in_dir, fs::path const& out_file, bool compress) {
+	auto blobs = collect_blobs(in_dir, out_file);
+
+	// the game maps archives, so the old one is replaced by rename() once the new one is complete
+	// instead of being rewritten in place under a running game
+	fs::path tmp_file = out_file;
+	tmp_file += ".tmp";
+
+	std::ofstream out(tmp_file.string(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out.good())
+		throw std::runtime_error("Could not write to file " + tmp_file.string() + ".");
+
+	psi_util::ArchiveHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, psi_util::ARCHIVE_MAGIC, sizeof(header.magic));
+	header.version = psi_util::ARCHIVE_VERSION;
+	header.entry_count = uint32_t(blobs.size());
+	header.index_offset = sizeof(psi_util::ArchiveHeader);
+
+	// blobs follow the index, each on its own page; the index is written last, once offsets are known
+	uint64_t offset = align_up(header.index_offset + blobs.size() * sizeof(psi_util::ArchiveEntry));
+	uint64_t packed_bytes = 0;
+	for (auto& blob : blobs) {
+		auto data = read_file(blob.file);
+		blob.entry.offset = offset;
+		blob.entry.size = data.size();
+		blob.entry.compression = psi_util::ArchiveCompression::NONE;
+
+		if (compress && !data.empty()) {
+			std::vector<char> packed(compressBound(uLong(data.size())));
+			uLongf packed_size = uLongf(packed.size());
+			int res = compress2(reinterpret_cast<Bytef*>(packed.data()), &packed_size,
+				reinterpret_cast<Bytef const*>(data.data()), uLong(data.size()), Z_BEST_COMPRESSION);
+
+			// already compressed formats like .png barely shrink, decompressing them would be wasted time
+			if (res == Z_OK && packed_size <= data.size() / 10 * 9) {
+				packed.resize(packed_size);
+				data = std::move(packed);
+				blob.entry.compression = psi_util::ArchiveCompression::ZLIB;
+			}
+		}
+		blob.entry.stored_size = data.size();
+
+		out.seekp(std::streamoff(offset));
+		out.write(data.data(), std::streamsize(data.size()));
+		offset = align_up(offset + data.size());
+		packed_bytes += data.size();
+
+		std::cout
+			<< "Packed " << blob.name << " (" << blob.entry.size << " bytes"
+			<< (blob.entry.compression == psi_util::ArchiveCompression::ZLIB ? ", compressed to " + std::to_string(blob.entry.stored_size) : std::string())
+			<< ")" << std::endl;
+	}
+
+	// pad the last blob to a whole page, so it can be read with O_DIRECT
+	if (offset > 0) {
+		out.seekp(std::streamoff(offset - 1));
+		out.put('\0');
+	}
+
+	out.seekp(0);
+	out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+	for (auto const& blob : blobs) {
+		out.write(reinterpret_cast<char const*>(&blob.entry), sizeof(blob.entry));
+	}
+
+	out.close();
+	if (!out.good())
+		throw std::runtime_error("Could not write to file " + tmp_file.string() + ".");
+	fs::rename(tmp_file, out_file);
+
+	std::cout << "Packed " << blobs.size() << " files, " << packed_bytes << " bytes of data." << std::endl;
+}
+
+struct Environment {
+	fs::path in_dir;
+	fs::path out_file;
+	bool compress;
+};
+
+constexpr int NO_EXIT = 1337;
+/// Parses the given command line arguments into the specified environment.
+/// @return exit code if program should exit, NO_EXIT otherwise
+int parse_command_line(int argc, char** argv, Environment& env) {
+	po::options_description options("Options");
+	options.add_options()
+		("help,h", "Display this help message and quit.")
+		("version,v", "Display the program version and quit.")
+		("input-directory,i", po::value<fs::path>()->default_value("./resources/"), "Set the directory whose files are packed.")
+		("output-file,o", po::value<fs::path>()->default_value("./resources/resources.pak"), "Set the archive file to write.")
+		("compress,c", "Compress files with zlib where it saves at least a tenth of their size.")
+	;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, options), vm);
+		po::notify(vm);
+	}
+	catch (std::exception const& e) {
+		std::cout
+			<< "Invalid option:\n"
+			<< e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (vm.count("help")) {
+		std::cout
+			<< "----- Psi Packer 1.0.0 -----\n"
+			<< "Copyright (C) 2016 Wojciech Nawrocki\n"
+			<< "Packs a directory of resources into a single indexed\n"
+			<< "archive which the Psi Engine opens with one call.\n"
+			<< "\n"
+			<< options << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	if (vm.count("version")) {
+		std::cout << "1.0.0" << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	env.in_dir = vm["input-directory"].as<fs::path>();
+	if (!fs::is_directory(env.in_dir)) {
+		std::cout << "Invalid input directory " << env.in_dir << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	env.out_file = vm["output-file"].as<fs::path>();
+	env.compress = vm.count("compress");
+
+	return NO_EXIT;
+}
+
+int main(int argc, char** argv) {
+	Environment env;
+	auto code = parse_command_line(argc, argv, env);
+	if (code != NO_EXIT)
+		return code;
+
+	try {
+		pack(env.in_dir, env.out_file, env.compress);
+	}
+	catch (std::exception const& e) {
+		std::cout
+			<< "An error occurred while packing "
+			<< env.in_dir
+			<< ":\n"
+			<< e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "Packing completed successfully." << std::endl;
+	return EXIT_SUCCESS;
+}
@@ -23,6 +23,7 @@
 #include "rendering/gl/gl.hpp"
 #include "rendering/gl/helper.hpp"
 #include "rendering/camera.hpp"
+#include "rendering/prefetch.hpp"
 #include "rendering/resource.hpp"
 #include "scene/default_components.hpp"
 #include "service/resource.hpp"
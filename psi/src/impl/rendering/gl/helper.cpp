@@ -20,6 +20,8 @@
 
 #include "helper.hpp"
 
+#include <cstddef>
+#include <cstring>
 #include <regex>
 
 #include "../../../util/assert.hpp"
@@ -27,7 +29,10 @@
 
 
 // -- MeshBuffer --
-psi_gl::MeshBuffer::MeshBuffer(psi_rndr::MeshData const& mesh) {
+psi_gl::MeshBuffer::MeshBuffer(psi_rndr::MeshData const& mesh)
+	: MeshBuffer(psi_rndr::view_mesh(mesh)) {}
+
+psi_gl::MeshBuffer::MeshBuffer(psi_rndr::MeshView const& mesh) {
 	gl::GenVertexArrays(1, &_vao);
 	gl::GenBuffers(1, &_vbo);
 	gl::GenBuffers(1, &_ebo);
@@ -39,21 +44,35 @@ psi_gl::MeshBuffer::MeshBuffer(psi_rndr::MeshData const& mesh) {
 	gl::BindBuffer(gl::ARRAY_BUFFER, _vbo);
 
 	// describe how vertices are laid out in vert_memory
-	gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::POS), 3, gl::FLOAT, false, psi_rndr::VertexData::FLOATS_PER_VERTEX * sizeof(float), nullptr);
-	gl::EnableVertexAttribArray(GLuint(ShaderVertexAttrib::POS));
+	GLsizei const stride = GLsizei(psi_rndr::vertex_size(mesh.layout));
+	switch (mesh.layout) {
+		case psi_rndr::VertexLayout::FLOAT:
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::POS), 3, gl::FLOAT, false, stride, reinterpret_cast<void*>(offsetof(psi_rndr::VertexData, pos)));
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::NORM), 3, gl::FLOAT, false, stride, reinterpret_cast<void*>(offsetof(psi_rndr::VertexData, norm)));
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::TAN), 3, gl::FLOAT, false, stride, reinterpret_cast<void*>(offsetof(psi_rndr::VertexData, tan)));
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::UV), 2, gl::FLOAT, false, stride, reinterpret_cast<void*>(offsetof(psi_rndr::VertexData, uv)));
+			break;
+
+		case psi_rndr::VertexLayout::QUANTIZED:
+			// positions become fractions of the bounding box and octahedral normals and tangents become
+			// [-1, 1] pairs, the vertex shaders decode both, see bind_vertex_layout
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::POS), 3, gl::UNSIGNED_SHORT, true, stride, reinterpret_cast<void*>(offsetof(psi_rndr::QuantizedVertexData, pos)));
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::NORM), 2, gl::SHORT, true, stride, reinterpret_cast<void*>(offsetof(psi_rndr::QuantizedVertexData, norm)));
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::TAN), 2, gl::SHORT, true, stride, reinterpret_cast<void*>(offsetof(psi_rndr::QuantizedVertexData, tan)));
+			gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::UV), 2, gl::HALF_FLOAT, false, stride, reinterpret_cast<void*>(offsetof(psi_rndr::QuantizedVertexData, uv)));
+			break;
 
-	gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::NORM), 3, gl::FLOAT, false, psi_rndr::VertexData::FLOATS_PER_VERTEX * sizeof(float), reinterpret_cast<void*>(3 * sizeof(float)));
+		default:
+			ASSERT(false);
+	}
+	gl::EnableVertexAttribArray(GLuint(ShaderVertexAttrib::POS));
 	gl::EnableVertexAttribArray(GLuint(ShaderVertexAttrib::NORM));
-
-	gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::TAN), 3, gl::FLOAT, false, psi_rndr::VertexData::FLOATS_PER_VERTEX * sizeof(float), reinterpret_cast<void*>(6 * sizeof(float)));
 	gl::EnableVertexAttribArray(GLuint(ShaderVertexAttrib::TAN));
-
-	gl::VertexAttribPointer(GLuint(ShaderVertexAttrib::UV), 2, gl::FLOAT, false, psi_rndr::VertexData::FLOATS_PER_VERTEX * sizeof(float), reinterpret_cast<void*>(9 * sizeof(float)));
 	gl::EnableVertexAttribArray(GLuint(ShaderVertexAttrib::UV));
 
 	// buffer sizes
-	size_t const VERTICES_SIZE = mesh.vertices.size() * psi_rndr::VertexData::FLOATS_PER_VERTEX * sizeof(float);
-	size_t const INDICES_SIZE = mesh.indices.size() * sizeof(uint32_t);
+	size_t const VERTICES_SIZE = mesh.vertex_count * psi_rndr::vertex_size(mesh.layout);
+	size_t const INDICES_SIZE = mesh.index_count * sizeof(uint32_t);
 
 	// create and initialize data storage
 	// TODO is gl::DYNAMIC_STORAGE_BIT needed here?
@@ -61,32 +80,23 @@ psi_gl::MeshBuffer::MeshBuffer(psi_rndr::MeshData const& mesh) {
 	gl::BufferStorage(gl::ELEMENT_ARRAY_BUFFER, INDICES_SIZE, nullptr, gl::DYNAMIC_STORAGE_BIT | gl::MAP_WRITE_BIT | gl::MAP_PERSISTENT_BIT | gl::MAP_COHERENT_BIT);
 
 	// upload vertices
-	float* vert_mem = static_cast<float*>(gl::MapBufferRange(gl::ARRAY_BUFFER, 0, VERTICES_SIZE, gl::MAP_WRITE_BIT | gl::MAP_PERSISTENT_BIT | gl::MAP_COHERENT_BIT | gl::MAP_INVALIDATE_BUFFER_BIT));
-
-	for (size_t i_vert = 0; i_vert < mesh.vertices.size(); ++i_vert) {
-		auto const& vert = mesh.vertices[i_vert];
-		size_t id = i_vert * psi_rndr::VertexData::FLOATS_PER_VERTEX;
-		vert_mem[id] = vert.pos[0];
-		vert_mem[id + 1] = vert.pos[1];
-		vert_mem[id + 2] = vert.pos[2];
-		vert_mem[id + 3] = vert.norm[0];
-		vert_mem[id + 4] = vert.norm[1];
-		vert_mem[id + 5] = vert.norm[2];
-		vert_mem[id + 6] = vert.tan[0];
-		vert_mem[id + 7] = vert.tan[1];
-		vert_mem[id + 8] = vert.tan[2];
-		vert_mem[id + 9] = vert.uv[0];
-		vert_mem[id + 10] = vert.uv[1];
-	}
+	// vertices are laid out like the buffer, so they are copied as they are,
+	// straight from the mapped file if the mesh is mapped
+	void* vert_mem = gl::MapBufferRange(gl::ARRAY_BUFFER, 0, VERTICES_SIZE, gl::MAP_WRITE_BIT | gl::MAP_PERSISTENT_BIT | gl::MAP_COHERENT_BIT | gl::MAP_INVALIDATE_BUFFER_BIT);
+	std::memcpy(vert_mem, mesh.vertices, VERTICES_SIZE);
 
 	// upload indices
-	uint32_t* index_mem = static_cast<uint32_t*>(gl::MapBufferRange(gl::ELEMENT_ARRAY_BUFFER, 0, INDICES_SIZE, gl::MAP_WRITE_BIT | gl::MAP_PERSISTENT_BIT | gl::MAP_COHERENT_BIT | gl::MAP_INVALIDATE_BUFFER_BIT));
+	void* index_mem = gl::MapBufferRange(gl::ELEMENT_ARRAY_BUFFER, 0, INDICES_SIZE, gl::MAP_WRITE_BIT | gl::MAP_PERSISTENT_BIT | gl::MAP_COHERENT_BIT | gl::MAP_INVALIDATE_BUFFER_BIT);
+	std::memcpy(index_mem, mesh.indices, INDICES_SIZE);
 
-	for (size_t i_ind = 0; i_ind < mesh.indices.size(); ++i_ind) {
-		index_mem[i_ind] = mesh.indices[i_ind];
+	_levels = mesh.levels;
+	if (_levels.empty()) {
+		_levels.emplace_back();
+		_levels.back().index_count = mesh.index_count;
 	}
-
-	_index_count = GLuint(mesh.indices.size());
+	_layout = mesh.layout;
+	_min_pos = mesh.min_pos;
+	_max_pos = mesh.max_pos;
 }
 
 psi_gl::MeshBuffer::~MeshBuffer() {
@@ -95,9 +105,37 @@ psi_gl::MeshBuffer::~MeshBuffer() {
 	//gl::DeleteVertexArrays(1, &m_VAO);
 }
 
-void psi_gl::MeshBuffer::draw(GLenum primitives) {
+void psi_gl::MeshBuffer::bind_vertex_layout(Shader const& sh) const {
+	auto layout = sh.unifs.find(UniformMapping::MESH_VERTEX_LAYOUT);
+	if (layout != sh.unifs.end())
+		gl::Uniform1ui(layout->second, GLuint(_layout));
+
+	auto min = sh.unifs.find(UniformMapping::MESH_MIN_POS);
+	if (min != sh.unifs.end())
+		gl::Uniform3fv(min->second, 1, _min_pos.data());
+
+	auto max = sh.unifs.find(UniformMapping::MESH_MAX_POS);
+	if (max != sh.unifs.end())
+		gl::Uniform3fv(max->second, 1, _max_pos.data());
+}
+
+void psi_gl::MeshBuffer::draw(GLenum primitives, size_t level) {
+	ASSERT(level < _levels.size());
+	auto const& lvl = _levels[level];
+
 	gl::BindVertexArray(_vao);
-	gl::DrawElements(primitives, _index_count, gl::UNSIGNED_INT, nullptr);
+	gl::DrawElements(primitives, GLsizei(lvl.index_count), gl::UNSIGNED_INT, reinterpret_cast<void*>(lvl.first_index * sizeof(uint32_t)));
+}
+
+std::vector<psi_rndr::MeshLevel> const& psi_gl::MeshBuffer::levels() const {
+	return _levels;
+}
+
+void psi_gl::MeshBuffer::free() {
+	gl::DeleteVertexArrays(1, &_vao);
+	gl::DeleteBuffers(1, &_vbo);
+	gl::DeleteBuffers(1, &_ebo);
+	_levels.clear();
 }
 
 // -- MultipleRenderTargetFramebuffer --
@@ -244,6 +282,7 @@ inline static psi_gl::UniformMapping uniform_mapping_from_name(std::string const
 	UMAP(ACTIVE_SPOT_LIGHTS)
 	UMAP(MESH_MIN_POS)
 	UMAP(MESH_MAX_POS)
+	UMAP(MESH_VERTEX_LAYOUT)
 
 	throw std::runtime_error("Tried to resolve invalid uniform mapping " + name + ".");
 }
@@ -278,6 +317,7 @@ inline static std::string uniform_mapping_glsl_type(psi_gl::UniformMapping map)
 
 	case psi_gl::UniformMapping::ACTIVE_POINT_LIGHTS:
 	case psi_gl::UniformMapping::ACTIVE_SPOT_LIGHTS:
+	case psi_gl::UniformMapping::MESH_VERTEX_LAYOUT:
 		return "uint";
 
 	default:
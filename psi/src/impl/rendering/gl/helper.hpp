@@ -31,19 +31,38 @@
 
 
 namespace psi_gl {
+struct Shader;
+
 class MeshBuffer {
 public:
 	explicit MeshBuffer(psi_rndr::MeshData const&);
+	explicit MeshBuffer(psi_rndr::MeshView const&);
 	~MeshBuffer();
 
-	void draw(GLenum primitives);
+	/// Sets the uniforms which the shader, if it maps them, needs to decode this mesh's vertex layout.
+	/// The shader must be in use.
+	void bind_vertex_layout(Shader const&) const;
+
+	/// Draws the given detail level, see psi_rndr::MeshData::levels.
+	void draw(GLenum primitives, size_t level = 0);
+
+	/// The detail levels of the mesh, at least one.
+	std::vector<psi_rndr::MeshLevel> const& levels() const;
+
+	/// Deletes the GL objects. Not done by the destructor, since copies share them.
+	void free();
 
 private:
 	GLuint _vbo;
 	GLuint _ebo;
 	GLuint _vao;
 
-	uint32_t _index_count;
+	std::vector<psi_rndr::MeshLevel> _levels;
+
+	psi_rndr::VertexLayout _layout;
+	/// The bounding box, which quantized positions are relative to
+	std::array<float, 3> _min_pos;
+	std::array<float, 3> _max_pos;
 };
 
 struct FramebufferRenderTargetCreationInfo {
@@ -117,6 +136,7 @@ HASHABLE_ENUM_CLASS_IN_NAMESPACE(UniformMapping, uint32_t, psi_gl) {
 	ACTIVE_SPOT_LIGHTS,
 	MESH_MIN_POS,
 	MESH_MAX_POS,
+	MESH_VERTEX_LAYOUT,
 };
 
 /// A memory buffer that a uniform block in a shader may be attached to.
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "prefetch.hpp"
+
+#include <cmath>
+
+
+psi_rndr::CameraPrefetcher::CameraPrefetcher(PrefetchArgs const& args)
+	: _args(args) {}
+
+void psi_rndr::CameraPrefetcher::sample_camera(Eigen::Vector3f const& position, Clock::time_point now) {
+	if (!_has_sample) {
+		_position = position;
+		_sampled = now;
+		_has_sample = true;
+		return;
+	}
+
+	float dt = std::chrono::duration<float>(now - _sampled).count();
+	// frames can be shorter than the clock's resolution
+	if (dt <= 0.0f)
+		return;
+
+	// exponential smoothing with a time constant of a quarter second, independent of the frame rate,
+	// so that a single jittery frame does not send the prediction flying
+	Eigen::Vector3f measured = (position - _position) / dt;
+	float alpha = 1.0f - std::exp(-dt / 0.25f);
+	_velocity += alpha * (measured - _velocity);
+
+	_position = position;
+	_sampled = now;
+}
+
+Eigen::Vector3f const& psi_rndr::CameraPrefetcher::velocity() const {
+	return _velocity;
+}
+
+boost::optional<float> psi_rndr::CameraPrefetcher::time_until_visible(Eigen::Vector3f const& center, float radius) const {
+	// the earliest t in [0, horizon] at which |position + velocity * t - center| <= view_distance + radius
+	Eigen::Vector3f d = _position - center;
+	float reach = _args.view_distance + radius;
+
+	float c = d.squaredNorm() - reach * reach;
+	if (c <= 0.0f)
+		return 0.0f;
+
+	float a = _velocity.squaredNorm();
+	float b = 2.0f * d.dot(_velocity);
+	// standing still or moving away
+	if (a == 0.0f || b >= 0.0f)
+		return boost::none;
+
+	float disc = b * b - 4.0f * a * c;
+	if (disc < 0.0f)
+		return boost::none;
+
+	float t = (-b - std::sqrt(disc)) / (2.0f * a);
+	if (t > _args.horizon)
+		return boost::none;
+	return t;
+}
+
+bool psi_rndr::CameraPrefetcher::is_visible(float distance, float radius) const {
+	return distance <= _args.view_distance + radius;
+}
+
+psi_rndr::PrefetchArgs const& psi_rndr::CameraPrefetcher::args() const {
+	return _args;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+#include <boost/optional.hpp>
+#include <eigen3/Eigen/Core>
+
+#include "../../marker/thread_safety.hpp"
+
+
+namespace psi_rndr {
+struct PrefetchArgs {
+	/// How far ahead the camera's motion is extrapolated, in seconds.
+	float horizon = 2.0f;
+	/// Models whose bounds come this close to the camera are considered visible.
+	float view_distance = 60.0f;
+	/// No more prefetches start while the resource service holds more bytes than this, 0 for no limit.
+	size_t memory_ceiling = 0;
+	/// Maximum number of prefetched resources loading at once, so that prefetches never flood the loaders.
+	size_t max_in_flight = 32;
+	/// Priority of prefetched loads, below the loads of visible models.
+	float priority = -1.0f;
+};
+
+/// Predicts which models become visible soon from the camera's motion, so that their resources can be
+/// loaded before they are. The camera is assumed to keep its velocity, smoothed over the last few frames,
+/// and models are visible within the view distance in any direction, since the camera turns faster than it moves.
+class CameraPrefetcher : psi_mark::NonThreadsafe {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	explicit CameraPrefetcher(PrefetchArgs const& args);
+
+	/// Records the camera's position, call once a frame.
+	void sample_camera(Eigen::Vector3f const& position, Clock::time_point now = Clock::now());
+
+	/// @return the camera's smoothed velocity in units per second
+	Eigen::Vector3f const& velocity() const;
+
+	/// Returns in how many seconds a model comes within the view distance of the camera on its predicted path.
+	/// @param[in] center the center of the model's bounding sphere
+	/// @param[in] radius the radius of the model's bounding sphere
+	/// @return 0 if it is visible already, nothing if it does not become visible within the horizon
+	boost::optional<float> time_until_visible(Eigen::Vector3f const& center, float radius) const;
+
+	/// @return whether a model at the given distance from the camera is visible now
+	bool is_visible(float distance, float radius) const;
+
+	PrefetchArgs const& args() const;
+
+private:
+	PrefetchArgs const _args;
+
+	Eigen::Vector3f _position = Eigen::Vector3f::Zero();
+	Eigen::Vector3f _velocity = Eigen::Vector3f::Zero();
+	Clock::time_point _sampled;
+	bool _has_sample = false;
+};
+} // namespace psi_rndr
@@ -20,78 +20,364 @@
 
 #include "resource.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
 #include <FreeImagePlus.h>
 
 #include <openssl/md5.h>
 
 #include "../../util/file.hpp"
+#include "../../util/hash.hpp"
+#include "../../util/assert.hpp"
 namespace fs = boost::filesystem;
 #include "../../log/log.hpp"
 
 
 psi_rndr::MeshData psi_rndr::load_mesh(fs::path const& file) {
 	// might throw, pass exception if it does
-	auto data = psi_util::load_binary(file);
+	return parse_mesh(psi_util::load_binary(file));
+}
 
-	MeshData mesh;
+/// The first 8 bytes of a .msh file of version 2 or later. Version 1 files start with the vertex count instead.
+static char const MSH_MAGIC[8] = { 'P', 'S', 'I', 'M', 'E', 'S', 'H', '\0' };
+
+/// Returns the size of the header of a .msh file including its hash, which depends on the version
+/// and the number of detail levels, or 0 if the file is too short to tell.
+static size_t msh_header_size(char const* data, size_t size) {
+	if (size < sizeof(MSH_MAGIC) + 4 || std::memcmp(data, MSH_MAGIC, sizeof(MSH_MAGIC)) != 0)
+		return 40 + 16;
+
+	uint32_t version;
+	std::memcpy(&version, data + sizeof(MSH_MAGIC), sizeof(version));
+	if (version < 3)
+		return 56 + 16;
+
+	// the level count is not checked yet, so it is only trusted as far as the file is long
+	if (size < 64)
+		return 0;
+	uint32_t levels;
+	std::memcpy(&levels, data + 56, sizeof(levels));
+	if (levels > size / 24)
+		return 0;
+	return 64 + levels * 24 + 16;
+}
+
+/// Reads a value from possibly unaligned memory and advances the pointer past it.
+template <typename T>
+static T read_msh(char const*& ptr) {
+	T val;
+	std::memcpy(&val, ptr, sizeof(T));
+	ptr += sizeof(T);
+	return val;
+}
+
+/// Checks a mesh in the .msh format and points a view into it.
+/// @throws if the data is invalid
+static psi_rndr::MeshView view_msh(char const* data, size_t size) {
+	// header, first hash and second hash
+	size_t const head = msh_header_size(data, size);
+	if (head == 0 || size < head + 16)
+		throw std::runtime_error("Mesh file is truncated.");
+
+	psi_rndr::MeshView mesh;
 
 	MD5_CTX md5;
 	std::array<unsigned char, 16> md5_digest;
 
 	// read from Psi Mesh format
-	// calculate first 16 byte MD4 hash
-	char const* ptr = data.data();
+	// calculate first 16 byte MD5 hash of the header
 	MD5_Init(&md5);
-	MD5_Update(&md5, ptr, 40 * sizeof(char));
+	MD5_Update(&md5, data, head - 16);
 	MD5_Final(md5_digest.data(), &md5);
 
-	// read first 40 bytes
-	size_t verts = *reinterpret_cast<uint64_t const*>(ptr);
-	ptr += sizeof(uint64_t) / sizeof(char);
-	size_t inds = *reinterpret_cast<uint64_t const*>(ptr);
-	ptr += sizeof(uint64_t) / sizeof(char);
-	auto box_ptr  = reinterpret_cast<float const*>(ptr);
-	mesh.max_pos[0] = *(box_ptr++);
-	mesh.max_pos[1] = *(box_ptr++);
-	mesh.max_pos[2] = *(box_ptr++);
-	mesh.min_pos[0] = *(box_ptr++);
-	mesh.min_pos[1] = *(box_ptr++);
-	mesh.min_pos[2] = *(box_ptr++);
-	ptr = reinterpret_cast<char const*>(box_ptr);
-
-	// check first 16 byte MD5 hash
-	for (char const c : md5_digest) {
-		if (c != *(ptr++)) {
-			throw std::runtime_error("Mesh file MD5 Sum 1 is invalid.");
+	// check first 16 byte MD5 hash before trusting anything in the header
+	if (std::memcmp(md5_digest.data(), data + head - 16, 16) != 0)
+		throw std::runtime_error("Mesh file MD5 Sum 1 is invalid.");
+
+	char const* ptr = data;
+	uint32_t version = 1;
+	if (head != 40 + 16) {
+		ptr += sizeof(MSH_MAGIC);
+		version = read_msh<uint32_t>(ptr);
+		if (version != 2 && version != 3)
+			throw std::runtime_error("Mesh file version " + std::to_string(version) + " is not supported.");
+
+		auto layout = read_msh<uint32_t>(ptr);
+		if (layout > uint32_t(psi_rndr::VertexLayout::QUANTIZED))
+			throw std::runtime_error("Mesh file vertex layout " + std::to_string(layout) + " is not supported.");
+		mesh.layout = psi_rndr::VertexLayout(layout);
+	}
+
+	size_t verts = read_msh<uint64_t>(ptr);
+	size_t inds = read_msh<uint64_t>(ptr);
+	for (auto& c : mesh.max_pos)
+		c = read_msh<float>(ptr);
+	for (auto& c : mesh.min_pos)
+		c = read_msh<float>(ptr);
+
+	if (version >= 3) {
+		auto levels = read_msh<uint32_t>(ptr);
+		ptr += sizeof(uint32_t);
+		for (uint32_t i = 0; i < levels; ++i) {
+			psi_rndr::MeshLevel level;
+			level.first_index = read_msh<uint64_t>(ptr);
+			level.index_count = read_msh<uint64_t>(ptr);
+			level.error = read_msh<float>(ptr);
+			ptr += sizeof(uint32_t);
+
+			if (level.first_index > inds || level.index_count > inds - level.first_index)
+				throw std::runtime_error("Mesh file level " + std::to_string(i) + " is out of bounds.");
+			mesh.levels.push_back(level);
 		}
 	}
+	else {
+		psi_rndr::MeshLevel level;
+		level.index_count = inds;
+		mesh.levels.push_back(level);
+	}
+	ptr += 16;
+
+	// the counts are trusted now, but may still disagree with the file size
+	size_t const vert_size = psi_rndr::vertex_size(mesh.layout);
+	if (verts > size / vert_size || inds > size / sizeof(uint32_t)
+	 || size != head + verts * vert_size + inds * sizeof(uint32_t) + 16)
+		throw std::runtime_error("Mesh file size does not match its header.");
 
 	// calculate second 16 byte MD5 hash
 	MD5_Init(&md5);
-	MD5_Update(&md5, ptr, verts * sizeof(psi_rndr::VertexData) + inds * sizeof(uint32_t));
+	MD5_Update(&md5, ptr, verts * vert_size + inds * sizeof(uint32_t));
 	MD5_Final(md5_digest.data(), &md5);
 
-	// read the rest of the bytes
-	mesh.vertices.resize(verts);
-	memcpy(mesh.vertices.data(), ptr, verts * sizeof(psi_rndr::VertexData));
-	ptr += verts * sizeof(psi_rndr::VertexData);
-	mesh.indices.resize(inds);
-	memcpy(mesh.indices.data(), ptr, inds * sizeof(uint32_t));
+	// point into the rest of the bytes, both arrays are 4-byte aligned relative to the start
+	mesh.vertices = ptr;
+	mesh.vertex_count = verts;
+	ptr += verts * vert_size;
+	mesh.indices = reinterpret_cast<uint32_t const*>(ptr);
+	mesh.index_count = inds;
 	ptr += inds * sizeof(uint32_t);
 
 	// check second 16 byte MD5 hash
-	for (char const c : md5_digest) {
-		if (c != *(ptr++)) {
-			throw std::runtime_error("Mesh file MD5 Sum 2 is invalid.");
-		}
-	}
+	if (std::memcmp(md5_digest.data(), ptr, 16) != 0)
+		throw std::runtime_error("Mesh file MD5 Sum 2 is invalid.");
 
 	return mesh;
 }
 
+psi_rndr::MeshData psi_rndr::parse_mesh(std::vector<char> const& data) {
+	auto view = view_msh(data.data(), data.size());
+
+	MeshData mesh;
+	if (view.layout == VertexLayout::QUANTIZED) {
+		auto verts = static_cast<QuantizedVertexData const*>(view.vertices);
+		mesh.vertices.reserve(view.vertex_count);
+		for (size_t i = 0; i < view.vertex_count; ++i)
+			mesh.vertices.push_back(dequantize_vertex(verts[i], view.min_pos, view.max_pos));
+	}
+	else {
+		auto verts = static_cast<VertexData const*>(view.vertices);
+		mesh.vertices.assign(verts, verts + view.vertex_count);
+	}
+	mesh.indices.assign(view.indices, view.indices + view.index_count);
+	mesh.levels = view.levels;
+	mesh.mode = view.mode;
+	mesh.max_pos = view.max_pos;
+	mesh.min_pos = view.min_pos;
+	return mesh;
+}
+
+psi_rndr::MeshView psi_rndr::map_mesh(std::shared_ptr<psi_util::MappedFile const> const& file) {
+	return map_mesh(file, file->data(), file->size());
+}
+
+psi_rndr::MeshView psi_rndr::map_mesh(std::shared_ptr<void const> storage, char const* data, size_t size) {
+	auto view = view_msh(data, size);
+	view.storage = std::move(storage);
+	return view;
+}
+
+psi_rndr::MeshView psi_rndr::view_mesh(MeshData const& mesh) {
+	MeshView view;
+	view.vertices = mesh.vertices.data();
+	view.vertex_count = mesh.vertices.size();
+	view.indices = mesh.indices.data();
+	view.index_count = mesh.indices.size();
+	view.levels = mesh.levels;
+	view.mode = mesh.mode;
+	view.max_pos = mesh.max_pos;
+	view.min_pos = mesh.min_pos;
+	return view;
+}
+
+size_t psi_rndr::select_mesh_level(std::vector<MeshLevel> const& levels, float pixels_per_unit, float max_pixel_error) {
+	// levels get coarser and their errors larger
+	size_t level = 0;
+	for (size_t i = 1; i < levels.size(); ++i) {
+		if (levels[i].error * pixels_per_unit > max_pixel_error)
+			break;
+		level = i;
+	}
+	return level;
+}
+
+size_t psi_rndr::vertex_size(VertexLayout layout) {
+	static_assert(sizeof(VertexData) == 44, "VertexData must be tightly packed.");
+	static_assert(sizeof(QuantizedVertexData) == 20, "QuantizedVertexData must be tightly packed.");
+
+	switch (layout) {
+		case VertexLayout::FLOAT:
+			return sizeof(VertexData);
+
+		case VertexLayout::QUANTIZED:
+			return sizeof(QuantizedVertexData);
+
+		default:
+			ASSERT(false);
+	}
+}
+
+/// Converts a float to the nearest half-precision float, stored in its bits.
+static uint16_t float_to_half(float f) {
+	uint32_t x;
+	std::memcpy(&x, &f, sizeof(x));
+
+	uint32_t const sign = (x >> 16) & 0x8000;
+	uint32_t const exp_bits = (x >> 23) & 0xff;
+	uint32_t mant = x & 0x7fffff;
+
+	// infinity and NaN
+	if (exp_bits == 0xff)
+		return uint16_t(sign | 0x7c00 | (mant ? 0x200 : 0));
+
+	int32_t const exp = int32_t(exp_bits) - 127 + 15;
+	// too large, becomes infinity
+	if (exp >= 31)
+		return uint16_t(sign | 0x7c00);
+
+	// too small for a normal half, becomes subnormal or zero
+	if (exp <= 0) {
+		if (exp < -10)
+			return uint16_t(sign);
+
+		mant |= 0x800000;
+		uint32_t const shift = uint32_t(14 - exp);
+		uint32_t half = mant >> shift;
+		uint32_t const rem = mant & ((1u << shift) - 1);
+		uint32_t const mid = 1u << (shift - 1);
+		// round to nearest even
+		if (rem > mid || (rem == mid && (half & 1)))
+			++half;
+		return uint16_t(sign | half);
+	}
+
+	uint32_t half = sign | (uint32_t(exp) << 10) | (mant >> 13);
+	uint32_t const rem = mant & 0x1fff;
+	// round to nearest even, a carry into the exponent is still correct
+	if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+		++half;
+	return uint16_t(half);
+}
+
+/// Converts the bits of a half-precision float to a float.
+static float half_to_float(uint16_t h) {
+	uint32_t const sign = uint32_t(h & 0x8000) << 16;
+	uint32_t const exp = (h >> 10) & 0x1f;
+	uint32_t const mant = h & 0x3ff;
+
+	if (exp == 0) {
+		float f = std::ldexp(float(mant), -24);
+		return sign ? -f : f;
+	}
+
+	uint32_t x = exp == 31
+		? sign | 0x7f800000 | (mant << 13)
+		: sign | ((exp + 127 - 15) << 23) | (mant << 13);
+	float f;
+	std::memcpy(&f, &x, sizeof(f));
+	return f;
+}
+
+static int16_t float_to_snorm16(float f) {
+	return int16_t(std::lround(std::min(std::max(f, -1.0f), 1.0f) * 32767.0f));
+}
+
+static float snorm16_to_float(int16_t s) {
+	// like GL does, both -32768 and -32767 are -1
+	return std::max(float(s) / 32767.0f, -1.0f);
+}
+
+/// Projects a direction onto the octahedron and unfolds its lower half onto the plane.
+static std::array<int16_t, 2> encode_octahedral(std::array<float, 3> const& v) {
+	float const l1 = std::abs(v[0]) + std::abs(v[1]) + std::abs(v[2]);
+	// degenerate vectors, e.g. tangents of meshes without texture coordinates
+	if (!(l1 > 0.0f) || !std::isfinite(l1))
+		return {{ 0, 0 }};
+
+	float x = v[0] / l1;
+	float y = v[1] / l1;
+	if (v[2] < 0.0f) {
+		float const fold_x = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		float const fold_y = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = fold_x;
+		y = fold_y;
+	}
+
+	return {{ float_to_snorm16(x), float_to_snorm16(y) }};
+}
+
+/// Inverse of encode_octahedral, matches oct_decode in the vertex shaders.
+static std::array<float, 3> decode_octahedral(std::array<int16_t, 2> const& e) {
+	std::array<float, 3> v = {{ snorm16_to_float(e[0]), snorm16_to_float(e[1]), 0.0f }};
+	v[2] = 1.0f - std::abs(v[0]) - std::abs(v[1]);
+	float const t = std::max(-v[2], 0.0f);
+	v[0] += v[0] >= 0.0f ? -t : t;
+	v[1] += v[1] >= 0.0f ? -t : t;
+
+	float const len = std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	for (auto& c : v)
+		c /= len;
+	return v;
+}
+
+psi_rndr::QuantizedVertexData psi_rndr::quantize_vertex(VertexData const& vert, std::array<float, 3> const& min_pos, std::array<float, 3> const& max_pos) {
+	QuantizedVertexData q;
+	for (size_t i = 0; i < 3; ++i) {
+		float const extent = max_pos[i] - min_pos[i];
+		float const f = extent > 0.0f ? (vert.pos[i] - min_pos[i]) / extent : 0.0f;
+		q.pos[i] = uint16_t(std::lround(std::min(std::max(f, 0.0f), 1.0f) * 65535.0f));
+	}
+	q.padding = 0;
+	q.norm = encode_octahedral(vert.norm);
+	q.tan = encode_octahedral(vert.tan);
+	q.uv = {{ float_to_half(vert.uv[0]), float_to_half(vert.uv[1]) }};
+	return q;
+}
+
+psi_rndr::VertexData psi_rndr::dequantize_vertex(QuantizedVertexData const& q, std::array<float, 3> const& min_pos, std::array<float, 3> const& max_pos) {
+	VertexData vert;
+	for (size_t i = 0; i < 3; ++i)
+		vert.pos[i] = min_pos[i] + float(q.pos[i]) / 65535.0f * (max_pos[i] - min_pos[i]);
+	vert.norm = decode_octahedral(q.norm);
+	vert.tan = decode_octahedral(q.tan);
+	vert.uv = {{ half_to_float(q.uv[0]), half_to_float(q.uv[1]) }};
+	return vert;
+}
+
 psi_rndr::TextureData psi_rndr::load_texture(fs::path const& file) {
+	return decode_texture(psi_util::load_binary(file));
+}
+
+psi_rndr::TextureData psi_rndr::decode_texture(std::vector<char> const& data) {
+	return decode_texture(data.data(), data.size());
+}
+
+psi_rndr::TextureData psi_rndr::decode_texture(char const* data, size_t size) {
+	// FreeImage only reads from the memory, the cast is just its signature
+	fipMemoryIO mem(reinterpret_cast<BYTE*>(const_cast<char*>(data)), DWORD(size));
 	fipImage img;
-	img.load(file.c_str());
+	if (!img.loadFromMemory(mem))
+		throw std::runtime_error("Image format not recognized.");
 	img.convertToRGBA16();
 
 	// get size information
@@ -125,3 +411,35 @@ psi_rndr::TextureData psi_rndr::load_texture(fs::path const& file) {
 
 	return tex;
 }
+
+size_t psi_rndr::mesh_size(MeshData const& mesh) {
+	return sizeof(MeshData)
+		+ mesh.vertices.size() * sizeof(VertexData)
+		+ mesh.indices.size() * sizeof(uint32_t)
+		+ mesh.levels.size() * sizeof(MeshLevel);
+}
+
+uint64_t psi_rndr::mesh_content_hash(char const* data, size_t size) {
+	// header and its hash, then the hash of the vertices and indices
+	size_t const head = msh_header_size(data, size);
+	if (head == 0 || size < head + 16)
+		return psi_util::xxh64(data, size);
+
+	return psi_util::xxh64(data, head, psi_util::xxh64(data + size - 16, 16, size));
+}
+
+size_t psi_rndr::mesh_view_size(MeshView const& mesh) {
+	// the mapped pages are the memory a view occupies, even though the kernel may drop clean ones
+	return sizeof(MeshView)
+		+ mesh.vertex_count * vertex_size(mesh.layout)
+		+ mesh.index_count * sizeof(uint32_t)
+		+ mesh.levels.size() * sizeof(MeshLevel);
+}
+
+size_t psi_rndr::texture_size(TextureData const& tex) {
+	size_t size = sizeof(TextureData);
+	for (auto const& mip : tex.data) {
+		size += mip.size();
+	}
+	return size;
+}
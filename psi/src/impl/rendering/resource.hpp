@@ -23,10 +23,13 @@
 #include <array>
 #include <cstdint>
 #include <cfloat>
+#include <memory>
 #include <vector>
 
 #include <boost/filesystem.hpp>
 
+#include "../../util/mapped_file.hpp"
+
 
 namespace psi_rndr {
 /// Describes a single vertex in a mesh.
@@ -42,6 +45,40 @@ struct VertexData {
 	std::array<float, 2> uv;
 };
 
+/// Describes how the vertices of a mesh are laid out in memory and on the GPU.
+enum class VertexLayout : uint32_t {
+	/// VertexData, 44 bytes of floats. The only layout of .msh version 1.
+	FLOAT = 0,
+	/// QuantizedVertexData, 20 bytes.
+	QUANTIZED = 1,
+};
+
+/// Describes a single vertex in a mesh with quantized attributes.
+struct QuantizedVertexData {
+	/// Position as 16-bit unsigned normalized fractions of the mesh bounding box, from min_pos to max_pos
+	std::array<uint16_t, 3> pos;
+	/// Always zero, keeps the following attributes 4-byte aligned
+	uint16_t padding;
+	/// Normal vector in octahedral encoding, as 16-bit signed normalized integers
+	std::array<int16_t, 2> norm;
+	/// Tangent vector in octahedral encoding, as 16-bit signed normalized integers
+	std::array<int16_t, 2> tan;
+	/// Texture UV coordinates as half-precision floats
+	std::array<uint16_t, 2> uv;
+};
+
+/// Returns the size of a single vertex in the given layout in bytes.
+size_t vertex_size(VertexLayout);
+
+/// Describes a detail level of a mesh, a range of its indices which is drawn instead of all of them.
+struct MeshLevel {
+	/// Offset of the first index of the level
+	size_t first_index = 0;
+	size_t index_count = 0;
+	/// How far the simplified surface strays from the full detail one in model space, 0 for full detail
+	float error = 0.0f;
+};
+
 /// Describes a physical mesh.
 struct MeshData {
 	/// Designates how primitives in a mesh are constructed from its vertices.
@@ -54,6 +91,9 @@ struct MeshData {
 	std::vector<VertexData> vertices;
 	/// Indices of vectors creating primitives
 	std::vector<uint32_t> indices;
+	/// Detail levels, finest first, whose index ranges together make up the indices.
+	/// Meshes stored before .msh version 3 have a single level.
+	std::vector<MeshLevel> levels;
 	MeshPrimitiveMode mode = MeshPrimitiveMode::TRIANGLES;
 
 	/// Bounding Box maximum position
@@ -62,6 +102,29 @@ struct MeshData {
 	std::array<float, 3> min_pos = {{FLT_MAX, FLT_MAX, FLT_MAX}};
 };
 
+/// Describes a mesh stored elsewhere, e.g. in a mapped file, without copying it.
+/// Indices are laid out exactly as in MeshData, vertices as the layout says.
+struct MeshView {
+	/// Points to vertex_count vertices of type VertexData or QuantizedVertexData, depending on the layout.
+	void const* vertices = nullptr;
+	size_t vertex_count = 0;
+	VertexLayout layout = VertexLayout::FLOAT;
+	uint32_t const* indices = nullptr;
+	size_t index_count = 0;
+	/// Detail levels, finest first, see MeshData
+	std::vector<MeshLevel> levels;
+	MeshData::MeshPrimitiveMode mode = MeshData::MeshPrimitiveMode::TRIANGLES;
+
+	/// Bounding Box maximum position
+	std::array<float, 3> max_pos = {{FLT_MIN, FLT_MIN, FLT_MIN}};
+	/// Bounding Box minimum position
+	std::array<float, 3> min_pos = {{FLT_MAX, FLT_MAX, FLT_MAX}};
+
+	/// Owner of the memory the view points into, e.g. a mapped file, kept alive by the view.
+	/// Empty if the view does not own its memory.
+	std::shared_ptr<void const> storage;
+};
+
 struct TextureData {
 	enum class Encoding {
 		RGB8,
@@ -83,13 +146,64 @@ struct TextureData {
 };
 
 /// Tries to load a mesh stored in the Psi Engine Mesh .msh format.
+/// Quantized vertices are decoded to floats.
 /// @throws if the file does not exist, is invalid, or otherwise occupied
 /// @returns the mesh data
 MeshData load_mesh(boost::filesystem::path const& file);
 
+/// Parses a mesh in the Psi Engine Mesh .msh format from the contents of a file.
+/// Quantized vertices are decoded to floats.
+/// @throws if the data is invalid
+/// @returns the mesh data
+MeshData parse_mesh(std::vector<char> const& data);
+
 /// Tries to load a texture stored in the .png, .jpeg, or .tiff format.
 /// Calculates mipmaps.
 /// @throws if the file does not exist, is invalid, or otherwise occupied
 /// @returns the mesh data
 TextureData load_texture(boost::filesystem::path const& file);
+
+/// Checks a mapped mesh in the Psi Engine Mesh .msh format and points a view straight into the mapping.
+/// The view keeps the mapping alive.
+/// @throws if the data is invalid
+MeshView map_mesh(std::shared_ptr<psi_util::MappedFile const> const& file);
+
+/// Checks a mesh in the Psi Engine Mesh .msh format and points a view straight into it.
+/// @param[in] storage owner of the memory, kept alive by the view
+/// @throws if the data is invalid
+MeshView map_mesh(std::shared_ptr<void const> storage, char const* data, size_t size);
+
+/// Returns a view of the mesh which does not own it.
+MeshView view_mesh(MeshData const&);
+
+/// Picks the coarsest detail level whose error covers at most the given number of pixels on screen.
+/// @param[in] pixels_per_unit how many pixels a model space unit covers at the mesh's distance from the camera
+/// @returns the index of the level, 0 if there are none
+size_t select_mesh_level(std::vector<MeshLevel> const& levels, float pixels_per_unit, float max_pixel_error);
+
+/// Quantizes a vertex relative to the given bounding box, which must contain its position.
+QuantizedVertexData quantize_vertex(VertexData const&, std::array<float, 3> const& min_pos, std::array<float, 3> const& max_pos);
+
+/// Decodes a vertex quantized relative to the given bounding box.
+VertexData dequantize_vertex(QuantizedVertexData const&, std::array<float, 3> const& min_pos, std::array<float, 3> const& max_pos);
+
+/// Returns a hash identifying the contents of a .msh file, for deduplication. Only the header and the
+/// stored checksums are read, which cover the rest, so the mesh data is not paged in.
+uint64_t mesh_content_hash(char const* data, size_t size);
+
+/// Decodes a texture in the .png, .jpeg, or .tiff format from the contents of a file.
+/// Calculates mipmaps.
+/// @throws if the data is invalid
+/// @returns the texture data
+TextureData decode_texture(std::vector<char> const& data);
+TextureData decode_texture(char const* data, size_t size);
+
+/// Returns the memory occupied by the mesh in bytes.
+size_t mesh_size(MeshData const&);
+
+/// Returns the memory occupied by the view and the mesh it points into in bytes.
+size_t mesh_view_size(MeshView const&);
+
+/// Returns the memory occupied by the texture and all its mipmaps in bytes.
+size_t texture_size(TextureData const&);
 } // namespace psi_util
@@ -22,201 +22,1662 @@
 
 #include <algorithm>
 #include <memory>
+#include <chrono>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
 #include <unordered_map>
+#include <list>
+#include <set>
+#include <future>
+#include <utility>
 
-#include <tbb/concurrent_hash_map.h>
-
+#include "../../thread/epoch.hpp"
+#include "../../thread/stage.hpp"
 #include "../../log/log.hpp"
 #include "../../util/assert.hpp"
+#include "../../util/file_watcher.hpp"
+#include "../../util/hash.hpp"
+#include "../../profile/profiler.hpp"
+
 
+/// A callback waiting for a resource to finish loading, linked into its storage.
+struct LoadWaiter {
+	psi_serv::IResourceService::LoadedCallback callback;
+	psi_thread::TaskQueue queue;
+	LoadWaiter* next;
+};
 
 class ResourceStorage {
 public:
 	ResourceStorage()
-		: _is_loaded(false) {}
-
-	/// ResourceStorage must be CopyConstructible for concurrent_hash_map.
-	ResourceStorage(ResourceStorage const& cpy)
-		: _is_loaded(cpy._is_loaded) {
-		// make deep copy of resource if it was loaded into cpy
-		if (cpy._is_loaded) {
-			_res = cpy._res;
-		}
-	}
+		: _state(psi_serv::ResourceState::LOADING)
+		, _future(_promise.get_future().share())
+		, _waiters(nullptr)
+		, _bytes(0)
+		, _pins(0) {}
 
 	~ResourceStorage() {
-		// simulate successful load and notify everybody we're done
-		// TODO won't this segfault if waiters check the Pred after m_is_loaded was destroyed?
-		std::unique_lock<std::mutex> lock(_load_mut);
-		_is_loaded = true;
-		lock.unlock();
-		_load_cond.notify_all();
+		// only left over if never completed
+		LoadWaiter* w = _waiters.load(std::memory_order_relaxed);
+		while (w && w != CLOSED) {
+			delete std::exchange(w, w->next);
+		}
 	}
 
 	/// Store the result of a successful load operation in a newly initialized ResourceStorage.
-	void store_load(boost::any&& res) {
-		std::unique_lock<std::mutex> lock(_load_mut);
-		// is_loaded must be false and m_res must be empty
-		ASSERT(!_is_loaded);
+	/// @return false if the load was abandoned meanwhile
+	bool store_load(psi_serv::Resource&& res, size_t bytes) {
+		// not visible to readers until the state says Available
 		_res = std::move(res);
-		_is_loaded = true;
-		lock.unlock();
-		_load_cond.notify_all();
+		_bytes = bytes;
+		return _complete(psi_serv::ResourceState::AVAILABLE);
 	}
 
-	/// Check if it is still loading == nothing was stored.
-	bool is_loaded() const {
-		std::unique_lock<std::mutex> lock(_load_mut);
-		return _is_loaded;
+	/// Marks a loading resource as never going to be loaded, because it was freed or its loader failed.
+	/// @return false if it was already complete
+	bool abandon() {
+		cancel_token.cancel();
+		return _complete(psi_serv::ResourceState::UNAVAILABLE);
 	}
 
-	/// Wait until something gets stored.
-	void wait_for_load() const {
-		std::unique_lock<std::mutex> lock(_load_mut);
-		if (_is_loaded)
-			return;
+	/// Wait until something gets stored or the load is abandoned.
+	/// @return whether the resource is available
+	bool wait_for_load() const {
+		return _future.get() == psi_serv::ResourceState::AVAILABLE;
+	}
 
-		_load_cond.wait(lock, [this]{ return _is_loaded; });
+	/// Becomes ready with Available or Unavailable once loading completes.
+	std::shared_future<psi_serv::ResourceState> const& future() const {
+		return _future;
 	}
 
 	/// Retrieve the state of this resource.
 	psi_serv::ResourceState state() const {
-		if (is_loaded())
-			return psi_serv::ResourceState::AVAILABLE;
-		else
-			return psi_serv::ResourceState::LOADING;
+		return _state.load(std::memory_order_acquire);
 	}
 
 	/// Returns the stored resource if it was loaded. Assertion fails otherwise.
-	boost::any const& resource() const {
-		ASSERT(is_loaded());
+	psi_serv::Resource const& resource() const {
+		ASSERT(state() == psi_serv::ResourceState::AVAILABLE);
 		return _res;
 	}
 
+	/// Links a waiter to be dispatched on completion, takes ownership of it.
+	/// @return false if already complete, the waiter is then still owned by the caller
+	bool add_waiter(LoadWaiter* w) {
+		LoadWaiter* head = _waiters.load(std::memory_order_acquire);
+		do {
+			if (head == CLOSED)
+				return false;
+			w->next = head;
+		} while (!_waiters.compare_exchange_weak(head, w, std::memory_order_acq_rel, std::memory_order_acquire));
+		return true;
+	}
+
+	/// Takes all waiters after completion, in the order they were added. Later add_waiter calls fail.
+	LoadWaiter* close_waiters() {
+		LoadWaiter* w = _waiters.exchange(CLOSED, std::memory_order_acq_rel);
+		// the list is LIFO, reverse it
+		LoadWaiter* ordered = nullptr;
+		while (w && w != CLOSED) {
+			LoadWaiter* next = w->next;
+			w->next = ordered;
+			ordered = w;
+			w = next;
+		}
+		return ordered;
+	}
+
+	/// Size of the resource in bytes as reported by its loader, 0 until it is loaded.
+	size_t bytes() const {
+		return _bytes;
+	}
+
+	/// Pinned resources are never evicted.
+	void pin() {
+		_pins.fetch_add(1, std::memory_order_relaxed);
+	}
+	void unpin() {
+		_pins.fetch_sub(1, std::memory_order_relaxed);
+	}
+	bool is_pinned() const {
+		return _pins.load(std::memory_order_relaxed) > 0;
+	}
+
+	/// Cancels the load task if it has not started yet.
+	psi_thread::CancellationToken cancel_token;
+
+	/// Set by every retrieval, cleared by the eviction clock hand. Resources not used since
+	/// the hand last passed are evicted first.
+	std::atomic<bool> referenced{true};
+
+	/// Position in ResourceLoader's eviction clock, guarded by its mutex.
+	std::list<std::pair<size_t, std::shared_ptr<ResourceStorage>>>::iterator clock_pos;
+	bool in_clock = false;
+	/// Children of an available bundle, pinned while it is in the clock. Guarded by the same mutex.
+	std::vector<std::pair<size_t, std::shared_ptr<ResourceStorage>>> bundled;
+	/// Bundles in the clock which have this as a child, so that a reload can hand their pins to its
+	/// new version. Guarded by the same mutex.
+	std::vector<ResourceStorage*> bundles;
+
 private:
-	bool _is_loaded;
-	mutable std::mutex _load_mut;
-	mutable std::condition_variable _load_cond;
+	static LoadWaiter* const CLOSED;
+
+	/// Moves from Loading to the given state exactly once.
+	bool _complete(psi_serv::ResourceState state) {
+		auto loading = psi_serv::ResourceState::LOADING;
+		if (!_state.compare_exchange_strong(loading, state, std::memory_order_acq_rel))
+			return false;
+
+		_promise.set_value(state);
+		return true;
+	}
+
+	std::atomic<psi_serv::ResourceState> _state;
+	std::promise<psi_serv::ResourceState> _promise;
+	std::shared_future<psi_serv::ResourceState> _future;
+	std::atomic<LoadWaiter*> _waiters;
+
+	psi_serv::Resource _res;
+	size_t _bytes;
+	std::atomic<size_t> _pins;
+};
+
+LoadWaiter* const ResourceStorage::CLOSED = reinterpret_cast<LoadWaiter*>(uintptr_t(1));
+
+/// A fixed-capacity, open-addressing hash table from resource handles to storages.
+/// Readers never take locks: they pin an epoch and copy the storage pointer out of the slot's entry.
+/// Writers serialize among themselves but never wait on readers either: they publish entries and slot
+/// arrays atomically and retire whatever they unlink through the epoch manager.
+/// Removed handles leave tombstones which later inserts reuse, and the slot array is rebuilt without them
+/// once they fill a quarter of it, so probe sequences stay short however many handles come and go.
+class ResourceTable : psi_mark::Threadsafe {
+public:
+	explicit ResourceTable(size_t capacity)
+		: _table(new Table(capacity))
+		, _mask(capacity - 1) {
+		ASSERT(capacity > 0 && (capacity & (capacity - 1)) == 0);
+	}
+
+	~ResourceTable() {
+		std::unique_ptr<Table> table(_table.load(std::memory_order_relaxed));
+		for (size_t i = 0; i <= _mask; ++i) {
+			if (table->slots[i].key.load(std::memory_order_relaxed) < TOMBSTONE)
+				delete table->slots[i].entry.load(std::memory_order_relaxed);
+		}
+	}
+
+	/// @return the storage for this handle or nullptr
+	std::shared_ptr<ResourceStorage> find(size_t h) const {
+		ASSERT(h < TOMBSTONE);
+
+		auto guard = _epochs.pin();
+		Table const* table = _table.load(std::memory_order_acquire);
+		for (size_t i = 0, at = _mix(h) & _mask; i <= _mask; ++i, at = (at + 1) & _mask) {
+			Slot const& slot = table->slots[at];
+			size_t key = slot.key.load(std::memory_order_acquire);
+			if (key == EMPTY)
+				return nullptr;
+			if (key != h)
+				continue;
+
+			// the slot may have been freed and reused by another handle since its key was read
+			Entry const* e = slot.entry.load(std::memory_order_acquire);
+			if (e && e->key == h)
+				return e->storage;
+		}
+		return nullptr;
+	}
+
+	/// Inserts the storage unless the handle already has one.
+	/// @return the storage for this handle afterwards, which is the given one if it was inserted
+	/// @throw std::runtime_error if the table is full
+	std::shared_ptr<ResourceStorage> insert(size_t h, std::shared_ptr<ResourceStorage> const& storage) {
+		std::lock_guard<std::mutex> lock(_write_mut);
+		Table* table = _table.load(std::memory_order_relaxed);
+
+		Slot* free = nullptr;
+		if (Slot* slot = _find_slot(*table, h, &free))
+			return slot->entry.load(std::memory_order_relaxed)->storage;
+
+		if (_live > _mask)
+			throw std::runtime_error("ResourceTable is full, increase ResourceLoaderArgs::max_resources.");
+
+		ASSERT(free);
+		if (free->key.load(std::memory_order_relaxed) == EMPTY)
+			++_used;
+		++_live;
+		// readers check the key first, so the entry has to be in place by the time they see it
+		free->entry.store(new Entry{h, storage}, std::memory_order_release);
+		free->key.store(h, std::memory_order_release);
+
+		_rebuild_if_needed();
+		return storage;
+	}
+
+	/// Removes the handle's storage, but only if it is the given one.
+	/// @return whether it was removed
+	bool erase(size_t h, std::shared_ptr<ResourceStorage> const& storage) {
+		std::lock_guard<std::mutex> lock(_write_mut);
+		Slot* slot = _find_slot(*_table.load(std::memory_order_relaxed), h);
+		if (!slot || slot->entry.load(std::memory_order_relaxed)->storage != storage)
+			return false;
+
+		_remove(*slot);
+		return true;
+	}
+
+	/// Replaces the handle's storage with another one, but only if it is the expected one.
+	/// @return whether it was replaced
+	bool replace(size_t h, std::shared_ptr<ResourceStorage> const& expected, std::shared_ptr<ResourceStorage> const& storage) {
+		std::lock_guard<std::mutex> lock(_write_mut);
+		Slot* slot = _find_slot(*_table.load(std::memory_order_relaxed), h);
+		if (!slot || slot->entry.load(std::memory_order_relaxed)->storage != expected)
+			return false;
+
+		_epochs.retire(slot->entry.exchange(new Entry{h, storage}, std::memory_order_acq_rel));
+		return true;
+	}
+
+	/// Removes the handle's storage, whichever it is.
+	/// @return the removed storage or nullptr
+	std::shared_ptr<ResourceStorage> erase(size_t h) {
+		std::lock_guard<std::mutex> lock(_write_mut);
+		Slot* slot = _find_slot(*_table.load(std::memory_order_relaxed), h);
+		if (!slot)
+			return nullptr;
+
+		auto storage = slot->entry.load(std::memory_order_relaxed)->storage;
+		_remove(*slot);
+		return storage;
+	}
+
+private:
+	/// Immutable once published, so readers may copy the pointer without synchronization.
+	/// Knows its handle, which tells readers whether the slot they probed was reused meanwhile.
+	struct Entry {
+		size_t key;
+		std::shared_ptr<ResourceStorage> storage;
+	};
+
+	/// Holds a handle and its entry, or is EMPTY or a TOMBSTONE without entry.
+	struct Slot {
+		std::atomic<size_t> key{EMPTY};
+		std::atomic<Entry*> entry{nullptr};
+	};
+
+	/// A slot array, replaced as a whole when rebuilt. Does not own the entries, they move on to the new array.
+	struct Table {
+		explicit Table(size_t capacity)
+			: slots(new Slot[capacity]) {}
+
+		std::unique_ptr<Slot[]> slots;
+	};
+
+	static constexpr size_t EMPTY = SIZE_MAX;
+	static constexpr size_t TOMBSTONE = SIZE_MAX - 1;
+
+	static size_t _mix(size_t h) {
+		// handles are often string hashes already, but nothing guarantees their low bits are spread
+		uint64_t x = h;
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		return size_t(x);
+	}
+
+	/// Looks the handle up on behalf of a writer. Requires _write_mut.
+	/// @param[out] free the first slot an insert of h may take, if requested
+	/// @return the slot holding h or nullptr
+	Slot* _find_slot(Table& table, size_t h, Slot** free = nullptr) const {
+		ASSERT(h < TOMBSTONE);
+
+		for (size_t i = 0, at = _mix(h) & _mask; i <= _mask; ++i, at = (at + 1) & _mask) {
+			Slot& slot = table.slots[at];
+			size_t key = slot.key.load(std::memory_order_relaxed);
+			if (key == h)
+				return &slot;
+			if ((key == EMPTY || key == TOMBSTONE) && free && !*free)
+				*free = &slot;
+			// the probe sequence for h ends at the first empty slot, tombstones only stand in for removed keys
+			if (key == EMPTY)
+				return nullptr;
+		}
+		return nullptr;
+	}
+
+	/// Turns the slot into a tombstone. Requires _write_mut.
+	void _remove(Slot& slot) {
+		slot.key.store(TOMBSTONE, std::memory_order_release);
+		_epochs.retire(slot.entry.exchange(nullptr, std::memory_order_acq_rel));
+		--_live;
+
+		_rebuild_if_needed();
+	}
+
+	/// Publishes a new slot array without tombstones once they fill a quarter of the table. Requires _write_mut.
+	void _rebuild_if_needed() {
+		if (_used - _live < (_mask + 1) / 4)
+			return;
+
+		Table* old = _table.load(std::memory_order_relaxed);
+		auto table = std::make_unique<Table>(_mask + 1);
+		for (size_t i = 0; i <= _mask; ++i) {
+			size_t key = old->slots[i].key.load(std::memory_order_relaxed);
+			if (key >= TOMBSTONE)
+				continue;
+
+			size_t at = _mix(key) & _mask;
+			while (table->slots[at].key.load(std::memory_order_relaxed) != EMPTY)
+				at = (at + 1) & _mask;
+			table->slots[at].key.store(key, std::memory_order_relaxed);
+			table->slots[at].entry.store(old->slots[i].entry.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		}
+
+		// readers still probing the old array find what it held when they pinned, it stays intact until retired
+		_table.store(table.release(), std::memory_order_release);
+		_epochs.retire(old);
+		_used = _live;
+	}
+
+	std::atomic<Table*> _table;
+	size_t const _mask;
+	psi_thread::EpochManager _epochs;
+
+	std::mutex _write_mut;
+	/// Slots holding a handle, guarded by _write_mut.
+	size_t _live = 0;
+	/// Slots holding a handle or a tombstone, guarded by _write_mut.
+	size_t _used = 0;
+};
+
+/// Load statistics of a loader, shared by its jobs.
+struct LoaderTelemetry {
+	std::mutex mut;
+	psi_serv::LoaderStats stats;
+};
+
+/// A registered loader with its statistics, which outlive the loader if the id is registered again.
+struct RegisteredLoader {
+	std::shared_ptr<psi_serv::IResourceService::StagedLoader const> loader;
+	std::shared_ptr<LoaderTelemetry> telemetry;
+};
+
+/// Registered loaders by id, read by every request and written by registration only.
+/// Readers pin an epoch and look the id up in the current snapshot, which is immutable, so they never lock.
+/// Writers copy the snapshot, change the copy, publish it and retire the old one through the epoch manager.
+class LoaderRegistry : psi_mark::Threadsafe {
+public:
+	using Loaders = std::unordered_map<psi_serv::IResourceService::ResourceLoaderId, RegisteredLoader>;
+
+	LoaderRegistry()
+		: _snapshot(new Loaders()) {}
+
+	~LoaderRegistry() {
+		delete _snapshot.load(std::memory_order_relaxed);
+	}
+
+	/// @return the loader registered with the id, or one without a loader
+	RegisteredLoader find(psi_serv::IResourceService::ResourceLoaderId id) const {
+		auto guard = _epochs.pin();
+		Loaders const* loaders = _snapshot.load(std::memory_order_acquire);
+		auto it = loaders->find(id);
+		return it != loaders->end() ? it->second : RegisteredLoader();
+	}
+
+	/// Registers the loader, replacing the one with the same id but keeping its statistics.
+	void set(psi_serv::IResourceService::ResourceLoaderId id, std::shared_ptr<psi_serv::IResourceService::StagedLoader const> loader) {
+		std::lock_guard<std::mutex> lock(_write_mut);
+		Loaders* current = _snapshot.load(std::memory_order_relaxed);
+		auto next = std::make_unique<Loaders>(*current);
+
+		auto& registered = (*next)[id];
+		registered.loader = std::move(loader);
+		if (!registered.telemetry) {
+			registered.telemetry = std::make_shared<LoaderTelemetry>();
+			registered.telemetry->stats.loader = id;
+		}
+
+		_snapshot.store(next.release(), std::memory_order_release);
+		_epochs.retire(current);
+	}
+
+	/// Calls the function with every registered loader, in no particular order. It must not register loaders.
+	template <typename F>
+	void for_each(F&& f) const {
+		auto guard = _epochs.pin();
+		for (auto const& l : *_snapshot.load(std::memory_order_acquire)) {
+			f(l.second);
+		}
+	}
+
+private:
+	std::atomic<Loaders*> _snapshot;
+	/// Serializes writers, which would lose each other's changes otherwise.
+	std::mutex _write_mut;
+	psi_thread::EpochManager _epochs;
+};
+
+using Clock = std::chrono::steady_clock;
+
+/// A loaded resource whose files are watched, with what is needed to load it again.
+struct WatchedResource {
+	std::shared_ptr<psi_serv::IResourceService::StagedLoader const> loader;
+	std::shared_ptr<LoaderTelemetry> telemetry;
+	std::string param;
+	/// Normalized paths of the files it is loaded from.
+	std::vector<std::string> files;
+	/// Incremented by every reload, only the latest one is swapped in. Guarded by the clock mutex.
+	uint64_t generation = 0;
+	/// Set if the files changed while the resource was still loading, it is reloaded once available.
+	/// Guarded by the clock mutex.
+	bool reload_pending = false;
+};
+
+/// A callback run on every reload of a resource.
+struct ReloadListener {
+	psi_serv::IResourceService::LoadedCallback callback;
+	psi_thread::TaskQueue queue;
+};
+
+/// A resource on its way through the loading pipeline.
+struct LoadJob {
+	size_t handle;
+	std::shared_ptr<ResourceStorage> storage;
+	std::shared_ptr<psi_serv::IResourceService::StagedLoader const> loader;
+	std::string param;
+	/// Output of the last stage which ran.
+	psi_serv::Resource data;
+	/// Keeps ResourceLoader alive while the job is in the read or decode stage.
+	std::shared_ptr<void> busy;
+	/// Orders the job in the stages it waits in.
+	std::shared_ptr<psi_thread::TaskPriority> priority;
+	/// Set if this loads a new version of a resource whose files changed.
+	std::shared_ptr<WatchedResource> reload = nullptr;
+	/// The storage the new version replaces and the reload generation it was started in.
+	std::shared_ptr<ResourceStorage> replaces = nullptr;
+	uint64_t generation = 0;
+	/// Whether the job looked for a resource with the same contents already, it only does once.
+	bool dedup_checked = false;
+	/// Set if the job completed with the data of a resource with the same contents, which counts its bytes.
+	bool shared = false;
+
+	/// Receives the job's timings once it completes.
+	std::shared_ptr<LoaderTelemetry> telemetry = nullptr;
+	/// When the job was created and when its current step began.
+	Clock::time_point requested = Clock::now();
+	Clock::time_point mark = requested;
+	/// Microseconds spent in each step so far, see LoaderStats.
+	uint64_t wait_us = 0;
+	uint64_t read_us = 0;
+	uint64_t decode_us = 0;
+	uint64_t finalize_us = 0;
+
+	/// Microseconds since the current step began, the next one begins now.
+	uint64_t lap() {
+		auto now = Clock::now();
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(now - mark).count();
+		mark = now;
+		return uint64_t(us);
+	}
+};
+
+/// A bundle waiting for its children to load.
+struct BundleJob {
+	struct Child {
+		size_t handle;
+		/// Null if the child failed or was freed right away.
+		std::shared_ptr<ResourceStorage> storage;
+		/// Keeps the loaded child from being evicted until the bundle is complete.
+		std::unique_ptr<psi_serv::IResourceLock> lock;
+	};
+
+	size_t handle;
+	std::shared_ptr<ResourceStorage> storage;
+	std::vector<Child> children;
+	/// Children which have not completed yet, the last one to complete completes the bundle.
+	std::atomic<size_t> remaining;
+	std::atomic<bool> failed{false};
+	/// Keeps ResourceLoader alive until the bundle is complete.
+	std::shared_ptr<void> busy;
+};
+
+/// Identifies resources which decode to the same data: those of the same loader with the same raw data.
+struct ContentKey {
+	psi_serv::IResourceService::StagedLoader const* loader;
+	uint64_t hash;
+
+	bool operator==(ContentKey const& other) const {
+		return loader == other.loader && hash == other.hash;
+	}
+};
 
-	boost::any _res;
+struct ContentKeyHash {
+	size_t operator()(ContentKey const& k) const {
+		return size_t(k.hash ^ (uintptr_t(k.loader) * 0x9e3779b97f4a7c15ull));
+	}
 };
 
-typedef tbb::concurrent_hash_map<size_t, ResourceStorage>::accessor accessor;
-typedef tbb::concurrent_hash_map<size_t, ResourceStorage>::const_accessor const_accessor;
+static size_t round_up_pow2(size_t n) {
+	size_t p = 1;
+	while (p < n) {
+		p <<= 1;
+	}
+	return p;
+}
 
 class ResourceLock : public psi_serv::IResourceLock {
 public:
-	explicit ResourceLock(std::unique_ptr<const_accessor>&& access)
-		: _access(std::move(access)) {}
+	explicit ResourceLock(std::shared_ptr<ResourceStorage> storage)
+		: _storage(std::move(storage)) {
+		_storage->pin();
+	}
 
-	~ResourceLock() {}
+	~ResourceLock() {
+		_storage->unpin();
+	}
 
-	boost::any const& resource() override {
-		return (*_access)->second.resource();
+	psi_serv::Resource const& resource() override {
+		return _storage->resource();
 	}
 
 private:
-	std::unique_ptr<const_accessor> _access;
+	std::shared_ptr<ResourceStorage> _storage;
 };
 
 class ResourceLoader : public psi_serv::IResourceService {
 public:
-	explicit ResourceLoader(psi_thread::TaskManager const& tasks)
-		: _task_submitter(tasks) {}
+	explicit ResourceLoader(psi_serv::ResourceLoaderArgs const& args)
+		: _resources(round_up_pow2(args.max_resources))
+		, _task_submitter(args.task_submitter)
+		, _budget(args.memory_budget)
+		, _resident(0)
+		, _file_reader(args.file_reader)
+		, _read_stage(args.task_submitter, psi_thread::TaskQueue::IO, args.max_reads)
+		, _decode_stage(args.task_submitter, psi_thread::TaskQueue::WORKER,
+			args.max_decodes ? args.max_decodes : args.task_submitter.worker_count() + 1)
+		, _dedup(args.deduplicate)
+		, _in_flight(0)
+		, _closing(false)
+		, _alive(std::make_shared<char>()) {
+		_read_stage.set_downstream(_decode_stage);
 
-	void register_loader(ResourceLoaderId id, std::function<boost::any(std::string const&)> loader) override {
-		_loaders[id] = loader;
+		if (args.hot_reload) {
+			try {
+				_watcher = std::make_unique<psi_util::FileWatcher>([this] (std::vector<boost::filesystem::path> const& files) {
+					_reload_files(files);
+				});
+				psi_log::info("ResourceLoader") << "Watching resource files for changes.\n";
+			}
+			catch (std::exception const& e) {
+				psi_log::warning("ResourceLoader") << "Hot reloading is unavailable: " << e.what() << "\n";
+			}
+		}
 	}
 
-	psi_serv::ResourceState request_resource(ResourceHandle h, ResourceLoaderId id, std::string location) const override {
-		ASSERT(_loaders.count(id));
+	~ResourceLoader() {
+		// no more reloads start once the watcher is gone; it is destroyed outside the lock
+		// because its callback takes it too
+		std::unique_ptr<psi_util::FileWatcher> watcher;
+		{
+			std::lock_guard<std::mutex> lock(_reload_mut);
+			watcher = std::move(_watcher);
+		}
+		watcher.reset();
+
+		// load tasks reference this, queued ones bail out early and running ones are waited for
+		_closing.store(true, std::memory_order_relaxed);
 
-		return request_resource(h, [&,this]()->boost::any{ return (_loaders.at(id))(location); });
+		// loads waiting for the main thread never complete now, bundles waiting for them would hold this up
+		std::vector<ResourceHandle> loading;
+		{
+			std::lock_guard<std::mutex> lock(_loading_mut);
+			for (auto const& l : _loading) {
+				loading.push_back(l.first);
+			}
+		}
+		for (auto h : loading) {
+			auto storage = _resources.find(h);
+			if (storage && storage->abandon())
+				_notify(storage);
+		}
+
+		std::unique_lock<std::mutex> lock(_idle_mut);
+		_idle.wait(lock, [this]{ return _in_flight.load() == 0; });
+	}
+
+	using IResourceService::register_loader;
+	using IResourceService::register_staged_loader;
+
+	void register_loader(ResourceLoaderId id, std::function<psi_serv::Resource(std::string const&)> loader, std::function<size_t(psi_serv::Resource const&)> size_of) override {
+		// a single stage doing everything, on an I/O thread since it most likely reads a file
+		StagedLoader staged;
+		staged.read = std::move(loader);
+		staged.size_of = std::move(size_of);
+		register_staged_loader(id, std::move(staged));
+	}
+
+	void register_staged_loader(ResourceLoaderId id, StagedLoader loader) override {
+		ASSERT(loader.read || loader.file);
+		_loaders.set(id, std::make_shared<StagedLoader const>(std::move(loader)));
+	}
+
+	psi_serv::ResourceState request_resource(ResourceHandle h, ResourceLoaderId id, std::string location) const override {
+		auto loader = _loaders.find(id);
+		ASSERT(loader.loader);
+		return _request(h, loader, std::move(location), 0.0f, Deadline::max());
 	}
 
 	psi_serv::ResourceState request_resource(
 	ResourceHandle h,
-	std::function<boost::any()> loader
+	std::function<psi_serv::Resource()> loader
 	) const override {
-		// check whether the resource is already in map
-		const_accessor access;
-		_resources.find(access, h);
-		if (!access.empty()) {
-			// access is pair<Key, Val>
-			return access->second.state();
+		// unknown size, not counted towards the budget
+		auto staged = std::make_shared<StagedLoader>();
+		staged->read = [loader] (std::string const&) { return loader(); };
+		return _request(h, RegisteredLoader{std::move(staged), _function_telemetry}, std::string(), 0.0f, Deadline::max());
+	}
+
+	boost::optional<std::unique_ptr<psi_serv::IResourceLock>> retrieve_resource(ResourceHandle h) const override {
+		PSI_PROFILE_ZONE("ResourceLoader::retrieve_resource", h);
+
+		auto storage = _resources.find(h);
+		if (!storage) {
+			_count(_counters.retrieve_misses);
+			return boost::optional<std::unique_ptr<psi_serv::IResourceLock>>();
 		}
 
-		// load resource from disk
-		_task_submitter.submit_task(
-			[&, h] {
-				// insert element (ResourceStorage() auto sets state as Loading)
-				accessor access;
-				_resources.insert(access, h);
-				access.release();
-
-				// try to load the resource
-				boost::any res;
-				try {
-					res = loader();
-				}
-				catch (std::exception const& e) {
-					psi_log::error("ResourceLoader") << "Loading resource " << h << " failed with error: " << e.what() << "\n";
-					// delete and quit if loading failed
-					_resources.erase(h);
-					return;
-				}
+		_count(storage->state() == psi_serv::ResourceState::AVAILABLE ? _counters.retrieve_hits : _counters.retrieve_waits);
+		if (!storage->wait_for_load())
+			return boost::optional<std::unique_ptr<psi_serv::IResourceLock>>();
 
-				_resources.find(access, h);
-				// I just inserted it but could be empty if the Loading element got deleted
-				if (access.empty())
-					return;
+		// construct lock and return it
+		return boost::optional<std::unique_ptr<psi_serv::IResourceLock>>(_lock(storage));
+	}
 
-				access->second.store_load(std::move(res));
-				psi_log::debug("ResourceLoader") << "Loaded resource " << h << " successfully.\n";
+	std::vector<psi_serv::ResourceState> request_resources(std::vector<ResourceRequest> const& requests) const override {
+		PSI_PROFILE_ZONE("ResourceLoader::request_resources");
+
+		std::vector<psi_serv::ResourceState> states;
+		states.reserve(requests.size());
+		for (auto const& r : requests) {
+			auto loader = _loaders.find(r.loader);
+			ASSERT(loader.loader);
+			states.push_back(_request(r.handle, loader, r.param, r.priority, r.deadline));
+		}
+		return states;
+	}
+
+	psi_serv::ResourceState request_bundle(ResourceHandle h, std::vector<ResourceRequest> const& children) const override {
+		PSI_PROFILE_ZONE("ResourceLoader::request_bundle", h);
+
+		auto storage = std::make_shared<ResourceStorage>();
+		auto existing = _resources.insert(h, storage);
+		if (existing != storage) {
+			_count(_counters.request_hits);
+			return existing->state();
+		}
+		_count(_counters.request_misses);
+
+		request_resources(children);
+
+		auto job = std::make_shared<BundleJob>();
+		job->handle = h;
+		job->storage = storage;
+		job->remaining.store(children.size() + 1, std::memory_order_relaxed);
+		job->busy = _hold();
+		job->children.reserve(children.size());
+		for (auto const& c : children) {
+			job->children.push_back(BundleJob::Child{c.handle, _resources.find(c.handle), nullptr});
+		}
+
+		// one waiter per child, the bundle completes with the last of them
+		for (size_t i = 0; i < job->children.size(); ++i) {
+			LoadedCallback callback = [this, job, i] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+				if (lock)
+					job->children[i].lock = std::move(lock);
+				else
+					job->failed.store(true, std::memory_order_relaxed);
+				_child_completed(*job);
+			};
+
+			auto const& child = job->children[i].storage;
+			if (!child) {
+				callback(nullptr);
+				continue;
 			}
-		);
 
-		// happens concurrently with the task submitted to m_task_submitter
+			auto w = std::make_unique<LoadWaiter>(LoadWaiter{std::move(callback), psi_thread::TaskQueue::WORKER, nullptr});
+			if (child->add_waiter(w.get()))
+				w.release();
+			else
+				_dispatch(child, std::move(w->callback), psi_thread::TaskQueue::WORKER);
+		}
+		// only complete once all waiters are added, even if the children are loaded already
+		_child_completed(*job);
+
 		return psi_serv::ResourceState::LOADING;
 	}
 
-	boost::optional<std::unique_ptr<psi_serv::IResourceLock>> retrieve_resource(ResourceHandle h) const override {
-		auto access = std::make_unique<const_accessor>();
-		_resources.find(*access, h);
-		if (access->empty())
+	std::vector<boost::optional<std::unique_ptr<psi_serv::IResourceLock>>> retrieve_all(std::vector<ResourceHandle> const& hs) const override {
+		PSI_PROFILE_ZONE("ResourceLoader::retrieve_all");
+
+		// waiting in order costs no more than the slowest load, they all run concurrently
+		std::vector<boost::optional<std::unique_ptr<psi_serv::IResourceLock>>> locks;
+		locks.reserve(hs.size());
+		for (auto h : hs) {
+			locks.push_back(retrieve_resource(h));
+		}
+		return locks;
+	}
+
+	boost::optional<std::unique_ptr<psi_serv::IResourceLock>> try_retrieve_resource(ResourceHandle h) const override {
+		auto storage = _resources.find(h);
+		if (!storage || storage->state() != psi_serv::ResourceState::AVAILABLE) {
+			_count(_counters.retrieve_misses);
 			return boost::optional<std::unique_ptr<psi_serv::IResourceLock>>();
+		}
 
-		(*access)->second.wait_for_load();
-		// construct lock and return it
-		return boost::optional<std::unique_ptr<psi_serv::IResourceLock>> (std::make_unique<ResourceLock>(std::move(access)));
+		_count(_counters.retrieve_hits);
+		return boost::optional<std::unique_ptr<psi_serv::IResourceLock>>(_lock(storage));
+	}
+
+	std::shared_future<psi_serv::ResourceState> request_resource_async(ResourceHandle h, ResourceLoaderId id, std::string param) const override {
+		request_resource(h, id, std::move(param));
+
+		if (auto storage = _resources.find(h))
+			return storage->future();
+
+		// freed or failed already
+		std::promise<psi_serv::ResourceState> unavailable;
+		unavailable.set_value(psi_serv::ResourceState::UNAVAILABLE);
+		return unavailable.get_future().share();
+	}
+
+	void on_loaded(ResourceHandle h, LoadedCallback callback, psi_thread::TaskQueue queue) const override {
+		auto storage = _resources.find(h);
+		if (!storage) {
+			_task_submitter.submit_task([callback] { callback(nullptr); }, {}, nullptr, queue);
+			return;
+		}
+
+		auto w = std::make_unique<LoadWaiter>(LoadWaiter{std::move(callback), queue, nullptr});
+		if (storage->add_waiter(w.get())) {
+			w.release();
+			return;
+		}
+
+		// completed already
+		_dispatch(storage, std::move(w->callback), queue);
+	}
+
+	void on_reloaded(ResourceHandle h, LoadedCallback callback, psi_thread::TaskQueue queue) const override {
+		std::lock_guard<std::mutex> lock(_reload_mut);
+		_reload_listeners[h].push_back(ReloadListener{std::move(callback), queue});
 	}
 
 	psi_serv::ResourceState resource_state(ResourceHandle h) const override {
-		const_accessor access;
-		_resources.find(access, h);
-		if (access.empty())
-			return psi_serv::ResourceState::UNAVAILABLE;
+		auto storage = _resources.find(h);
+		return storage ? storage->state() : psi_serv::ResourceState::UNAVAILABLE;
+	}
 
-		return access->second.state();
+	bool set_priority(ResourceHandle h, float priority, Deadline deadline) const override {
+		std::shared_ptr<psi_thread::TaskPriority> p;
+		{
+			std::lock_guard<std::mutex> lock(_loading_mut);
+			auto it = _loading.find(h);
+			if (it != _loading.end())
+				p = it->second.lock();
+		}
+		if (!p || resource_state(h) != psi_serv::ResourceState::LOADING)
+			return false;
+
+		p->set_priority(priority);
+		p->set_deadline(deadline);
+		_read_stage.priorities_changed();
+		_decode_stage.priorities_changed();
+		return true;
+	}
+
+	void reprioritize(std::function<float(ResourceHandle)> const& importance) const override {
+		PSI_PROFILE_ZONE("ResourceLoader::reprioritize");
+
+		std::vector<std::pair<ResourceHandle, std::shared_ptr<psi_thread::TaskPriority>>> loading;
+		{
+			std::lock_guard<std::mutex> lock(_loading_mut);
+			loading.reserve(_loading.size());
+			for (auto it = _loading.begin(); it != _loading.end(); ) {
+				if (auto p = it->second.lock()) {
+					loading.emplace_back(it->first, std::move(p));
+					++it;
+				}
+				else {
+					// the job is gone, it completed or was dropped
+					it = _loading.erase(it);
+				}
+			}
+		}
+
+		// evaluated without the lock, the metric may be slow
+		for (auto& l : loading) {
+			l.second->set_priority(importance(l.first));
+		}
+
+		// also drops loads which were cancelled while waiting
+		_read_stage.priorities_changed();
+		_decode_stage.priorities_changed();
 	}
 
-	// TODO this method
 	psi_serv::ResourceState free_resource(ResourceHandle h) const override {
-		return psi_serv::ResourceState::UNAVAILABLE;
-	};
+		{
+			std::lock_guard<std::mutex> lock(_reload_mut);
+			_reload_listeners.erase(h);
+		}
+
+		auto storage = _resources.erase(h);
+		_unwatch(h);
+		if (!storage)
+			return psi_serv::ResourceState::UNAVAILABLE;
+
+		bool abandoned;
+		{
+			// serializes with _store, so the resource is either abandoned before it is stored or forgotten after
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			abandoned = storage->abandon();
+			if (!abandoned)
+				_forget(storage);
+		}
+
+		// skips the load task if it has not started, otherwise its result is dropped on completion
+		if (abandoned)
+			_notify(storage);
+
+		auto state = abandoned ? psi_serv::ResourceState::LOADING : storage->state();
+
+		psi_log::debug("ResourceLoader") << "Freed resource " << h << ".\n";
+		return state;
+	}
+
+	size_t resident_bytes() const override {
+		return _resident.load(std::memory_order_relaxed);
+	}
+
+	psi_serv::ResourceStats stats() const override {
+		psi_serv::ResourceStats stats;
+
+		// telemetry is never removed, so the loaders only need to be looked at while collecting it
+		std::vector<std::shared_ptr<LoaderTelemetry>> telemetry;
+		_loaders.for_each([&telemetry] (RegisteredLoader const& l) {
+			telemetry.push_back(l.telemetry);
+		});
+		telemetry.push_back(_function_telemetry);
+
+		for (auto const& t : telemetry) {
+			std::lock_guard<std::mutex> lock(t->mut);
+			if (t->stats.loaded || t->stats.failed)
+				stats.loaders.push_back(t->stats);
+		}
+		std::sort(stats.loaders.begin(), stats.loaders.end(), [] (psi_serv::LoaderStats const& a, psi_serv::LoaderStats const& b) {
+			return a.loader < b.loader;
+		});
+
+		auto get = [] (std::atomic<uint64_t> const& c) { return c.load(std::memory_order_relaxed); };
+		stats.request_hits = get(_counters.request_hits);
+		stats.request_misses = get(_counters.request_misses);
+		stats.retrieve_hits = get(_counters.retrieve_hits);
+		stats.retrieve_waits = get(_counters.retrieve_waits);
+		stats.retrieve_misses = get(_counters.retrieve_misses);
+		stats.evictions = get(_counters.evictions);
+		stats.evicted_bytes = get(_counters.evicted_bytes);
+		stats.deduplicated = get(_counters.deduplicated);
+		stats.reloads = get(_counters.reloads);
+
+		{
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			stats.resident_count = _clock.size();
+			stats.resident_bytes = _resident.load(std::memory_order_relaxed);
+		}
+		stats.reads_running = _read_stage.running();
+		stats.reads_waiting = _read_stage.waiting();
+		stats.decodes_running = _decode_stage.running();
+		stats.decodes_waiting = _decode_stage.waiting();
+		return stats;
+	}
 
 private:
-	std::unordered_map<ResourceLoaderId, std::function<boost::any(std::string const&)>> _loaders;
+	psi_serv::ResourceState _request(ResourceHandle h, RegisteredLoader const& loader, std::string param, float priority, Deadline deadline) const {
+		// insert the Loading element right away, so that concurrent requests for the same handle
+		// see it and only the first one submits a load
+		auto storage = std::make_shared<ResourceStorage>();
+		auto existing = _resources.insert(h, storage);
+		if (existing != storage) {
+			_count(_counters.request_hits);
+			return existing->state();
+		}
+		_count(_counters.request_misses);
+
+		if (_watcher && (loader.loader->watch || loader.loader->file))
+			_watch(h, storage, loader, param);
+
+		// the job may outlive this call, so it owns its parameters
+		auto job = std::make_shared<LoadJob>(LoadJob{h, storage, loader.loader, std::move(param), {}, _hold(),
+			std::make_shared<psi_thread::TaskPriority>(priority, deadline)});
+		job->telemetry = loader.telemetry;
+		{
+			// expires with the job
+			std::lock_guard<std::mutex> lock(_loading_mut);
+			_loading[h] = job->priority;
+		}
+		_submit(job);
+
+		// happens concurrently with the tasks submitted to the stages
+		return psi_serv::ResourceState::LOADING;
+	}
+
+	void _submit(std::shared_ptr<LoadJob> const& job) const {
+		auto const& token = job->storage->cancel_token;
+		// read on an I/O thread, so that workers stay free for frame work
+		if (job->loader->file)
+			_read_stage.push_async([this, job] (psi_thread::PipelineStage::Done done) { _read_file(job, std::move(done)); }, token, job->priority);
+		else
+			_read_stage.push([this, job] { _read(job); }, token, job->priority);
+	}
+
+	/// Starts watching the files a resource is loaded from.
+	void _watch(ResourceHandle h, std::shared_ptr<ResourceStorage> const& storage, RegisteredLoader const& loader, std::string const& param) const {
+		std::vector<std::string> files;
+		try {
+			files = loader.loader->watch ? loader.loader->watch(param) : std::vector<std::string>{loader.loader->file(param)};
+		}
+		catch (std::exception const& e) {
+			psi_log::warning("ResourceLoader") << "Cannot watch resource " << h << " for changes: " << e.what() << "\n";
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(_reload_mut);
+		// freed already, _unwatch ran before this and found nothing to remove
+		if (!_watcher || _resources.find(h) != storage)
+			return;
+
+		auto watched = std::make_shared<WatchedResource>(WatchedResource{loader.loader, loader.telemetry, param, {}});
+		for (auto const& f : files) {
+			try {
+				_watcher->watch(f);
+			}
+			catch (std::exception const& e) {
+				psi_log::warning("ResourceLoader") << "Cannot watch resource " << h << " for changes: " << e.what() << "\n";
+				continue;
+			}
+			watched->files.push_back(psi_util::FileWatcher::normalize(f).string());
+		}
+
+		// requested again after being evicted, the previous request's files may differ
+		_drop_watched(h);
+		for (auto const& f : watched->files) {
+			_watched_files[f].insert(h);
+		}
+		_watched[h] = std::move(watched);
+	}
+
+	/// Stops watching the files of a resource which left the table, unless it was requested again meanwhile.
+	/// Resources with reload listeners stay watched until they are freed, _reload loads them again.
+	void _unwatch(ResourceHandle h) const {
+		std::lock_guard<std::mutex> lock(_reload_mut);
+		if (_watcher && !_resources.find(h) && !_reload_listeners.count(h))
+			_drop_watched(h);
+	}
+
+	/// Forgets a watched resource and stops watching files nothing else is loaded from. Requires _reload_mut.
+	void _drop_watched(ResourceHandle h) const {
+		auto watched = _watched.find(h);
+		if (watched == _watched.end())
+			return;
+
+		for (auto const& f : watched->second->files) {
+			auto handles = _watched_files.find(f);
+			if (handles == _watched_files.end())
+				continue;
+
+			handles->second.erase(h);
+			if (!handles->second.empty())
+				continue;
+
+			_watched_files.erase(handles);
+			_watcher->unwatch(f);
+		}
+		_watched.erase(watched);
+	}
+
+	/// Reloads the resources loaded from any of the changed files. Runs on the watcher's thread.
+	void _reload_files(std::vector<boost::filesystem::path> const& files) const {
+		// a resource loaded from several changed files is reloaded once
+		std::unordered_map<ResourceHandle, std::shared_ptr<WatchedResource>> reloads;
+		{
+			std::lock_guard<std::mutex> lock(_reload_mut);
+			for (auto const& f : files) {
+				auto it = _watched_files.find(f.string());
+				if (it == _watched_files.end())
+					continue;
+
+				for (auto h : it->second) {
+					auto w = _watched.find(h);
+					if (w != _watched.end())
+						reloads.emplace(h, w->second);
+				}
+			}
+		}
+
+		for (auto const& r : reloads) {
+			_reload(r.first, r.second);
+		}
+	}
+
+	/// Loads a new version of a resource, which is swapped in once it finishes loading.
+	/// The current version stays available meanwhile, and for good if the new one fails to load.
+	void _reload(ResourceHandle h, std::shared_ptr<WatchedResource> const& watched) const {
+		auto current = _resources.find(h);
+		if (!current) {
+			_reload_evicted(h, watched);
+			return;
+		}
+		uint64_t generation;
+		{
+			// serializes with _swap, so that a swap either happened before this or loses to it,
+			// and with _store, so that a pending reload is either seen by it or not needed
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			// one still loading might have read the old contents already
+			if (current->state() == psi_serv::ResourceState::LOADING) {
+				watched->reload_pending = true;
+				return;
+			}
+			if (current->state() != psi_serv::ResourceState::AVAILABLE)
+				return;
+			generation = ++watched->generation;
+		}
+
+		auto job = std::make_shared<LoadJob>(LoadJob{h, std::make_shared<ResourceStorage>(), watched->loader, watched->param, {}, _hold(),
+			std::make_shared<psi_thread::TaskPriority>()});
+		job->reload = watched;
+		job->replaces = std::move(current);
+		job->generation = generation;
+		job->telemetry = watched->telemetry;
+
+		psi_log::info("ResourceLoader") << "Reloading resource " << h << ".\n";
+		_submit(job);
+	}
+
+	/// Loads an evicted resource again if its reload listeners still use an old version of it, e.g. a GL copy,
+	/// and passes them the new one. Others are loaded from the changed files anyway once they are requested again.
+	void _reload_evicted(ResourceHandle h, std::shared_ptr<WatchedResource> const& watched) const {
+		std::vector<ReloadListener> listeners;
+		{
+			std::lock_guard<std::mutex> lock(_reload_mut);
+			auto it = _reload_listeners.find(h);
+			if (it == _reload_listeners.end())
+				return;
+			listeners = it->second;
+		}
+
+		psi_log::info("ResourceLoader") << "Reloading evicted resource " << h << ".\n";
+		_request(h, RegisteredLoader{watched->loader, watched->telemetry}, watched->param, 0.0f, Deadline::max());
+		for (auto& l : listeners) {
+			// a failed load keeps the previous version, like a failed reload
+			on_loaded(h, [callback = std::move(l.callback)] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+				if (lock)
+					callback(std::move(lock));
+			}, l.queue);
+		}
+	}
+
+	/// Completes the bundle once all of its children completed.
+	void _child_completed(BundleJob& job) const {
+		if (job.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		if (job.failed.load(std::memory_order_relaxed)) {
+			psi_log::error("ResourceLoader") << "Loading bundle " << job.handle << " failed, some of its resources are unavailable.\n";
+			_resources.erase(job.handle, job.storage);
+			if (job.storage->abandon())
+				_notify(job.storage);
+			return;
+		}
+
+		std::vector<std::pair<size_t, psi_serv::Resource>> resources;
+		resources.reserve(job.children.size());
+		for (auto const& c : job.children) {
+			resources.emplace_back(c.handle, c.lock->resource());
+		}
+
+		{
+			// serializes with free_resource like _store
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			if (!job.storage->store_load(psi_serv::Resource::make(psi_serv::ResourceBundle(std::move(resources))), 0))
+				return;
+
+			// the children's bytes are counted already, the bundle only decides when they are evicted;
+			// one reloaded since it was requested is held in its current version, _swap moves later ones along
+			for (auto const& c : job.children) {
+				auto child = _resources.find(c.handle);
+				if (!child)
+					child = c.storage;
+				child->pin();
+				child->bundles.push_back(job.storage.get());
+				job.storage->bundled.emplace_back(c.handle, std::move(child));
+			}
+			job.storage->clock_pos = _clock.emplace(_hand, job.handle, job.storage);
+			job.storage->in_clock = true;
+		}
+
+		psi_log::debug("ResourceLoader") << "Loaded bundle " << job.handle << " of " << job.children.size() << " resources successfully.\n";
+		_notify(job.storage);
+	}
+
+	/// Counts a job as in flight until the returned pointer and all its copies are gone.
+	std::shared_ptr<void> _hold() const {
+		_in_flight.fetch_add(1);
+		return std::shared_ptr<void>(nullptr, [this] (void*) {
+			// last use of this, the destructor may proceed afterwards
+			std::lock_guard<std::mutex> lock(_idle_mut);
+			if (_in_flight.fetch_sub(1) == 1)
+				_idle.notify_all();
+		});
+	}
+
+	void _read(std::shared_ptr<LoadJob> const& job) const {
+		PSI_PROFILE_ZONE("ResourceLoader::read", job->handle);
+
+		job->wait_us += job->lap();
+		if (!_run_stage(*job, [&job] { return job->loader->read(job->param); }))
+			return;
+		job->read_us += job->lap();
+
+		_decode_or_finalize(job);
+	}
+
+	/// Submits the file read and calls done once it completes. The read stays in the read stage meanwhile.
+	void _read_file(std::shared_ptr<LoadJob> const& job, psi_thread::PipelineStage::Done done) const {
+		job->wait_us += job->lap();
+
+		psi_util::FileRead read;
+		try {
+			if (_closing.load(std::memory_order_relaxed))
+				throw std::runtime_error("ResourceLoader is shutting down");
+			read.file = job->loader->file(job->param);
+		}
+		catch (std::exception const& e) {
+			_fail(*job, e);
+			done();
+			return;
+		}
+
+		// runs on the reader's completion thread
+		read.callback = [this, job, done] (std::vector<char> data, std::exception_ptr error) {
+			job->read_us += job->lap();
+			if (!error) {
+				std::lock_guard<std::mutex> lock(job->telemetry->mut);
+				job->telemetry->stats.bytes_read += data.size();
+			}
+
+			bool ok = _run_stage(*job, [&] {
+				if (error)
+					std::rethrow_exception(error);
+				return psi_serv::Resource::make(std::move(data));
+			});
+			if (ok)
+				_decode_or_finalize(job);
+			done();
+		};
+		_file_reader.read(std::move(read));
+	}
+
+	void _decode_or_finalize(std::shared_ptr<LoadJob> const& job) const {
+		if (job->loader->decode)
+			_decode_stage.push([this, job] { _decode(job); }, job->storage->cancel_token, job->priority);
+		else
+			_finalize(job);
+	}
+
+	void _decode(std::shared_ptr<LoadJob> const& job) const {
+		PSI_PROFILE_ZONE("ResourceLoader::decode", job->handle);
+
+		job->wait_us += job->lap();
+		if (_share_decoded(job))
+			return;
+
+		if (!_run_stage(*job, [&job] { return job->loader->decode(job->data); }))
+			return;
+		job->decode_us += job->lap();
+
+		_finalize(job);
+	}
+
+	/// Looks for a resource decoded from the same raw data and completes the job with its data once it is
+	/// loaded, instead of decoding the same data again. Falls back to decoding if that resource fails to load.
+	/// @return whether the job waits for the other resource
+	bool _share_decoded(std::shared_ptr<LoadJob> const& job) const {
+		// finalize runs on the main thread, so waiting for another load's finalize could block the destructor
+		if (!_dedup || job->dedup_checked || job->reload || job->loader->finalize)
+			return false;
+		job->dedup_checked = true;
+
+		uint64_t hash;
+		try {
+			if (job->loader->content_hash) {
+				hash = job->loader->content_hash(job->data);
+			}
+			else if (job->loader->file) {
+				auto const& bytes = *job->data.get<std::vector<char>>();
+				hash = psi_util::xxh64(bytes.data(), bytes.size());
+			}
+			else {
+				return false;
+			}
+		}
+		catch (std::exception const& e) {
+			psi_log::warning("ResourceLoader") << "Hashing resource " << job->handle << " failed: " << e.what() << "\n";
+			return false;
+		}
+
+		std::shared_ptr<ResourceStorage> canonical;
+		{
+			std::lock_guard<std::mutex> lock(_content_mut);
+			auto& entry = _contents[ContentKey{job->loader.get(), hash}];
+			canonical = entry.lock();
+			if (!canonical || canonical->state() == psi_serv::ResourceState::UNAVAILABLE) {
+				// the first of its contents, others will wait for it
+				entry = job->storage;
+				_prune_contents();
+				return false;
+			}
+		}
+
+		psi_log::debug("ResourceLoader") << "Resource " << job->handle << " has the same contents as a loaded one, sharing it.\n";
+
+		auto w = std::make_unique<LoadWaiter>(LoadWaiter{
+			[this, job] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+				if (!lock) {
+					// it failed or was freed, decode this one after all
+					_decode_stage.push([this, job] { _decode(job); }, job->storage->cancel_token, job->priority);
+					return;
+				}
+
+				job->decode_us += job->lap();
+				if (_run_stage(*job, [&lock] { return lock->resource(); })) {
+					job->shared = true;
+					_count(_counters.deduplicated);
+					_complete(*job);
+				}
+			},
+			psi_thread::TaskQueue::WORKER,
+			nullptr
+		});
+		if (canonical->add_waiter(w.get()))
+			w.release();
+		else
+			_dispatch(canonical, std::move(w->callback), psi_thread::TaskQueue::WORKER);
+		return true;
+	}
+
+	/// Drops entries of resources which are gone, once the table doubled since the last time. Requires _content_mut.
+	void _prune_contents() const {
+		if (_contents.size() < 2 * _contents_pruned_size + 64)
+			return;
+
+		for (auto it = _contents.begin(); it != _contents.end(); ) {
+			if (it->second.expired())
+				it = _contents.erase(it);
+			else
+				++it;
+		}
+		_contents_pruned_size = _contents.size();
+	}
+
+	/// Runs the finalize stage on the main thread if the loader has one, stores the resource otherwise.
+	void _finalize(std::shared_ptr<LoadJob> const& job) const {
+		if (!job->loader->finalize) {
+			_complete(*job);
+			return;
+		}
+
+		// the main thread only runs its tasks between frames, so the job must not hold up the destructor
+		// once it is queued there. Released at the end of this scope, after the last use of this.
+		auto busy = std::move(job->busy);
+		_task_submitter.submit_task(
+			[this, alive = std::weak_ptr<char>(_alive), job] {
+				// the loader is owned by the main thread, so it cannot go away while this runs
+				if (alive.expired()) {
+					job->storage->abandon();
+					return;
+				}
+
+				PSI_PROFILE_ZONE("ResourceLoader::finalize", job->handle);
+				if (_run_stage(*job, [&job] { return job->loader->finalize(job->data); })) {
+					job->finalize_us += job->lap();
+					_complete(*job);
+				}
+			},
+			{},
+			&job->storage->cancel_token,
+			psi_thread::TaskQueue::MAIN
+		);
+	}
+
+	/// Replaces the job's data with the output of the stage.
+	/// @return false if the stage failed, the load is then abandoned, or the load was cancelled
+	template <typename F>
+	bool _run_stage(LoadJob& job, F&& stage) const {
+		// freed meanwhile, nobody wants the result
+		if (job.storage->cancel_token.is_cancelled())
+			return false;
+
+		try {
+			if (_closing.load(std::memory_order_relaxed))
+				throw std::runtime_error("ResourceLoader is shutting down");
+			job.data = stage();
+			return true;
+		}
+		catch (std::exception const& e) {
+			_fail(job, e);
+			return false;
+		}
+	}
+
+	void _fail(LoadJob& job, std::exception const& e) const {
+		psi_log::error("ResourceLoader") << (job.reload ? "Reloading" : "Loading") << " resource " << job.handle
+			<< " failed with error: " << e.what() << (job.reload ? ", keeping the previous version.\n" : "\n");
+		// delete and quit if loading failed
+		_resources.erase(job.handle, job.storage);
+		if (!job.reload)
+			_unwatch(job.handle);
+		if (job.storage->abandon())
+			_notify(job.storage);
+
+		std::lock_guard<std::mutex> lock(job.telemetry->mut);
+		++job.telemetry->stats.failed;
+	}
+
+	void _complete(LoadJob& job) const {
+		{
+			auto& stats = job.telemetry->stats;
+			std::lock_guard<std::mutex> lock(job.telemetry->mut);
+			++stats.loaded;
+			stats.wait_us.add(job.wait_us);
+			stats.read_us.add(job.read_us);
+			stats.decode_us.add(job.decode_us);
+			stats.finalize_us.add(job.finalize_us);
+			stats.total_us.add(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - job.requested).count()));
+		}
+
+		// the data of a shared resource is counted once already, by the one which decoded it
+		size_t bytes = job.loader->size_of && !job.shared ? job.loader->size_of(job.data) : 0;
+		if (job.reload)
+			_swap(job, bytes);
+		else
+			_store(job.handle, job.storage, std::move(job.data), bytes);
+	}
+
+	/// Swaps a reloaded version in for the one it replaces, unless that was freed or a newer reload started.
+	void _swap(LoadJob& job, size_t bytes) const {
+		{
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			if (job.generation != job.reload->generation
+				|| !job.storage->store_load(std::move(job.data), bytes)
+				|| !_resources.replace(job.handle, job.replaces, job.storage))
+				return;
+
+			// holders of the old version keep it alive, it just stops counting towards the budget
+			_forget(job.replaces);
+
+			// bundles holding the old version pin and evict the new one instead
+			for (auto bundle : job.replaces->bundles) {
+				for (auto& c : bundle->bundled) {
+					if (c.second == job.replaces)
+						c.second = job.storage;
+				}
+				job.storage->pin();
+				job.replaces->unpin();
+			}
+			job.storage->bundles = std::move(job.replaces->bundles);
+			job.replaces->bundles.clear();
+			job.storage->clock_pos = _clock.emplace(_hand, job.handle, job.storage);
+			job.storage->in_clock = true;
+			_resident.fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		_count(_counters.reloads);
+		psi_log::info("ResourceLoader") << "Reloaded resource " << job.handle << " (" << bytes << " bytes).\n";
+
+		std::vector<ReloadListener> listeners;
+		{
+			std::lock_guard<std::mutex> lock(_reload_mut);
+			auto it = _reload_listeners.find(job.handle);
+			if (it != _reload_listeners.end())
+				listeners = it->second;
+		}
+		for (auto& l : listeners) {
+			_dispatch(job.storage, std::move(l.callback), l.queue);
+		}
+
+		_enforce_budget();
+	}
+
+	void _store(ResourceHandle h, std::shared_ptr<ResourceStorage> const& storage, psi_serv::Resource&& res, size_t bytes) const {
+		{
+			// a concurrent free either abandoned it already or forgets it after it is fully accounted for
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			if (!storage->store_load(std::move(res), bytes))
+				return;
 
-	mutable tbb::concurrent_hash_map<size_t, ResourceStorage> _resources;
+			// new resources go right behind the hand, as far from eviction as possible
+			storage->clock_pos = _clock.emplace(_hand, h, storage);
+			storage->in_clock = true;
+			_resident.fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		psi_log::debug("ResourceLoader") << "Loaded resource " << h << " (" << bytes << " bytes) successfully.\n";
+		_notify(storage);
+		_reload_pending(h);
+		_enforce_budget();
+	}
+
+	/// Starts the reload of a resource whose files changed while it was loading.
+	void _reload_pending(ResourceHandle h) const {
+		if (_closing.load(std::memory_order_relaxed))
+			return;
+
+		std::shared_ptr<WatchedResource> watched;
+		{
+			std::lock_guard<std::mutex> lock(_reload_mut);
+			auto it = _watched.find(h);
+			if (it == _watched.end())
+				return;
+			watched = it->second;
+		}
+		{
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			if (!std::exchange(watched->reload_pending, false))
+				return;
+		}
+
+		_reload(h, watched);
+	}
+
+	/// Creates a lock on an available resource and marks it as recently used.
+	std::unique_ptr<psi_serv::IResourceLock> _lock(std::shared_ptr<ResourceStorage> const& storage) const {
+		std::unique_ptr<psi_serv::IResourceLock> lock = std::make_unique<ResourceLock>(storage);
+		storage->referenced.store(true, std::memory_order_relaxed);
+		return lock;
+	}
+
+	/// Submits a completion callback to its queue.
+	/// The task does not reference this, main queue tasks may run after the loader is gone.
+	void _dispatch(std::shared_ptr<ResourceStorage> const& storage, LoadedCallback callback, psi_thread::TaskQueue queue) const {
+		_task_submitter.submit_task(
+			[storage, callback] {
+				if (storage->state() == psi_serv::ResourceState::AVAILABLE)
+					callback(std::make_unique<ResourceLock>(storage));
+				else
+					callback(nullptr);
+			},
+			{},
+			nullptr,
+			queue
+		);
+	}
+
+	/// Dispatches all callbacks waiting for a storage which completed loading.
+	void _notify(std::shared_ptr<ResourceStorage> const& storage) const {
+		LoadWaiter* w = storage->close_waiters();
+		while (w) {
+			std::unique_ptr<LoadWaiter> owned(std::exchange(w, w->next));
+			_dispatch(storage, std::move(owned->callback), owned->queue);
+		}
+	}
+
+	/// Removes a resource from the eviction clock and the byte count. Requires _clock_mut.
+	void _forget(std::shared_ptr<ResourceStorage> const& storage) const {
+		if (!storage->in_clock)
+			return;
+
+		if (_hand == storage->clock_pos)
+			++_hand;
+		_clock.erase(storage->clock_pos);
+		storage->in_clock = false;
+		_resident.fetch_sub(storage->bytes(), std::memory_order_relaxed);
+
+		// a bundle's children may be evicted on their own again
+		for (auto const& c : storage->bundled) {
+			c.second->unpin();
+			auto& bundles = c.second->bundles;
+			bundles.erase(std::remove(bundles.begin(), bundles.end(), storage.get()), bundles.end());
+		}
+		storage->bundled.clear();
+	}
+
+	/// Evicts unlocked resources which were not used recently until the resident size fits the budget.
+	void _enforce_budget() const {
+		if (_budget == 0 || _resident.load(std::memory_order_relaxed) <= _budget)
+			return;
+
+		std::vector<std::pair<size_t, std::shared_ptr<ResourceStorage>>> victims;
+		{
+			std::lock_guard<std::mutex> lock(_clock_mut);
+			// two full sweeps clear every reference bit, a third finding nothing means all are locked
+			size_t steps = _clock.size() * 3;
+			while (steps-- > 0 && !_clock.empty() && _resident.load(std::memory_order_relaxed) > _budget) {
+				if (_hand == _clock.end())
+					_hand = _clock.begin();
+
+				auto& storage = _hand->second;
+				if (storage->is_pinned() || storage->referenced.exchange(false, std::memory_order_relaxed)) {
+					++_hand;
+					continue;
+				}
+
+				victims.push_back(*_hand);
+				auto children = victims.back().second->bundled;
+				// the copy, the node goes away
+				_forget(victims.back().second);
+
+				// a bundle goes as a unit, with the children nothing else holds on to
+				for (auto& c : children) {
+					if (c.second->in_clock && !c.second->is_pinned()) {
+						_forget(c.second);
+						victims.push_back(std::move(c));
+					}
+				}
+			}
+		}
+
+		// removing from the table does not free anything that is still locked or referenced elsewhere
+		for (auto const& v : victims) {
+			_resources.erase(v.first, v.second);
+			_unwatch(v.first);
+		}
+
+		if (!victims.empty()) {
+			size_t bytes = 0;
+			for (auto const& v : victims) {
+				bytes += v.second->bytes();
+			}
+			_count(_counters.evictions, victims.size());
+			_count(_counters.evicted_bytes, bytes);
+
+			psi_log::debug("ResourceLoader") << "Evicted " << victims.size() << " resources, "
+				<< _resident.load(std::memory_order_relaxed) << " of " << _budget << " bytes resident.\n";
+		}
+	}
+
+	/// Counts an event for ResourceStats.
+	static void _count(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+		counter.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	/// Requests read it concurrently with registration.
+	LoaderRegistry _loaders;
+	/// Statistics of loads by function, which have no loader id.
+	std::shared_ptr<LoaderTelemetry> _function_telemetry = std::make_shared<LoaderTelemetry>();
+
+	/// Counters of ResourceStats, the rest of them is taken from the state of the loader.
+	struct Counters {
+		std::atomic<uint64_t> request_hits{0};
+		std::atomic<uint64_t> request_misses{0};
+		std::atomic<uint64_t> retrieve_hits{0};
+		std::atomic<uint64_t> retrieve_waits{0};
+		std::atomic<uint64_t> retrieve_misses{0};
+		std::atomic<uint64_t> evictions{0};
+		std::atomic<uint64_t> evicted_bytes{0};
+		std::atomic<uint64_t> deduplicated{0};
+		std::atomic<uint64_t> reloads{0};
+	};
+	mutable Counters _counters;
+
+	mutable ResourceTable _resources;
 	psi_thread::TaskManager const& _task_submitter;
+
+	/// Maximum resident bytes, 0 for unlimited.
+	size_t const _budget;
+	mutable std::atomic<size_t> _resident;
+	/// Available resources in a ring swept by the CLOCK eviction hand. Only writers lock it.
+	mutable std::mutex _clock_mut;
+	mutable std::list<std::pair<size_t, std::shared_ptr<ResourceStorage>>> _clock;
+	mutable std::list<std::pair<size_t, std::shared_ptr<ResourceStorage>>>::iterator _hand = _clock.end();
+
+	mutable psi_util::AsyncFileReader _file_reader;
+	/// Reads feed decodes, which hold reads back while they are saturated.
+	mutable psi_thread::PipelineStage _read_stage;
+	mutable psi_thread::PipelineStage _decode_stage;
+
+	/// The first resource decoded from each raw data, which later ones with the same data share.
+	bool const _dedup;
+	mutable std::mutex _content_mut;
+	mutable std::unordered_map<ContentKey, std::weak_ptr<ResourceStorage>, ContentKeyHash> _contents;
+	mutable size_t _contents_pruned_size = 0;
+
+	/// Priorities of loading resources, by handle. Entries expire with their jobs.
+	mutable std::mutex _loading_mut;
+	mutable std::unordered_map<ResourceHandle, std::weak_ptr<psi_thread::TaskPriority>> _loading;
+
+	/// Number of load jobs in the read or decode stage.
+	mutable std::atomic<size_t> _in_flight;
+	std::atomic<bool> _closing;
+	mutable std::mutex _idle_mut;
+	mutable std::condition_variable _idle;
+	/// Expires with the loader, main thread tasks check it since they are not waited for.
+	std::shared_ptr<char> _alive;
+
+	/// Set if hot reloading is enabled and inotify is available.
+	std::unique_ptr<psi_util::FileWatcher> _watcher;
+	/// Guards the watched resources, the files they are loaded from and the reload listeners.
+	mutable std::mutex _reload_mut;
+	mutable std::unordered_map<ResourceHandle, std::shared_ptr<WatchedResource>> _watched;
+	mutable std::unordered_map<std::string, std::set<ResourceHandle>> _watched_files;
+	mutable std::unordered_map<ResourceHandle, std::vector<ReloadListener>> _reload_listeners;
 };
 
 std::unique_ptr<psi_serv::IResourceService> psi_serv::start_resource_loader(ResourceLoaderArgs args) {
-	auto loader = new ResourceLoader(args.task_submitter);
+	auto loader = new ResourceLoader(args);
 
 	psi_log::info("ResourceLoader") << "Initialized the ResourceLoader service successfully.\n";
 	return std::unique_ptr<IResourceService>(loader);
@@ -22,12 +22,32 @@
 
 #include "../../thread/manager.hpp"
 #include "../../service/resource.hpp"
+#include "../../util/async_file.hpp"
 
 
 namespace psi_serv {
 /// Arguments required to start the ResourceLoader service.
 struct ResourceLoaderArgs {
 	psi_thread::TaskManager const& task_submitter;
+	/// Least recently used resources which are not locked get evicted to keep the
+	/// total size of loaded resources within this many bytes. 0 means unlimited.
+	size_t memory_budget = 0;
+	/// Maximum number of resource handles held at once, rounded up to a power of two.
+	/// Freed and evicted handles give their table slot back.
+	size_t max_resources = 1 << 16;
+	/// Maximum number of loads in the read stage at once. Asynchronous file reads do not occupy a thread,
+	/// so this may exceed the number of I/O threads by far.
+	size_t max_reads = 128;
+	/// Maximum number of loads in the decode stage at once. 0 means one more than there are workers.
+	size_t max_decodes = 0;
+	/// Configures the reader used by file loaders.
+	psi_util::AsyncFileReaderArgs file_reader = {};
+	/// Decode resources of the same loader with identical raw data once and share the result,
+	/// see StagedLoader::content_hash. The memory budget counts a shared resource once, for the handle which decoded it.
+	bool deduplicate = true;
+	/// Watch the files of loaded resources and reload them in the background when they change.
+	/// Loaders report their files through StagedLoader::watch.
+	bool hot_reload = false;
 };
 
 std::unique_ptr<IResourceService> start_resource_loader(ResourceLoaderArgs);
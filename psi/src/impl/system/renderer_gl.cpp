@@ -21,6 +21,14 @@
 #include "renderer_gl.hpp"
 
 #include <string>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_set>
+#include <cstring>
 #include <codecvt>
 #include <locale>
 
@@ -30,14 +38,89 @@
 #include "../../scene/components.hpp"
 #include "../scene/default_components.hpp"
 #include "../rendering/camera.hpp"
+#include "../rendering/prefetch.hpp"
 #include "../../log/log.hpp"
+#include "../../profile/profiler.hpp"
+#include "../../util/hash.hpp"
+
+using namespace psi_serv::literals;
+
+/// How many pixels a coarser mesh detail level may stray from the full detail one by before a finer one is drawn.
+static constexpr float MAX_LEVEL_PIXEL_ERROR = 1.0f;
+
+/// Loaders the game registers, computed at compile time since some are compared against every frame.
+static constexpr psi_serv::IResourceService::ResourceLoaderId MESH_LOADER = u8"mesh"_rid;
+static constexpr psi_serv::IResourceService::ResourceLoaderId TEXTURE_LOADER = u8"texture"_rid;
+static constexpr psi_serv::IResourceService::ResourceLoaderId SHADER_LOADER = u8"shader"_rid;
+
+/// GL objects uploaded from resources, by name. Names whose resources share data, e.g. because the
+/// resource service found their files to be identical, share one object.
+template <typename Data, typename Object>
+class SharedUploads {
+public:
+	SharedUploads(std::function<Object(Data const&)> upload, std::function<void(Object&)> free)
+		: _upload(std::move(upload))
+		, _free(std::move(free)) {}
+
+	/// Points the name at the object uploaded from the data, uploading it unless another name uses it already.
+	/// The object the name pointed at before is freed if no other name uses it anymore.
+	void set(std::string const& name, std::shared_ptr<Data const> const& data) {
+		std::weak_ptr<Data const> key = data;
+		auto it = _objects.find(key);
+		if (it == _objects.end())
+			it = _objects.emplace(key, Shared{_upload(*data), 0}).first;
+		++it->second.users;
+
+		auto named = _names.find(name);
+		if (named != _names.end()) {
+			_release(named->second);
+			named->second = key;
+		}
+		else {
+			_names.emplace(name, key);
+		}
+	}
+
+	/// @return the object of the name or nullptr if it is not uploaded
+	Object* find(std::string const& name) {
+		auto named = _names.find(name);
+		return named != _names.end() ? &_objects.at(named->second).object : nullptr;
+	}
+	Object const* find(std::string const& name) const {
+		return const_cast<SharedUploads*>(this)->find(name);
+	}
+
+private:
+	struct Shared {
+		Object object;
+		size_t users;
+	};
+
+	void _release(std::weak_ptr<Data const> const& key) {
+		auto it = _objects.find(key);
+		if (--it->second.users > 0)
+			return;
+
+		_free(it->second.object);
+		_objects.erase(it);
+	}
+
+	std::function<Object(Data const&)> _upload;
+	std::function<void(Object&)> _free;
+
+	std::unordered_map<std::string, std::weak_ptr<Data const>> _names;
+	/// Keyed by the data's control block, which outlives the data as long as a weak pointer does,
+	/// so new data can never be mistaken for freed data at the same address. The data itself is not kept alive.
+	std::map<std::weak_ptr<Data const>, Shared, std::owner_less<std::weak_ptr<Data const>>> _objects;
+};
 
 
 class SystemGLRenderer : public psi_sys::ISystem {
 public:
-	SystemGLRenderer(psi_thread::TaskManager const& tasks, psi_serv::ServiceManager const& serv)
+	SystemGLRenderer(psi_thread::TaskManager const& tasks, psi_serv::ServiceManager const& serv, psi_rndr::PrefetchArgs const& prefetch)
 		: _tasks(tasks)
 		, _serv(serv)
+		, _prefetcher(prefetch)
 		, _mrt_buf(std::vector<psi_gl::FramebufferRenderTargetCreationInfo>(), 2, 2) {}
 
 	psi_scene::ComponentTypeIdBitset required_components() const override {
@@ -123,84 +206,353 @@ public:
 	}
 
 	void on_scene_loaded(psi_scene::ISceneDirectAccess& acc) override {
+		PSI_PROFILE_ZONE("SystemGLRenderer::on_scene_loaded");
+
 		register_input_handlers();
 
 		gl_3d_state_setup();
 		create_mrt_framebuffer();
 		create_tex_samplers();
+		create_placeholder_texture();
+
+		auto const& res = _serv.resource_service();
 
-		std::hash<std::string> hash;
-		_serv.resource_service().request_resource(hash(u8"deferred_geometry"), hash(u8"shader"), u8"glsl/deferred_geometry");
+		// what is visible from the start is requested in one batch up front, so that it loads in parallel,
+		// the rest of the scene streams in as the camera approaches it
+		LoadBatch batch;
+		batch.requests = {
+			{ u8"deferred_geometry"_rid, SHADER_LOADER, u8"glsl/deferred_geometry" },
+			{ u8"deferred_quad"_rid, SHADER_LOADER, u8"glsl/quad" },
+		};
+		_prefetcher.sample_camera(_cam.position());
+		add_visible_models(acc, batch);
+
+
+
+
+		//  -- TEST --
 		{
-			auto pass_first = *_serv.resource_service().retrieve_resource(hash(u8"deferred_geometry"));
-			_compiled_shaders[u8"deferred_gbuffer"] = psi_gl::compile_glsl_source(boost::any_cast<psi_gl::GLSLSource>(pass_first->resource()));
+			add_resource(batch, u8"meshes/cone_flat", MESH_LOADER);
+			add_resource(batch, u8"textures/default", TEXTURE_LOADER);
+			add_resource(batch, u8"textures/default_normal", TEXTURE_LOADER);
 		}
+		// -- END TEST --
 
-		_serv.resource_service().request_resource(hash(u8"deferred_quad"), hash(u8"shader"), u8"glsl/quad");
-		{
-			auto pass_second = *_serv.resource_service().retrieve_resource(hash(u8"deferred_quad"));
-			_compiled_shaders[u8"deferred_quad"] = psi_gl::compile_glsl_source(boost::any_cast<psi_gl::GLSLSource>(pass_second->resource()));
+		submit(batch);
+
+		// shaders are needed for the first frame, wait for them while the rest keeps loading
+		auto shaders = res.retrieve_all({ u8"deferred_geometry"_rid, u8"deferred_quad"_rid });
+		if (!shaders[0] || !shaders[1])
+			throw std::runtime_error("Deferred rendering shaders are unavailable.");
+
+		_compiled_shaders[u8"deferred_gbuffer"] = psi_gl::compile_glsl_source((*shaders[0])->get<psi_gl::GLSLSource>());
+		_compiled_shaders[u8"deferred_quad"] = psi_gl::compile_glsl_source((*shaders[1])->get<psi_gl::GLSLSource>());
+		recompile_shader_when_reloaded(u8"deferred_gbuffer", u8"deferred_geometry"_rid);
+		recompile_shader_when_reloaded(u8"deferred_quad", u8"deferred_quad"_rid);
+	}
+
+	/// The mesh and textures of a model, requested as one bundle. The mesh is the first child.
+	struct ModelBundle {
+		psi_serv::IResourceService::ResourceHandle handle;
+		std::vector<psi_serv::IResourceService::ResourceRequest> children;
+	};
+
+	/// Resources requested together. Meshes and textures are uploaded once they are loaded.
+	struct LoadBatch {
+		std::vector<psi_serv::IResourceService::ResourceRequest> requests;
+		std::vector<ModelBundle> models;
+	};
+
+	/// Returns the handle of the bundle of a model's mesh and textures, which models with the same ones share.
+	static psi_serv::IResourceService::ResourceHandle model_bundle_id(psi_scene::ComponentModel const& model) {
+		// combines the ids of the names instead of hashing them joined, so that nothing is allocated every frame
+		constexpr uint64_t seed = u8"model"_rid;
+		uint64_t h = seed;
+		for (char const* name : { model.mesh_name.data(), model.albedo_tex.data(), model.normal_tex.data(), model.reflectiveness_roughness_tex.data() }) {
+			h = (h ^ psi_util::fnv1a_64(name, std::strlen(name))) * 0x100000001b3ull;
+		}
+		return h;
+	}
+
+	/// Adds a resource which is not part of a model to the batch unless it was requested already.
+	void add_resource(LoadBatch& batch, std::string const& name, psi_serv::IResourceService::ResourceLoaderId loader) {
+		auto h = psi_serv::resource_id(name);
+		if (!_requested.insert(h).second)
+			return;
+
+		_pending.insert(h);
+		batch.requests.push_back({ h, loader, name });
+	}
+
+	/// Adds the bundle of a model's mesh and textures to the batch unless it was requested already.
+	/// @param[in] prefetch whether it is not visible yet, prefetches count towards PrefetchArgs::max_in_flight
+	void add_model(LoadBatch& batch, psi_scene::ComponentModel const& model, float priority, psi_serv::IResourceService::Deadline deadline, bool prefetch) {
+		auto h = model_bundle_id(model);
+		if (!_requested.insert(h).second)
+			return;
+
+		_pending.insert(h);
+		if (prefetch)
+			_prefetching.insert(h);
+
+		ModelBundle bundle{ h, {} };
+		auto add = [&] (char const* name, psi_serv::IResourceService::ResourceLoaderId loader) {
+			bundle.children.push_back({ psi_serv::resource_id(name), loader, name, priority, deadline });
+		};
+		add(model.mesh_name.data(), MESH_LOADER);
+		add(model.albedo_tex.data(), TEXTURE_LOADER);
+		add(model.normal_tex.data(), TEXTURE_LOADER);
+		add(model.reflectiveness_roughness_tex.data(), TEXTURE_LOADER);
+		batch.models.push_back(std::move(bundle));
+	}
+
+	/// Requests the batch and uploads its meshes and textures as they finish loading, placeholders are drawn meanwhile.
+	void submit(LoadBatch const& batch) {
+		auto const& res = _serv.resource_service();
+		if (!batch.requests.empty())
+			res.request_resources(batch.requests);
+		for (auto const& m : batch.models) {
+			res.request_bundle(m.handle, m.children);
+		}
+
+		for (auto const& r : batch.requests) {
+			if (r.loader == MESH_LOADER || r.loader == TEXTURE_LOADER)
+				upload_when_loaded(r);
+		}
+		for (auto const& m : batch.models) {
+			upload_model_when_loaded(m);
 		}
+	}
+
+	/// Returns the radius of the sphere around an entity's position which bounds its model, 0 until its mesh is loaded.
+	float model_radius(psi_scene::ComponentModel const& model, psi_scene::ComponentTransform const& transform) const {
+		auto it = _mesh_radius.find(model.mesh_name.data());
+		if (it == _mesh_radius.end())
+			return 0.0f;
+
+		float scale = std::max({ std::abs(transform.scale[0]), std::abs(transform.scale[1]), std::abs(transform.scale[2]) });
+		return it->second * scale;
+	}
+
+	/// Adds the models which are visible now, and those predicted to become visible within the prefetch horizon
+	/// as long as the memory ceiling and the prefetch limit allow. Predicted ones load at the prefetch priority,
+	/// with the time they become visible as the deadline.
+	void add_visible_models(psi_scene::ISceneDirectAccess& acc, LoadBatch& batch) {
+		PSI_PROFILE_ZONE("SystemGLRenderer::add_visible_models");
+
+		auto const& args = _prefetcher.args();
+		auto now = psi_serv::IResourceService::Deadline::clock::now();
+		bool may_prefetch = args.memory_ceiling == 0 || _serv.resource_service().resident_bytes() < args.memory_ceiling;
 
 		size_t entity_count = acc.component_count<psi_scene::ComponentEntity>();
 		for (size_t i_ent = 0; i_ent < entity_count; ++i_ent) {
 			auto ent = acc.read_component<psi_scene::ComponentEntity>(i_ent);
-			if (ent.model != psi_scene::NO_COMPONENT) {
-				auto model = acc.read_component<psi_scene::ComponentModel>(ent.model);
-				std::array<std::string, 3> textures = {{
-					model.albedo_tex.data(),
-					model.normal_tex.data(),
-					model.reflectiveness_roughness_tex.data()
-				}};
-
-				_serv.resource_service().request_resource(hash(model.mesh_name.data()), hash(u8"mesh"), model.mesh_name.data());
-				for (auto const& tex : textures) {
-					_serv.resource_service().request_resource(hash(tex), hash(u8"texture"), tex);
-				}
+			if (ent.model == psi_scene::NO_COMPONENT)
+				continue;
 
-				// upload mesh to GL
-				auto msh = *_serv.resource_service().retrieve_resource(hash(model.mesh_name.data()));
-				psi_gl::MeshBuffer buf(boost::any_cast<psi_rndr::MeshData>(msh->resource()));
-				_uploaded_meshes.emplace(model.mesh_name.data(), buf);
+			auto model = acc.read_component<psi_scene::ComponentModel>(ent.model);
+			if (_requested.count(model_bundle_id(model)))
+				continue;
 
-				// upload textures to GL
-				for (auto const& tex : textures) {
-					auto data = boost::any_cast<psi_rndr::TextureData>((*_serv.resource_service().retrieve_resource(hash(tex)))->resource());
-					_uploaded_textures[tex] = psi_gl::upload_tex(data);
-				}
+			// without a position it may be anywhere
+			if (ent.transform == psi_scene::NO_COMPONENT) {
+				add_model(batch, model, 0.0f, psi_serv::IResourceService::Deadline::max(), false);
+				continue;
 			}
-		}
 
+			auto transform = acc.read_component<psi_scene::ComponentTransform>(ent.transform);
+			auto t = _prefetcher.time_until_visible(Eigen::Vector3f(transform.pos[0], transform.pos[1], transform.pos[2]),
+				model_radius(model, transform));
+			if (!t)
+				continue;
 
+			if (*t == 0.0f) {
+				add_model(batch, model, 0.0f, now, false);
+			}
+			else if (may_prefetch && _prefetching.size() < args.max_in_flight) {
+				auto deadline = now + std::chrono::duration_cast<psi_serv::IResourceService::Deadline::duration>(std::chrono::duration<float>(*t));
+				add_model(batch, model, args.priority, deadline, true);
+			}
+		}
+	}
 
+	/// Requests the resources of models which became visible or are predicted to, see add_visible_models.
+	void stream_models(psi_scene::ISceneDirectAccess& acc) {
+		_prefetcher.sample_camera(_cam.position());
 
-		//  -- TEST --
-		{
-			_serv.resource_service().request_resource(hash(u8"meshes/cone_flat"), hash(u8"mesh"), u8"meshes/cone_flat");
+		LoadBatch batch;
+		add_visible_models(acc, batch);
+		submit(batch);
+	}
 
-			std::array<std::string, 3> textures = {{
-				u8"textures/default",
-				u8"textures/default_normal",
-				u8"textures/default",
-			}};
+	/// Uploads a loaded mesh or texture to GL, replacing its previous version.
+	void upload(std::string const& name, psi_serv::IResourceService::ResourceLoaderId loader, psi_serv::Resource const& res) {
+		if (loader == MESH_LOADER) {
+			PSI_PROFILE_ZONE("SystemGLRenderer::upload_mesh");
+			auto mesh = res.share<psi_rndr::MeshView>();
+			_mesh_radius[name] = std::max(
+				Eigen::Vector3f(mesh->min_pos[0], mesh->min_pos[1], mesh->min_pos[2]).norm(),
+				Eigen::Vector3f(mesh->max_pos[0], mesh->max_pos[1], mesh->max_pos[2]).norm());
+			_uploaded_meshes.set(name, mesh);
+		}
+		else {
+			PSI_PROFILE_ZONE("SystemGLRenderer::upload_texture");
+			_uploaded_textures.set(name, res.share<psi_rndr::TextureData>());
+		}
+	}
 
-			for (auto const& tex : textures) {
-				_serv.resource_service().request_resource(hash(tex), hash(u8"texture"), tex);
+	/// Uploads a requested mesh or texture to GL on the main thread once it is loaded, and again whenever it is reloaded.
+	void upload_when_loaded(psi_serv::IResourceService::ResourceRequest const& r) {
+		auto upload_loaded = [this, name = r.param, loader = r.loader, h = r.handle] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+			_pending.erase(h);
+			if (!lock) {
+				psi_log::warning("SystemGLRenderer") << (loader == MESH_LOADER ? "Mesh " : "Texture ") << name << " is unavailable.\n";
+				return;
 			}
 
-			auto msh = *_serv.resource_service().retrieve_resource(hash(u8"meshes/cone_flat"));
-			psi_gl::MeshBuffer buf(boost::any_cast<psi_rndr::MeshData>(msh->resource()));
-			_uploaded_meshes.emplace(u8"meshes/cone_flat", buf);
+			upload(name, loader, lock->resource());
+		};
+
+		_serv.resource_service().on_loaded(r.handle, upload_loaded, psi_thread::TaskQueue::MAIN);
+		upload_when_reloaded(r);
+	}
+
+	/// Uploads the mesh and textures of a model on the main thread once all of them are loaded, with a single
+	/// lock on their bundle, and each of them again whenever it is reloaded.
+	void upload_model_when_loaded(ModelBundle const& model) {
+		auto upload_loaded = [this, model] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+			_pending.erase(model.handle);
+			_prefetching.erase(model.handle);
+			if (!lock) {
+				// draw what is there, the missing ones are reported on their own
+				for (auto const& c : model.children) {
+					upload_when_loaded(c);
+				}
+				return;
+			}
 
-			for (auto const& tex : textures) {
-				auto data = boost::any_cast<psi_rndr::TextureData>((*_serv.resource_service().retrieve_resource(hash(tex)))->resource());
-				_uploaded_textures[tex] = psi_gl::upload_tex(data);
+			PSI_PROFILE_ZONE("SystemGLRenderer::upload_model");
+			auto const& bundle = lock->get<psi_serv::ResourceBundle>();
+			for (auto const& c : model.children) {
+				// models share meshes and textures, each is uploaded once and replaced by reloads only
+				bool uploaded = c.loader == MESH_LOADER ? _uploaded_meshes.find(c.param) != nullptr : _uploaded_textures.find(c.param) != nullptr;
+				if (!uploaded)
+					upload(c.param, c.loader, *bundle.find(c.handle));
 			}
+		};
+
+		_serv.resource_service().on_loaded(model.handle, upload_loaded, psi_thread::TaskQueue::MAIN);
+		for (auto const& c : model.children) {
+			upload_when_reloaded(c);
 		}
-		// -- END TEST --
+	}
+
+	/// Uploads a mesh or texture again whenever it is reloaded. Subscribes once per resource.
+	void upload_when_reloaded(psi_serv::IResourceService::ResourceRequest const& r) {
+		if (!_reload_subscribed.insert(r.handle).second)
+			return;
+
+		_serv.resource_service().on_reloaded(r.handle,
+			[this, name = r.param, loader = r.loader] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+				if (lock)
+					upload(name, loader, lock->resource());
+			},
+			psi_thread::TaskQueue::MAIN
+		);
+	}
+
+	/// Recompiles a shader on the main thread whenever its sources are reloaded.
+	/// The previous program is kept if the new sources fail to compile.
+	void recompile_shader_when_reloaded(std::string const& name, psi_serv::IResourceService::ResourceHandle h) {
+		_serv.resource_service().on_reloaded(h,
+			[this, name] (std::unique_ptr<psi_serv::IResourceLock> lock) {
+				if (!lock)
+					return;
+
+				PSI_PROFILE_ZONE("SystemGLRenderer::recompile_shader");
+				psi_gl::Shader sh;
+				try {
+					sh = psi_gl::compile_glsl_source(lock->get<psi_gl::GLSLSource>());
+				}
+				catch (std::exception const& e) {
+					psi_log::error("SystemGLRenderer") << "Recompiling shader " << name << " failed: " << e.what() << "\n";
+					return;
+				}
+
+				auto& old = _compiled_shaders[name];
+				gl::DeleteProgram(old.handle);
+				old = std::move(sh);
+			},
+			psi_thread::TaskQueue::MAIN
+		);
+	}
+
+	/// Lets the meshes and textures of visible entities closest to the camera load first,
+	/// those of entities out of view keep the prefetch priority.
+	void prioritize_pending_loads(psi_scene::ISceneDirectAccess& acc) {
+		if (_pending.empty())
+			return;
+
+		PSI_PROFILE_ZONE("SystemGLRenderer::prioritize_pending_loads");
+
+		Eigen::Vector3f cam = _cam.position();
+		// a resource is as important as the closest entity using it, bundles load with their children's priorities
+		std::unordered_map<psi_serv::IResourceService::ResourceHandle, float> closeness;
+		// the names were checked for collisions when their loads were requested, hashing them is enough
+		auto note = [&] (char const* name, float c) {
+			auto it = closeness.emplace(psi_util::fnv1a_64(name, std::strlen(name)), c).first;
+			it->second = std::max(it->second, c);
+		};
+
+		size_t entity_count = acc.component_count<psi_scene::ComponentEntity>();
+		for (size_t i_ent = 0; i_ent < entity_count; ++i_ent) {
+			auto ent = acc.read_component<psi_scene::ComponentEntity>(i_ent);
+			if (ent.model == psi_scene::NO_COMPONENT || ent.transform == psi_scene::NO_COMPONENT)
+				continue;
+
+			auto model = acc.read_component<psi_scene::ComponentModel>(ent.model);
+			if (!_pending.count(model_bundle_id(model)))
+				continue;
+
+			auto transform = acc.read_component<psi_scene::ComponentTransform>(ent.transform);
+			float dist = (Eigen::Vector3f(transform.pos[0], transform.pos[1], transform.pos[2]) - cam).norm();
+			// in (0, 1], above the default priority of loads nobody rendered asked for
+			float c = _prefetcher.is_visible(dist, model_radius(model, transform))
+				? 1.0f / (1.0f + dist)
+				: _prefetcher.args().priority;
+
+			note(model.mesh_name.data(), c);
+			note(model.albedo_tex.data(), c);
+			note(model.normal_tex.data(), c);
+			note(model.reflectiveness_roughness_tex.data(), c);
+		}
+
+		_serv.resource_service().reprioritize([&closeness] (psi_serv::IResourceService::ResourceHandle h) {
+			auto it = closeness.find(h);
+			return it != closeness.end() ? it->second : 0.0f;
+		});
+	}
+
+	/// Creates a 1x1 grey texture bound in place of textures which are still loading.
+	void create_placeholder_texture() {
+		psi_rndr::TextureData tex;
+		tex.width = 1;
+		tex.height = 1;
+		tex.encoding = psi_rndr::TextureData::Encoding::RGBA8;
+		tex.data = {{ 128, 128, 128, 255 }};
+
+		_placeholder_tex = psi_gl::upload_tex(tex);
+	}
+
+	/// Returns the GL handle of the texture, or the placeholder if it is not uploaded yet.
+	GLuint texture_or_placeholder(std::string const& name) const {
+		auto tex = _uploaded_textures.find(name);
+		return tex ? *tex : _placeholder_tex;
 	}
 
 	void deferred_gbuffer_pass(psi_scene::ISceneDirectAccess& acc) {
+		PSI_PROFILE_ZONE("SystemGLRenderer::deferred_gbuffer_pass");
+
 		_mrt_buf.bind();
 
 		gl::Clear(gl::COLOR_BUFFER_BIT | gl::DEPTH_BUFFER_BIT);
@@ -236,21 +588,32 @@ public:
 		gl::UniformMatrix4fv(sh.unifs.at(psi_gl::UniformMapping::LOCAL_TO_CLIP), 1, false, local_to_clip.data());
 
 		gl::ActiveTexture(gl::TEXTURE0 + GLint(TextureUnit::TEX_ALBEDO));
-		gl::BindTexture(gl::TEXTURE_2D, _uploaded_textures.at(u8"textures/default"));
+		gl::BindTexture(gl::TEXTURE_2D, texture_or_placeholder(u8"textures/default"));
 		gl::ActiveTexture(gl::TEXTURE0 + GLint(TextureUnit::TEX_REFLECTIVENESS_ROUGHNESS));
-		gl::BindTexture(gl::TEXTURE_2D, _uploaded_textures.at(u8"textures/default"));
+		gl::BindTexture(gl::TEXTURE_2D, texture_or_placeholder(u8"textures/default"));
 		gl::ActiveTexture(gl::TEXTURE0 + GLint(TextureUnit::TEX_NORMAL));
-		gl::BindTexture(gl::TEXTURE_2D, _uploaded_textures.at(u8"textures/default_normal"));
+		gl::BindTexture(gl::TEXTURE_2D, texture_or_placeholder(u8"textures/default_normal"));
 		gl::Uniform1i(sh.unifs.at(psi_gl::UniformMapping::ALBEDO_TEXTURE_SAMPLER), GLint(TextureUnit::TEX_ALBEDO));
 		gl::Uniform1i(sh.unifs.at(psi_gl::UniformMapping::NORMAL_TEXTURE_SAMPLER), GLint(TextureUnit::TEX_NORMAL));
 		gl::Uniform1i(sh.unifs.at(psi_gl::UniformMapping::REFLECTIVENESS_ROUGHNESS_TEXTURE_SAMPLER), GLint(TextureUnit::TEX_REFLECTIVENESS_ROUGHNESS));
 
-		_uploaded_meshes.at(u8"meshes/cone_flat").draw(gl::TRIANGLES);
+		// not drawn until loaded
+		auto cone = _uploaded_meshes.find(u8"meshes/cone_flat");
+		if (cone) {
+			// the cone stands at the origin, a model unit there covers this many pixels vertically
+			float dist = std::max(_cam.position().norm(), 0.001f);
+			float pixels_per_unit = _clip.to_clip()(1, 1) * 0.5f * float(_frame_height) / dist;
+
+			cone->bind_vertex_layout(sh);
+			cone->draw(gl::TRIANGLES, psi_rndr::select_mesh_level(cone->levels(), pixels_per_unit, MAX_LEVEL_PIXEL_ERROR));
+		}
 
 		_mrt_buf.unbind();
 	}
 
 	void deferred_lighting_pass() {
+		PSI_PROFILE_ZONE("SystemGLRenderer::deferred_lighting_pass");
+
 		gl::Clear(gl::COLOR_BUFFER_BIT | gl::DEPTH_BUFFER_BIT);
 
 		gl::UseProgram(_compiled_shaders[u8"deferred_quad"].handle);
@@ -316,6 +679,9 @@ public:
 
 		handle_input();
 
+		stream_models(acc);
+		prioritize_pending_loads(acc);
+
 		deferred_gbuffer_pass(acc);
 
 		deferred_lighting_pass();
@@ -325,16 +691,40 @@ public:
 
 	void on_scene_shutdown(psi_scene::ISceneDirectAccess&) override {}
 
+	/// Owns the GL context, which is current on the main thread only.
+	bool requires_main_thread() const override {
+		return true;
+	}
+
 private:
 	psi_thread::TaskManager const& _tasks;
 	psi_serv::ServiceManager const& _serv;
 
 	psi_rndr::IsometricTransform _cam;
 	psi_rndr::ClipMatrix _clip;
+	psi_rndr::CameraPrefetcher _prefetcher;
 
-	std::unordered_map<std::string, GLuint> _uploaded_textures;
-	std::unordered_map<std::string, psi_gl::MeshBuffer> _uploaded_meshes;
+	SharedUploads<psi_rndr::TextureData, GLuint> _uploaded_textures{
+		[] (psi_rndr::TextureData const& tex) { return psi_gl::upload_tex(tex); },
+		[] (GLuint& tex) { gl::DeleteTextures(1, &tex); }
+	};
+	SharedUploads<psi_rndr::MeshView, psi_gl::MeshBuffer> _uploaded_meshes{
+		// reads straight from the mapped file
+		[] (psi_rndr::MeshView const& mesh) { return psi_gl::MeshBuffer(mesh); },
+		[] (psi_gl::MeshBuffer& buf) { buf.free(); }
+	};
 	std::unordered_map<std::string, psi_gl::Shader> _compiled_shaders;
+	/// Handles of model bundles and other resources already requested.
+	std::unordered_set<psi_serv::IResourceService::ResourceHandle> _requested;
+	/// Handles of meshes and textures whose reloads are uploaded.
+	std::unordered_set<psi_serv::IResourceService::ResourceHandle> _reload_subscribed;
+	/// Handles of requested model bundles and other meshes and textures which are not uploaded yet.
+	std::unordered_set<psi_serv::IResourceService::ResourceHandle> _pending;
+	/// Those of them which were prefetched before they were visible.
+	std::unordered_set<psi_serv::IResourceService::ResourceHandle> _prefetching;
+	/// Bounding sphere radii of uploaded meshes around their origin, by name.
+	std::unordered_map<std::string, float> _mesh_radius;
+	GLuint _placeholder_tex;
 
 	psi_gl::MultipleRenderTargetFramebuffer _mrt_buf;
 
@@ -349,6 +739,6 @@ private:
 	bool _mouse_blocked = true;
 };
 
-std::unique_ptr<psi_sys::ISystem> psi_sys::start_gl_renderer(psi_thread::TaskManager const& tasks, psi_serv::ServiceManager const& serv) {
-	return std::make_unique<SystemGLRenderer>(tasks, serv);
+std::unique_ptr<psi_sys::ISystem> psi_sys::start_gl_renderer(psi_thread::TaskManager const& tasks, psi_serv::ServiceManager const& serv, psi_rndr::PrefetchArgs const& prefetch) {
+	return std::make_unique<SystemGLRenderer>(tasks, serv, prefetch);
 }
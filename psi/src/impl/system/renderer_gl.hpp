@@ -25,7 +25,10 @@
 #include "../../system/system.hpp"
 #include "../../thread/manager.hpp"
 #include "../../service/manager.hpp"
+#include "../rendering/prefetch.hpp"
 
 namespace psi_sys {
-std::unique_ptr<ISystem> start_gl_renderer(psi_thread::TaskManager const&, psi_serv::ServiceManager const&);
+/// Starts the renderer, which streams in the meshes and textures of models as the camera approaches them.
+/// @param[in] prefetch how far ahead the resources of models are loaded
+std::unique_ptr<ISystem> start_gl_renderer(psi_thread::TaskManager const&, psi_serv::ServiceManager const&, psi_rndr::PrefetchArgs const& prefetch = psi_rndr::PrefetchArgs());
 } // namespace psi_sys
@@ -64,8 +64,9 @@ void psi_log::init(fs::path const& work_dir, Level max) {
 static inline std::string __header(psi_log::Level lvl, std::string const& module, std::string const& part) {
 	time_t time;
 	std::time(&time);
-	struct tm* info;
-	info = localtime(&time);
+	// loggers run on several threads, localtime's static buffer is not safe
+	struct tm buf;
+	struct tm* info = localtime_r(&time, &buf);
 
 	// format date and time
 	std::string output = "[";
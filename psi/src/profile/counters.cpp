@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "counters.hpp"
+
+#include <mutex>
+#include <map>
+#include <memory>
+#include <cstring>
+
+#ifdef __linux__
+	#include <unistd.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <linux/perf_event.h>
+#endif
+
+#include "../log/log.hpp"
+#include "../util/assert.hpp"
+
+
+std::atomic<bool> psi_prof::COUNTERS_ENABLED(false);
+
+#ifdef __linux__
+static int perf_event_open(perf_event_attr* attr, int group_fd) {
+	// measure the calling thread on any CPU
+	return int(syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0));
+}
+
+static perf_event_attr counter_attr(psi_prof::Counter c) {
+	perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	switch (c) {
+		case psi_prof::Counter::CYCLES:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			break;
+
+		case psi_prof::Counter::INSTRUCTIONS:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			break;
+
+		case psi_prof::Counter::L1D_MISSES:
+			attr.type = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_L1D
+				| (PERF_COUNT_HW_CACHE_OP_READ << 8)
+				| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			break;
+
+		case psi_prof::Counter::LLC_MISSES:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+			break;
+
+		case psi_prof::Counter::BRANCH_MISSES:
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+			break;
+
+		default:
+			ASSERT(false);
+	}
+
+	return attr;
+}
+#endif
+
+psi_prof::HardwareCounters::HardwareCounters()
+	: _leader(-1)
+	, _opened(0) {
+	_fds.fill(-1);
+	_slots.fill(-1);
+
+#ifdef __linux__
+	for (size_t i = 0; i < size_t(Counter::COUNT); ++i) {
+		auto attr = counter_attr(Counter(i));
+		// the first counter which opens becomes the group leader, so all are scheduled together
+		int fd = perf_event_open(&attr, _leader);
+		if (fd == -1)
+			continue;
+
+		if (_leader == -1)
+			_leader = fd;
+		_fds[i] = fd;
+		_slots[i] = int(_opened++);
+	}
+#endif
+}
+
+psi_prof::HardwareCounters::~HardwareCounters() {
+#ifdef __linux__
+	for (int fd : _fds) {
+		if (fd != -1)
+			close(fd);
+	}
+#endif
+}
+
+bool psi_prof::HardwareCounters::available() const {
+	return _opened != 0;
+}
+
+psi_prof::CounterValues psi_prof::HardwareCounters::read() const {
+	CounterValues values = {{}};
+
+#ifdef __linux__
+	if (_leader == -1)
+		return values;
+
+	// layout of a PERF_FORMAT_GROUP read with both time fields
+	std::array<uint64_t, 3 + size_t(Counter::COUNT)> buf;
+	if (::read(_leader, buf.data(), sizeof(buf)) < ssize_t(3 * sizeof(uint64_t)))
+		return values;
+
+	uint64_t enabled = buf[1];
+	uint64_t running = buf[2];
+	for (size_t i = 0; i < values.size(); ++i) {
+		if (_slots[i] == -1)
+			continue;
+
+		uint64_t v = buf[3 + _slots[i]];
+		// extrapolate if the kernel multiplexed our group with other events
+		if (running != 0 && running < enabled)
+			v = uint64_t(double(v) * double(enabled) / double(running));
+		values[i] = v;
+	}
+#endif
+
+	return values;
+}
+
+void psi_prof::set_counters_enabled(bool on) {
+	COUNTERS_ENABLED.store(on, std::memory_order_relaxed);
+}
+
+psi_prof::CounterValues psi_prof::read_thread_counters() {
+	thread_local std::unique_ptr<HardwareCounters> counters;
+	if (!counters) {
+		counters = std::make_unique<HardwareCounters>();
+
+		static std::once_flag warned;
+		if (!counters->available()) {
+			std::call_once(warned, []{
+				psi_log::warning("Profiler") << "Hardware performance counters are unavailable. Check /proc/sys/kernel/perf_event_paranoid.\n";
+			});
+		}
+	}
+
+	return counters->read();
+}
+
+struct ZoneCounters {
+	psi_prof::CounterValues current = {{}};
+	psi_prof::CounterValues last_frame = {{}};
+	/// Whether the zone ran in the current frame, frames in which it did not are not sampled
+	bool ran = false;
+	std::array<psi_util::Histogram, size_t(psi_prof::Counter::COUNT)> per_frame;
+};
+
+static std::mutex ZONES_MUT;
+static std::map<std::pair<char const*, uint64_t>, ZoneCounters> ZONES;
+
+void psi_prof::record_counters(char const* name, uint64_t id, CounterValues const& delta) {
+	std::lock_guard<std::mutex> lock(ZONES_MUT);
+	auto& zone = ZONES[std::make_pair(name, id)];
+	for (size_t i = 0; i < delta.size(); ++i)
+		zone.current[i] += delta[i];
+	zone.ran = true;
+}
+
+void psi_prof::end_counter_frame() {
+	std::lock_guard<std::mutex> lock(ZONES_MUT);
+	for (auto& z : ZONES) {
+		auto& zone = z.second;
+		if (zone.ran) {
+			for (size_t i = 0; i < zone.current.size(); ++i)
+				zone.per_frame[i].add(zone.current[i]);
+		}
+		zone.ran = false;
+
+		zone.last_frame = zone.current;
+		zone.current.fill(0);
+	}
+}
+
+std::vector<psi_prof::CounterZoneReport> psi_prof::counter_report() {
+	std::lock_guard<std::mutex> lock(ZONES_MUT);
+
+	std::vector<CounterZoneReport> report;
+	for (auto const& z : ZONES) {
+		report.push_back(CounterZoneReport{
+			z.first.first,
+			z.first.second,
+			z.second.last_frame,
+			z.second.per_frame,
+		});
+	}
+
+	return report;
+}
+
+void psi_prof::log_counter_report() {
+	static char const* const NAMES[] = {
+		"cycles",
+		"instructions",
+		"L1D misses",
+		"LLC misses",
+		"branch misses",
+	};
+
+	auto stream = psi_log::info("Profiler");
+	stream << "Hardware counters per frame (p50 / p99 / max):\n";
+	for (auto const& zone : counter_report()) {
+		auto const& cyc = zone.per_frame[size_t(Counter::CYCLES)];
+		auto const& ins = zone.per_frame[size_t(Counter::INSTRUCTIONS)];
+		double ipc = cyc.sum() ? double(ins.sum()) / double(cyc.sum()) : 0.0;
+
+		stream << zone.name << " #" << zone.id << " over " << cyc.count() << " frames, IPC " << ipc << "\n";
+		for (size_t i = 0; i < size_t(Counter::COUNT); ++i) {
+			auto const& h = zone.per_frame[i];
+			stream << "\t" << NAMES[i] << ": " << h.percentile(0.5) << " / " << h.percentile(0.99) << " / " << h.max() << "\n";
+		}
+	}
+}
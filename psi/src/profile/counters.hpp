@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <atomic>
+
+#include "profiler.hpp"
+#include "../util/histogram.hpp"
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_prof {
+/// Hardware events sampled by HardwareCounters.
+enum class Counter : size_t {
+	CYCLES,
+	INSTRUCTIONS,
+	L1D_MISSES,
+	LLC_MISSES,
+	BRANCH_MISSES,
+	COUNT,
+};
+
+using CounterValues = std::array<uint64_t, size_t(Counter::COUNT)>;
+
+/// A group of hardware performance counters measuring the thread which created it.
+/// Backed by perf_event_open on Linux. Counters which the CPU or kernel do not provide,
+/// or which the process lacks permissions for (see /proc/sys/kernel/perf_event_paranoid), read as 0.
+class HardwareCounters : psi_mark::NonThreadsafe {
+public:
+	HardwareCounters();
+	~HardwareCounters();
+
+	HardwareCounters(HardwareCounters const&) = delete;
+	HardwareCounters& operator=(HardwareCounters const&) = delete;
+
+	/// Whether at least one counter could be opened.
+	bool available() const;
+
+	/// Reads the current counter values, scaled for time lost to multiplexing.
+	CounterValues read() const;
+
+private:
+	/// Group leader fd followed by members, -1 where an event could not be opened.
+	std::array<int, size_t(Counter::COUNT)> _fds;
+	/// Position of each counter in the group read buffer, -1 when not opened.
+	std::array<int, size_t(Counter::COUNT)> _slots;
+	int _leader;
+	size_t _opened;
+};
+
+/// Whether counter zones are currently being measured. Use set_counters_enabled() to change.
+extern std::atomic<bool> COUNTERS_ENABLED;
+
+void set_counters_enabled(bool);
+
+inline bool counters_enabled() {
+	return COUNTERS_ENABLED.load(std::memory_order_relaxed);
+}
+
+/// Reads the calling thread's counters, opening them on first use.
+/// @return all zeroes if counters are unavailable on this thread
+CounterValues read_thread_counters();
+
+/// Adds a counter delta to the given zone in the current frame.
+void record_counters(char const* name, uint64_t id, CounterValues const& delta);
+
+/// Folds the current frame's counters into the per-zone histograms and starts a new frame.
+/// Called by mark_frame().
+void end_counter_frame();
+
+/// Aggregated counters of a single zone.
+struct CounterZoneReport {
+	char const* name;
+	uint64_t id;
+	/// Totals of the last finished frame.
+	CounterValues last_frame;
+	/// Distribution of per-frame totals over the finished frames in which the zone ran.
+	std::array<psi_util::Histogram, size_t(Counter::COUNT)> per_frame;
+};
+
+/// Returns a snapshot of the aggregated counters of all zones.
+std::vector<CounterZoneReport> counter_report();
+
+/// Logs a human-readable summary of counter_report().
+void log_counter_report();
+
+/// Measures hardware counters between its construction and destruction.
+class ScopedCounters : psi_mark::NonThreadsafe {
+public:
+	explicit ScopedCounters(char const* name, uint64_t id = 0)
+		: _name(name)
+		, _id(id)
+		, _active(counters_enabled()) {
+		if (_active)
+			_start = read_thread_counters();
+	}
+
+	~ScopedCounters() {
+		if (!_active)
+			return;
+
+		auto end = read_thread_counters();
+		for (size_t i = 0; i < end.size(); ++i)
+			end[i] -= _start[i];
+		record_counters(_name, _id, end);
+	}
+
+	ScopedCounters(ScopedCounters const&) = delete;
+	ScopedCounters& operator=(ScopedCounters const&) = delete;
+
+private:
+	char const* _name;
+	uint64_t _id;
+	bool _active;
+	CounterValues _start;
+};
+} // namespace psi_prof
+
+/// Measures hardware counters over the enclosing scope. Compiled out unless PSI_PERF_COUNTERS is defined.
+/// Usage: PSI_PROFILE_COUNTERS("name") or PSI_PROFILE_COUNTERS("name", id).
+#ifdef PSI_PERF_COUNTERS
+	#define PSI_PROFILE_COUNTERS(...) \
+		psi_prof::ScopedCounters PSI_PROF_CONCAT(_psi_prof_counters_, __LINE__)(__VA_ARGS__)
+#else
+	#define PSI_PROFILE_COUNTERS(...) \
+		((void)0)
+#endif
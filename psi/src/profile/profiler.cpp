@@ -0,0 +1,208 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "profiler.hpp"
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace fs = boost::filesystem;
+
+#include "counters.hpp"
+#include "../log/log.hpp"
+
+
+std::atomic<bool> psi_prof::ENABLED(false);
+
+/// Number of zones kept per thread. Older zones are overwritten.
+static constexpr size_t ZONES_PER_THREAD = 1 << 16;
+/// Number of frame start times kept.
+static constexpr size_t FRAMES_KEPT = 1 << 10;
+
+/// A zone as stored in a ring buffer. The fields are atomic since dumps read them while the owning thread
+/// may be overwriting them, see ThreadBuffer.
+struct ZoneSlot {
+	std::atomic<char const*> name;
+	std::atomic<uint64_t> id;
+	std::atomic<uint64_t> start;
+	std::atomic<uint64_t> end;
+};
+
+struct ZoneRecord {
+	char const* name;
+	uint64_t id;
+	uint64_t start;
+	uint64_t end;
+};
+
+/// A ring buffer of zones written by exactly one thread.
+/// Like a seqlock, a dump copies a zone and then checks that the owner has not started overwriting its slot since.
+struct ThreadBuffer {
+	/// OS thread id, shown in the trace.
+	uint64_t tid;
+	/// Total number of zones whose writing has started. Only the owning thread stores to it.
+	std::atomic<uint64_t> started;
+	/// Total number of zones ever written. Only the owning thread stores to it.
+	std::atomic<uint64_t> written;
+	std::array<ZoneSlot, ZONES_PER_THREAD> zones;
+};
+
+static std::mutex BUFFERS_MUT;
+static std::vector<std::unique_ptr<ThreadBuffer>> BUFFERS;
+
+static std::array<uint64_t, FRAMES_KEPT> FRAME_STARTS;
+static std::atomic<uint64_t> FRAME_COUNT(0);
+
+
+static ThreadBuffer& thread_buffer() {
+	// registered once per thread, buffers outlive their threads so dumps can still read them
+	thread_local ThreadBuffer* buf = nullptr;
+	if (!buf) {
+		auto owned = std::make_unique<ThreadBuffer>();
+		owned->tid = uint64_t(syscall(SYS_gettid));
+		owned->started.store(0, std::memory_order_relaxed);
+		owned->written.store(0, std::memory_order_relaxed);
+		buf = owned.get();
+
+		std::lock_guard<std::mutex> lock(BUFFERS_MUT);
+		BUFFERS.push_back(std::move(owned));
+	}
+	return *buf;
+}
+
+/// Writes a nanosecond value as microseconds with three decimal places.
+static void write_us(std::ostream& out, uint64_t ns) {
+	uint64_t frac = ns % 1000;
+	out << ns / 1000 << "." << frac / 100 << frac / 10 % 10 << frac % 10;
+}
+
+uint64_t psi_prof::now_ns() {
+	return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+void psi_prof::set_enabled(bool on) {
+	ENABLED.store(on, std::memory_order_relaxed);
+}
+
+void psi_prof::record_zone(char const* name, uint64_t id, uint64_t start, uint64_t end) {
+	auto& buf = thread_buffer();
+	uint64_t n = buf.written.load(std::memory_order_relaxed);
+	// a dump which sees any of the stores below also sees that the slot is being overwritten
+	buf.started.store(n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	auto& slot = buf.zones[n % ZONES_PER_THREAD];
+	slot.name.store(name, std::memory_order_relaxed);
+	slot.id.store(id, std::memory_order_relaxed);
+	slot.start.store(start, std::memory_order_relaxed);
+	slot.end.store(end, std::memory_order_relaxed);
+
+	// publish the record to dumping threads
+	buf.written.store(n + 1, std::memory_order_release);
+}
+
+void psi_prof::mark_frame() {
+	uint64_t n = FRAME_COUNT.load(std::memory_order_relaxed);
+	FRAME_STARTS[n % FRAMES_KEPT] = now_ns();
+	FRAME_COUNT.store(n + 1, std::memory_order_release);
+
+#ifdef PSI_PERF_COUNTERS
+	end_counter_frame();
+#endif
+}
+
+void psi_prof::dump_chrome_trace(fs::path const& file, size_t frames) {
+	uint64_t frame_count = FRAME_COUNT.load(std::memory_order_acquire);
+	if (frames > FRAMES_KEPT)
+		frames = FRAMES_KEPT;
+
+	// zones which ended before the first requested frame are skipped
+	uint64_t cutoff = 0;
+	if (frame_count >= frames && frames > 0)
+		cutoff = FRAME_STARTS[(frame_count - frames) % FRAMES_KEPT];
+
+	std::ofstream out(file.c_str());
+	if (!out.good())
+		throw std::runtime_error("Failed to open trace file " + file.string() + ".");
+
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	bool first = true;
+	size_t dumped = 0;
+
+	// frame boundaries as instant events on the main thread track
+	uint64_t first_frame = frame_count >= frames ? frame_count - frames : 0;
+	for (uint64_t i_frame = first_frame; i_frame < frame_count; ++i_frame) {
+		uint64_t ts = FRAME_STARTS[i_frame % FRAMES_KEPT];
+		out << (first ? "" : ",\n")
+			<< "{\"name\":\"frame\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,\"ts\":";
+		write_us(out, ts);
+		out << ",\"args\":{\"frame\":" << i_frame << "}}";
+		first = false;
+	}
+
+	std::lock_guard<std::mutex> lock(BUFFERS_MUT);
+	for (auto const& buf : BUFFERS) {
+		uint64_t written = buf->written.load(std::memory_order_acquire);
+		uint64_t begin = written > ZONES_PER_THREAD ? written - ZONES_PER_THREAD : 0;
+
+		for (uint64_t i_zone = begin; i_zone < written; ++i_zone) {
+			auto const& slot = buf->zones[i_zone % ZONES_PER_THREAD];
+			ZoneRecord z{
+				slot.name.load(std::memory_order_relaxed),
+				slot.id.load(std::memory_order_relaxed),
+				slot.start.load(std::memory_order_relaxed),
+				slot.end.load(std::memory_order_relaxed)
+			};
+
+			// the owner keeps recording during the dump, the oldest zones may have been overwritten while copying
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (buf->started.load(std::memory_order_relaxed) > i_zone + ZONES_PER_THREAD)
+				continue;
+
+			if (z.end < cutoff)
+				continue;
+
+			uint64_t dur = z.end - z.start;
+			// Chrome trace timestamps are in microseconds
+			out << (first ? "" : ",\n")
+				<< "{\"name\":\"" << z.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buf->tid
+				<< ",\"ts\":";
+			write_us(out, z.start);
+			out << ",\"dur\":";
+			write_us(out, dur);
+			out << ",\"args\":{\"id\":" << z.id << "}}";
+			first = false;
+			++dumped;
+		}
+	}
+
+	out << "\n]}\n";
+	out.close();
+
+	psi_log::info("Profiler") << "Dumped " << uint64_t(dumped) << " zones from the last " << uint64_t(frames) << " frames to " << file.string() << ".\n";
+}
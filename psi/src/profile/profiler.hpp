@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+#include <boost/filesystem.hpp>
+
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_prof {
+/// Whether zones are currently being recorded. Use set_enabled() to change.
+extern std::atomic<bool> ENABLED;
+
+/// Returns the value of the monotonic profiler clock in nanoseconds.
+uint64_t now_ns();
+
+/// Starts or stops recording zones at runtime. Zones compiled in with
+/// PSI_PROFILE_ZONE cost a single atomic load while the profiler is disabled.
+void set_enabled(bool);
+
+inline bool is_enabled() {
+	return ENABLED.load(std::memory_order_relaxed);
+}
+
+/// Stores a completed zone in the calling thread's buffer.
+/// Each thread writes only to its own buffer, so this never takes a lock
+/// except once per thread to register the buffer.
+/// @param[in] name  static string naming the zone
+/// @param[in] id    additional identifier, e.g. a system index or resource handle
+/// @param[in] start zone start time from now_ns()
+/// @param[in] end   zone end time from now_ns()
+void record_zone(char const* name, uint64_t id, uint64_t start, uint64_t end);
+
+/// Marks the beginning of a new frame. Should be called once per frame from the main thread.
+void mark_frame();
+
+/// Writes all zones recorded during the last N frames to a file
+/// in the Chrome trace event format, which can be opened in chrome://tracing or Perfetto.
+/// Should be called between frames. Other threads may keep recording zones, those
+/// they overwrite during the dump are left out.
+/// @param[in] file   path of the JSON file to create
+/// @param[in] frames number of most recent frames to dump
+/// @throw if the file cannot be written
+void dump_chrome_trace(boost::filesystem::path const& file, size_t frames);
+
+/// Measures the time between its construction and destruction and records it as a zone.
+class ScopedZone : psi_mark::NonThreadsafe {
+public:
+	explicit ScopedZone(char const* name, uint64_t id = 0)
+		: _name(name)
+		, _id(id)
+		, _start(is_enabled() ? now_ns() : 0) {}
+
+	~ScopedZone() {
+		if (_start != 0 && is_enabled())
+			record_zone(_name, _id, _start, now_ns());
+	}
+
+	ScopedZone(ScopedZone const&) = delete;
+	ScopedZone& operator=(ScopedZone const&) = delete;
+
+private:
+	char const* _name;
+	uint64_t _id;
+	uint64_t _start;
+};
+} // namespace psi_prof
+
+#define PSI_PROF_CONCAT_IMPL(a, b) a##b
+#define PSI_PROF_CONCAT(a, b) PSI_PROF_CONCAT_IMPL(a, b)
+
+/// Records the enclosing scope as a profiling zone. Compiled out unless PSI_PROFILING is defined.
+/// Usage: PSI_PROFILE_ZONE("name") or PSI_PROFILE_ZONE("name", id).
+#ifdef PSI_PROFILING
+	#define PSI_PROFILE_ZONE(...) \
+		psi_prof::ScopedZone PSI_PROF_CONCAT(_psi_prof_zone_, __LINE__)(__VA_ARGS__)
+#else
+	#define PSI_PROFILE_ZONE(...) \
+		((void)0)
+#endif
@@ -44,7 +44,7 @@ public:
 
 	template <typename T>
 	size_t add_component(T comp) {
-		return _add_component(T::type, comp);
+		return _add_component(T::type, &comp);
 	}
 
 	template <typename T>
@@ -84,7 +84,7 @@ protected:
 	/// Adds the given component to the memory of the given type.
 	/// Components present at frame beginning are guaranteed to be contiguous in memory, added ones are not.
 	/// @param[in] t    component type
-	/// @param[in] comp component data : boost::any<T>
+	/// @param[in] comp pointer to the component data, copied before returning : boost::any<T*>
 	/// @return the id of the added component
 	/// @warning Fails if the component type is not required by the accessing system or if the component data is not of the specified type.
 	virtual size_t _add_component(ComponentTypeId t, boost::any comp) = 0;
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "resource.hpp"
+
+#include <array>
+#include <utility>
+
+#include "../log/log.hpp"
+
+
+void psi_serv::log_resource_stats(ResourceStats const& stats) {
+	auto rate = [] (uint64_t hits, uint64_t total) {
+		return total ? 100.0 * double(hits) / double(total) : 0.0;
+	};
+	uint64_t retrievals = stats.retrieve_hits + stats.retrieve_waits + stats.retrieve_misses;
+
+	auto stream = psi_log::info("ResourceLoader");
+	stream << "Resource statistics:\n"
+		<< "\trequests: " << stats.request_hits + stats.request_misses << ", "
+		<< rate(stats.request_hits, stats.request_hits + stats.request_misses) << "% already loading or available\n"
+		<< "\tretrievals: " << retrievals << ", " << rate(stats.retrieve_hits, retrievals) << "% available, "
+		<< rate(stats.retrieve_waits, retrievals) << "% waited for\n"
+		<< "\tresident: " << stats.resident_count << " resources, " << stats.resident_bytes << " bytes\n"
+		<< "\tevicted: " << stats.evictions << " resources, " << stats.evicted_bytes << " bytes\n"
+		<< "\tdeduplicated: " << stats.deduplicated << ", reloaded: " << stats.reloads << "\n"
+		<< "\treads: " << stats.reads_running << " running, " << stats.reads_waiting << " waiting\n"
+		<< "\tdecodes: " << stats.decodes_running << " running, " << stats.decodes_waiting << " waiting\n";
+
+	stream << "Load times in us (p50 / p99 / max):\n";
+	for (auto const& l : stats.loaders) {
+		stream << "loader " << l.loader << ": " << l.loaded << " loaded, " << l.failed << " failed, "
+			<< l.bytes_read << " bytes read\n";
+
+		std::pair<char const*, psi_util::Histogram const*> const stages[] = {
+			{"wait", &l.wait_us},
+			{"read", &l.read_us},
+			{"decode", &l.decode_us},
+			{"finalize", &l.finalize_us},
+			{"total", &l.total_us},
+		};
+		for (auto const& s : stages) {
+			stream << "\t" << s.first << ": " << s.second->percentile(0.5) << " / " << s.second->percentile(0.99)
+				<< " / " << s.second->max() << "\n";
+		}
+	}
+}
+
+void psi_serv::write_resource_stats_header(std::ostream& out) {
+	out << "frame,resident_count,resident_bytes,reads_running,reads_waiting,decodes_running,decodes_waiting,"
+		"request_hits,request_misses,retrieve_hits,retrieve_waits,retrieve_misses,"
+		"evictions,evicted_bytes,deduplicated,reloads,loaded,failed,bytes_read\n";
+}
+
+void psi_serv::write_resource_stats_row(std::ostream& out, uint64_t frame, ResourceStats const& stats, ResourceStats const& previous) {
+	auto totals = [] (ResourceStats const& s) {
+		std::array<uint64_t, 3> t = {{0, 0, 0}};
+		for (auto const& l : s.loaders) {
+			t[0] += l.loaded;
+			t[1] += l.failed;
+			t[2] += l.bytes_read;
+		}
+		return t;
+	};
+	auto now = totals(stats);
+	auto before = totals(previous);
+
+	out << frame << ',' << stats.resident_count << ',' << stats.resident_bytes
+		<< ',' << stats.reads_running << ',' << stats.reads_waiting
+		<< ',' << stats.decodes_running << ',' << stats.decodes_waiting
+		<< ',' << stats.request_hits - previous.request_hits
+		<< ',' << stats.request_misses - previous.request_misses
+		<< ',' << stats.retrieve_hits - previous.retrieve_hits
+		<< ',' << stats.retrieve_waits - previous.retrieve_waits
+		<< ',' << stats.retrieve_misses - previous.retrieve_misses
+		<< ',' << stats.evictions - previous.evictions
+		<< ',' << stats.evicted_bytes - previous.evicted_bytes
+		<< ',' << stats.deduplicated - previous.deduplicated
+		<< ',' << stats.reloads - previous.reloads
+		<< ',' << now[0] - before[0] << ',' << now[1] - before[1] << ',' << now[2] - before[2] << '\n';
+}
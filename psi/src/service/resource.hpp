@@ -21,14 +21,24 @@
 #pragma once
 
 #include <string>
+#include <chrono>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <future>
+#include <vector>
+#include <utility>
+#include <ostream>
+
+#include <typeinfo>
+#include <type_traits>
 
 #include <boost/optional.hpp>
-#include <boost/any.hpp>
 
+#include "../thread/manager.hpp"
 #include "../marker/thread_safety.hpp"
+#include "../util/hash.hpp"
+#include "../util/histogram.hpp"
 
 
 namespace psi_serv {
@@ -42,28 +52,305 @@ enum class ResourceState {
 	AVAILABLE,
 };
 
+/// An immutable, reference-counted resource of any type. Copies share the same data.
+class Resource : psi_mark::ConstThreadsafe {
+public:
+	Resource()
+		: _type(&typeid(void)) {}
+
+	template <typename T>
+	explicit Resource(std::shared_ptr<T const> ptr)
+		: _ptr(std::move(ptr))
+		, _type(&typeid(T)) {}
+
+	/// Moves the value into newly allocated shared storage.
+	template <typename T>
+	static Resource make(T&& val) {
+		return Resource(std::shared_ptr<std::decay_t<T> const>(std::make_shared<std::decay_t<T>>(std::forward<T>(val))));
+	}
+
+	/// @return the resource, or nullptr if it is not of type T
+	template <typename T>
+	T const* get() const {
+		return *_type == typeid(T) ? static_cast<T const*>(_ptr.get()) : nullptr;
+	}
+
+	/// @return shared ownership of the resource, or nullptr if it is not of type T
+	template <typename T>
+	std::shared_ptr<T const> share() const {
+		return *_type == typeid(T) ? std::static_pointer_cast<T const>(_ptr) : nullptr;
+	}
+
+	bool empty() const {
+		return !_ptr;
+	}
+
+	std::type_info const& type() const {
+		return *_type;
+	}
+
+private:
+	std::shared_ptr<void const> _ptr;
+	std::type_info const* _type;
+};
+
+/// The resource of a bundle: its children's resources, which become available together.
+/// See IResourceService::request_bundle.
+class ResourceBundle : psi_mark::ConstThreadsafe {
+public:
+	explicit ResourceBundle(std::vector<std::pair<size_t, Resource>> children)
+		: _children(std::move(children)) {}
+
+	/// @return the resource of the child with the given handle, or nullptr if it is not in the bundle
+	Resource const* find(size_t h) const {
+		for (auto const& c : _children) {
+			if (c.first == h)
+				return &c.second;
+		}
+		return nullptr;
+	}
+
+	/// @return shared ownership of the child's resource, or nullptr if it is not in the bundle or not of type T
+	template <typename T>
+	std::shared_ptr<T const> share(size_t h) const {
+		auto res = find(h);
+		return res ? res->share<T>() : nullptr;
+	}
+
+	/// The children's handles and resources, in request order.
+	std::vector<std::pair<size_t, Resource>> const& children() const {
+		return _children;
+	}
+
+private:
+	std::vector<std::pair<size_t, Resource>> _children;
+};
+
 /// An abstract class representing a read-lock on a resource.
 /// Destroying this object releases the lock and allows potential modifications to the resource.
 class IResourceLock : psi_mark::NonThreadsafe {
 public:
 	virtual ~IResourceLock() {};
 
-	virtual boost::any const& resource() = 0;
+	virtual Resource const& resource() = 0;
+
+	/// Returns the resource as T without copying it.
+	/// @throw std::bad_cast if the resource is not of type T
+	template <typename T>
+	T const& get() {
+		auto ptr = resource().get<T>();
+		if (!ptr)
+			throw std::bad_cast();
+		return *ptr;
+	}
+};
+
+/// Load statistics of one registered loader, see ResourceStats.
+struct LoaderStats {
+	/// The loader's id, 0 for loads by function.
+	uint64_t loader = 0;
+	/// Completed and failed loads, including reloads. Loads cancelled by free_resource count as neither.
+	uint64_t loaded = 0;
+	uint64_t failed = 0;
+	/// Bytes read by file loaders, the raw data of other loaders is not measured.
+	uint64_t bytes_read = 0;
+	/// Microseconds each completed load spent waiting for a stage to take it, reading, decoding or waiting
+	/// for the identical resource it shares, finalizing including the wait for the main thread, and in total.
+	psi_util::Histogram wait_us;
+	psi_util::Histogram read_us;
+	psi_util::Histogram decode_us;
+	psi_util::Histogram finalize_us;
+	psi_util::Histogram total_us;
 };
 
+/// A snapshot of the resource service's statistics. Counters only ever grow, so the difference between
+/// two snapshots is what happened in between. The rest is the state at the time of the snapshot.
+struct ResourceStats {
+	/// One entry per loader which was used, by id.
+	std::vector<LoaderStats> loaders;
+
+	/// Requests of resources which were Loading or Available already, and requests which started a load.
+	uint64_t request_hits = 0;
+	uint64_t request_misses = 0;
+	/// Retrievals of Available resources, of Loading ones which had to be waited for, and of neither.
+	uint64_t retrieve_hits = 0;
+	uint64_t retrieve_waits = 0;
+	uint64_t retrieve_misses = 0;
+	/// Resources evicted to stay within the memory budget and the bytes they occupied.
+	uint64_t evictions = 0;
+	uint64_t evicted_bytes = 0;
+	/// Loads which shared the data of a resource with the same contents instead of decoding it.
+	uint64_t deduplicated = 0;
+	/// Reloads of resources whose files changed which were swapped in.
+	uint64_t reloads = 0;
+
+	/// Available resources and the bytes they occupy, as reported by their loaders.
+	/// Resources which share the data of one with the same contents occupy no bytes of their own.
+	size_t resident_count = 0;
+	size_t resident_bytes = 0;
+	/// Loads running in and waiting for the read and decode stages.
+	size_t reads_running = 0;
+	size_t reads_waiting = 0;
+	size_t decodes_running = 0;
+	size_t decodes_waiting = 0;
+};
+
+/// Logs the statistics with the load time percentiles of every loader.
+void log_resource_stats(ResourceStats const& stats);
+
+/// Writes the column names of write_resource_stats_row as a CSV line.
+void write_resource_stats_header(std::ostream& out);
+
+/// Writes the state in a snapshot and what the counters grew by since the previous one as a CSV line,
+/// e.g. once per frame to see the queue depths and the hit rate over time.
+void write_resource_stats_row(std::ostream& out, uint64_t frame, ResourceStats const& stats, ResourceStats const& previous);
+
 /// A thread-safe service which loads and manages resources.
 class IResourceService : psi_mark::ConstThreadsafe {
 public:
+	virtual ~IResourceService() {};
+
 	using ResourceLoaderId = uint64_t;
 
 	/// Resource handles are global to the resource service, not per-resource-type.
 	using ResourceHandle = size_t;
 
+	/// A hint of when a resource is needed.
+	using Deadline = std::chrono::steady_clock::time_point;
+
+	/// A request to load a resource with a registered loader.
+	struct ResourceRequest {
+		/// Resource storage handle to load into.
+		ResourceHandle handle;
+		/// Resource loader id.
+		ResourceLoaderId loader;
+		/// UTF-8 string parameter passed to the loader.
+		std::string param;
+		/// Loads with a higher priority start first, see set_priority.
+		float priority = 0.0f;
+		/// Among loads of equal priority, those needed sooner start first.
+		Deadline deadline = Deadline::max();
+	};
+
+	/// Receives a lock on the loaded resource, or nullptr if it failed to load or was freed.
+	using LoadedCallback = std::function<void(std::unique_ptr<IResourceLock>)>;
+
+	/// A loader split into stages, each run on its own kind of thread with a bounded number of loads in it.
+	/// A stage which falls behind holds back the stages before it instead of letting their outputs pile up.
+	struct StagedLoader {
+		/// Reads the raw data, e.g. the contents of a file. Runs on an I/O thread.
+		std::function<Resource(std::string const&)> read;
+		/// Returns the path of a file whose contents are the raw data, as a std::vector<char>. Used instead of read
+		/// if set, the file is then read asynchronously and does not occupy a thread while the read is in flight.
+		std::function<std::string(std::string const&)> file;
+		/// Turns the raw data into the resource, e.g. parses it. Runs on a worker thread. Optional.
+		std::function<Resource(Resource const&)> decode;
+		/// Finishes the resource on the main thread, for work which is only allowed there. Optional.
+		std::function<Resource(Resource const&)> finalize;
+		/// Returns the memory a loaded resource occupies in bytes, as in register_loader. Optional.
+		std::function<size_t(Resource const&)> size_of;
+		/// Returns the files the resource is loaded from, for hot reloading. Defaults to the file of file loaders.
+		std::function<std::vector<std::string>(std::string const&)> watch;
+		/// Returns a hash of the raw data, e.g. psi_util::xxh64 of the bytes. Resources of this loader whose
+		/// raw data hashes the same are decoded once and share the result. Defaults to hashing the contents
+		/// for file loaders. Not used for loaders with a finalize stage.
+		std::function<uint64_t(Resource const&)> content_hash;
+	};
+
 	/// Registers a loader function which can then be used to load resources.
 	/// Replaces previous loader if this id was already registered.
+	/// @param[in] id      resource loader id
+	/// @param[in] loader  a thread-safe loader function
+	/// @param[in] size_of a thread-safe function returning the memory a loaded resource occupies in bytes,
+	///                    used for the memory budget; resources count as 0 bytes without it
+	virtual void register_loader(
+	ResourceLoaderId id,
+	std::function<Resource(std::string const&)> loader,
+	std::function<size_t(Resource const&)> size_of = nullptr
+	) = 0;
+
+	/// Registers a loader function returning T by value. The result is moved into shared storage once,
+	/// it is never copied afterwards.
+	template <typename T>
+	void register_loader(
+	ResourceLoaderId id,
+	std::function<T(std::string const&)> loader,
+	std::function<size_t(T const&)> size_of = nullptr
+	) {
+		register_loader(id,
+			std::function<Resource(std::string const&)>([loader] (std::string const& s) {
+				return Resource::make(loader(s));
+			}),
+			size_of ? std::function<size_t(Resource const&)>([size_of] (Resource const& r) {
+				return size_of(*r.get<T>());
+			}) : nullptr
+		);
+	}
+
+	/// Registers a staged loader which can then be used to load resources like any other loader.
+	/// Replaces previous loader if this id was already registered. May be called while resources are requested
+	/// on other threads, loads which started already finish with the previous loader.
 	/// @param[in] id     resource loader id
-	/// @param[in] loader a thread-safe loader function
-	virtual void register_loader(ResourceLoaderId id, std::function<boost::any(std::string const&)> loader) = 0;
+	/// @param[in] loader thread-safe stage functions, read or file is required
+	virtual void register_staged_loader(ResourceLoaderId id, StagedLoader loader) = 0;
+
+	/// Registers a staged loader which reads Raw data on an I/O thread and decodes it into T on a worker.
+	/// The raw data is freed as soon as it is decoded.
+	/// @param[in] watch        returns the files read for a parameter, for hot reloading. Optional.
+	/// @param[in] content_hash returns a hash of the raw data, to decode identical data once. Optional.
+	template <typename Raw, typename T>
+	void register_staged_loader(
+	ResourceLoaderId id,
+	std::function<Raw(std::string const&)> read,
+	std::function<T(Raw const&)> decode,
+	std::function<size_t(T const&)> size_of = nullptr,
+	std::function<std::vector<std::string>(std::string const&)> watch = nullptr,
+	std::function<uint64_t(Raw const&)> content_hash = nullptr
+	) {
+		StagedLoader loader;
+		loader.watch = std::move(watch);
+		if (content_hash) {
+			loader.content_hash = [content_hash] (Resource const& raw) {
+				return content_hash(*raw.get<Raw>());
+			};
+		}
+		loader.read = [read] (std::string const& s) {
+			return Resource::make(read(s));
+		};
+		loader.decode = [decode] (Resource const& raw) {
+			return Resource::make(decode(*raw.get<Raw>()));
+		};
+		if (size_of) {
+			loader.size_of = [size_of] (Resource const& r) {
+				return size_of(*r.get<T>());
+			};
+		}
+		register_staged_loader(id, std::move(loader));
+	}
+
+	/// Registers a staged loader which reads a file asynchronously and decodes its contents into T on a worker.
+	/// @param[in] id     resource loader id
+	/// @param[in] file   maps the UTF-8 parameter to the path of the file
+	/// @param[in] decode turns the contents of the file into the resource
+	template <typename T>
+	void register_file_loader(
+	ResourceLoaderId id,
+	std::function<std::string(std::string const&)> file,
+	std::function<T(std::vector<char> const&)> decode,
+	std::function<size_t(T const&)> size_of = nullptr
+	) {
+		StagedLoader loader;
+		loader.file = std::move(file);
+		loader.decode = [decode] (Resource const& raw) {
+			return Resource::make(decode(*raw.get<std::vector<char>>()));
+		};
+		if (size_of) {
+			loader.size_of = [size_of] (Resource const& r) {
+				return size_of(*r.get<T>());
+			};
+		}
+		register_staged_loader(id, std::move(loader));
+	}
 
 	/// Requests a resource to be loaded with the specified loader.
 	/// @param[in] h     resource storage handle to load into
@@ -77,22 +364,136 @@ public:
 	/// @param[in] f a thread-safe loader function
 	/// @throw When input is invalid or loading is otherwise prevented.
 	/// @return Loading if loading began. Available if index is already in use.
-	virtual ResourceState request_resource(ResourceHandle h, std::function<boost::any()> f) const = 0;
+	virtual ResourceState request_resource(ResourceHandle h, std::function<Resource()> f) const = 0;
+
+	/// Requests many resources at once, each like request_resource. All loads are submitted before any completes,
+	/// so they proceed in parallel on the loading threads.
+	/// @param[in] requests the resources to load
+	/// @return The state of each requested resource, in request order.
+	/// @warning Assertion failure on unregistered type.
+	virtual std::vector<ResourceState> request_resources(std::vector<ResourceRequest> const& requests) const = 0;
+
+	/// Requests resources which are used together as a bundle. The children are requested like request_resources,
+	/// and the bundle handle becomes Available with a ResourceBundle of them once all of them are. Waiting for and
+	/// locking the bundle replaces waiting for and locking each child.
+	/// While the bundle is Available it keeps its children from being evicted on their own, they are evicted
+	/// together with it unless they are locked or in another bundle. Like a lock, the bundle keeps the versions of
+	/// its children it was completed with if they are freed or reloaded meanwhile. Freeing the bundle leaves its
+	/// children loaded.
+	/// @param[in] bundle   resource storage handle of the bundle
+	/// @param[in] children the resources to load, their priorities and deadlines apply as in request_resources
+	/// @return Loading if loading began. Available if the bundle handle is already in use.
+	///         The bundle fails to load if any of its children does.
+	/// @warning Assertion failure on unregistered type.
+	virtual ResourceState request_bundle(ResourceHandle bundle, std::vector<ResourceRequest> const& children) const = 0;
+
+	/// Requests a resource to be loaded with the specified loader, like request_resource.
+	/// @return A future which becomes Available once loaded or Unavailable if loading failed or it was freed.
+	virtual std::shared_future<ResourceState> request_resource_async(ResourceHandle h, ResourceLoaderId id, std::string param) const = 0;
 
 	/// Tries to retrieve the resource with the specified handle.
 	/// Waits until the resource finishes loading if it is.
+	/// While the returned lock exists the resource is never evicted.
 	/// @param[in] h storage handle of the requested resource
-	/// @return A read-lock on the resource or empty optional if resource is not currently Loading/Available.
+	/// @return A read-lock on the resource or empty optional if resource is not currently Loading/Available
+	///         or it was freed while loading.
 	virtual boost::optional<std::unique_ptr<IResourceLock>> retrieve_resource(ResourceHandle h) const = 0;
 
+	/// Retrieves the resource like retrieve_resource and shares ownership of it as T.
+	/// The data stays alive as long as the pointer, but unlike a lock it does not prevent eviction.
+	/// @return The resource, or nullptr if it is unavailable or not of type T.
+	template <typename T>
+	std::shared_ptr<T const> retrieve(ResourceHandle h) const {
+		auto lock = retrieve_resource(h);
+		if (!lock)
+			return nullptr;
+		return (*lock)->resource().share<T>();
+	}
+
+	/// Retrieves many resources at once, waiting until all of them finish loading.
+	/// @param[in] hs storage handles of the requested resources
+	/// @return A read-lock or empty optional for each resource, like retrieve_resource, in handle order.
+	virtual std::vector<boost::optional<std::unique_ptr<IResourceLock>>> retrieve_all(std::vector<ResourceHandle> const& hs) const = 0;
+
+	/// Retrieves the resource with the specified handle if it is Available. Never blocks.
+	/// @param[in] h storage handle of the requested resource
+	/// @return A read-lock on the resource or empty optional if it is not Available.
+	virtual boost::optional<std::unique_ptr<IResourceLock>> try_retrieve_resource(ResourceHandle h) const = 0;
+
+	/// Calls the callback once the resource finishes loading, or right away if it already has.
+	/// The callback is submitted as a task, so it only runs inside this call if the queue runs tasks synchronously.
+	/// @param[in] h        storage handle of the awaited resource
+	/// @param[in] callback receives the lock, or nullptr if the resource is not Loading/Available or fails to load
+	/// @param[in] queue    task queue to run the callback on, e.g. MAIN for GL uploads
+	virtual void on_loaded(ResourceHandle h, LoadedCallback callback, psi_thread::TaskQueue queue = psi_thread::TaskQueue::WORKER) const = 0;
+
+	/// Calls the callback each time the resource is reloaded because one of its files changed, until it is freed.
+	/// Only called if the service watches files, see ResourceLoaderArgs::hot_reload. The previous version stays
+	/// valid for as long as it is locked or shared elsewhere. A resource evicted meanwhile is loaded again
+	/// when its files change, so that the callback still receives the new version.
+	/// @param[in] h        storage handle of the watched resource
+	/// @param[in] callback receives a lock on the new version
+	/// @param[in] queue    task queue to run the callback on, e.g. MAIN for GL uploads
+	virtual void on_reloaded(ResourceHandle h, LoadedCallback callback, psi_thread::TaskQueue queue = psi_thread::TaskQueue::WORKER) const = 0;
+
 	/// Queries the state of the resource.
 	/// @param[in] h storage handle of the queried resource
 	/// @return The queried state.
 	virtual ResourceState resource_state(ResourceHandle h) const = 0;
 
-	/// Frees the resource if it is Available. Stops loading and frees it if it is Loading. Blocks.
+	/// Changes the priority of a Loading resource. Its load starts according to the new priority if it has
+	/// not started yet, later stages of it are ordered by it too.
+	/// @param[in] h        storage handle of the loading resource
+	/// @param[in] priority loads with a higher priority start first
+	/// @param[in] deadline among loads of equal priority, those needed sooner start first
+	/// @return false if the resource is not Loading
+	virtual bool set_priority(ResourceHandle h, float priority, Deadline deadline = Deadline::max()) const = 0;
+
+	/// Sets the priority of every Loading resource to its importance and reorders the waiting loads
+	/// accordingly. Meant to be called once a frame with e.g. the closeness to the camera.
+	/// @param[in] importance returns the new priority of a loading resource, it must not call this service
+	virtual void reprioritize(std::function<float(ResourceHandle)> const& importance) const = 0;
+
+	/// Frees the resource if it is Available. Cancels loading and frees it if it is Loading: a load which
+	/// has not started is dropped, one in progress stops before its next stage.
+	/// Does not block, existing locks keep the resource's memory alive until they are destroyed.
 	/// @param[in] h storage handle of the freed resource
 	/// @return What the state was before freeing.
 	virtual ResourceState free_resource(ResourceHandle h) const = 0;
+
+	/// Returns the number of bytes occupied by available resources, as reported by their loaders.
+	/// Data shared by resources with the same contents is counted once.
+	virtual size_t resident_bytes() const = 0;
+
+	/// Takes a snapshot of the load statistics. Cheap enough to be called every frame.
+	virtual ResourceStats stats() const = 0;
 };
+
+/// Returns the identifier of a resource or loader name which is only known at runtime, e.g. from a scene file.
+/// Identifiers are the names' fnv1a_64, so they are the same in every build and may be stored in files.
+/// Debug builds check that no two names have the same identifier.
+inline IResourceService::ResourceHandle resource_id(char const* name, size_t size) {
+	auto id = psi_util::fnv1a_64(name, size);
+	psi_util::register_hash(id, name, size);
+	return id;
+}
+
+inline IResourceService::ResourceHandle resource_id(std::string const& name) {
+	return resource_id(name.data(), name.size());
+}
+
+inline namespace literals {
+/// u8"meshes/cone"_rid is the resource_id of the name, computed at compile time where it is a constant expression.
+/// Literals are only checked for collisions if PSI_CHECK_RESOURCE_IDS is defined, which makes every use outside
+/// of a constant expression as slow as resource_id and needs __builtin_is_constant_evaluated.
+constexpr IResourceService::ResourceHandle operator"" _rid(char const* name, size_t size) {
+#if defined(PSI_CHECK_RESOURCE_IDS) && defined(__has_builtin)
+#if __has_builtin(__builtin_is_constant_evaluated)
+	if (!__builtin_is_constant_evaluated())
+		return resource_id(name, size);
+#endif
+#endif
+	return psi_util::fnv1a_64(name, size);
+}
+} // namespace literals
 } // namespace psi_serv
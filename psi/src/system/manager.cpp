@@ -23,10 +23,14 @@
 #include <unordered_map>
 #include <vector>
 #include <set>
+#include <atomic>
+#include <cstring>
 
 #include <boost/optional.hpp>
 
 #include "../util/assert.hpp"
+#include "../profile/profiler.hpp"
+#include "../profile/counters.hpp"
 
 
 namespace psi_sys {
@@ -150,82 +154,108 @@ void SystemManager::register_component_type(psi_scene::ComponentTypeInfo info) {
 }
 
 void SystemManager::load_scene(void*) {
-	// TODO load actual scene resource/file and init storage
+	PSI_PROFILE_ZONE("SystemManager::load_scene");
 
-	std::vector<std::pair<uint64_t, std::unique_ptr<psi_scene::ISceneDirectAccess>>> tasks;
-	for (auto& sys : _systems) {
-		tasks.emplace_back();
-		auto index = tasks.size() - 1;
+	// TODO load actual scene resource/file and init storage
 
-		tasks[index].first = _tasks.submit_task(
-			[&, this] {
-			tasks[index].second = _construct_access(sys->required_components());
-			sys->on_scene_loaded(*tasks[index].second);
-		}
-		);
-	}
+	_run_systems("ISystem::on_scene_loaded", [] (ISystem& sys, psi_scene::ISceneDirectAccess& acc) {
+		sys.on_scene_loaded(acc);
+	});
+}
 
-	// wait until all systems are done
-	std::vector<std::unique_ptr<psi_scene::ISceneDirectAccess>> accesses;
-	for (auto& t : tasks) {
-		_tasks.wait_for_task(t.first);
-		accesses.push_back(std::move(t.second));
-	}
+void SystemManager::update_scene() {
+	PSI_PROFILE_ZONE("SystemManager::update_scene");
 
-	_sync_with_accesses(accesses);
+	_run_systems("ISystem::on_scene_update", [] (ISystem& sys, psi_scene::ISceneDirectAccess& acc) {
+		sys.on_scene_update(acc);
+	});
 }
 
-void SystemManager::update_scene() {
-	std::vector<std::pair<uint64_t, std::unique_ptr<psi_scene::ISceneDirectAccess>>> tasks;
-	for (auto& sys : _systems) {
-		tasks.emplace_back();
-		auto index = tasks.size() - 1;
-
-		tasks[index].first = _tasks.submit_task(
-			[&, this] {
-			tasks[index].second = _construct_access(sys->required_components());
-			sys->on_scene_update(*tasks[index].second);
-		}
-		);
-	}
+void SystemManager::save_scene() {
+	PSI_PROFILE_ZONE("SystemManager::save_scene");
 
-	// wait until all systems are done
-	std::vector<std::unique_ptr<psi_scene::ISceneDirectAccess>> accesses;
-	for (auto& t : tasks) {
-		_tasks.wait_for_task(t.first);
-		accesses.push_back(std::move(t.second));
-	}
+	_run_systems("ISystem::on_scene_save", [] (ISystem& sys, psi_scene::ISceneDirectAccess& acc) {
+		sys.on_scene_save(acc, nullptr);
+	});
+}
 
-	_sync_with_accesses(accesses);
+void SystemManager::shut_scene(void*) {}
+
+SystemManager::FrameStats const& SystemManager::last_frame_stats() const {
+	return _stats;
 }
 
-void SystemManager::save_scene() {
-	std::vector<std::pair<uint64_t, std::unique_ptr<psi_scene::ISceneDirectAccess>>> tasks;
-	for (auto& sys : _systems) {
-		tasks.emplace_back();
-		auto index = tasks.size() - 1;
-
-		tasks[index].first = _tasks.submit_task(
-			[&, this] {
-			tasks[index].second = _construct_access(sys->required_components());
-			sys->on_scene_save(*tasks[index].second, nullptr);
-		}
-		);
+void SystemManager::_run_systems(char const* zone, std::function<void(ISystem&, psi_scene::ISceneDirectAccess&)> const& callback) {
+	uint64_t start = psi_prof::now_ns();
+	std::atomic<uint64_t> construct_ns(0);
+	std::atomic<uint64_t> systems_ns(0);
+
+	// reserved up front, tasks hold references into it while running concurrently
+	std::vector<std::pair<psi_thread::TaskHandle, std::unique_ptr<psi_scene::ISceneDirectAccess>>> tasks(_systems.size());
+	auto run = [&, this] (size_t index) {
+		PSI_PROFILE_ZONE(zone, index);
+		PSI_PROFILE_COUNTERS(zone, index);
+		auto& sys = *_systems[index];
+
+		uint64_t t0 = psi_prof::now_ns();
+		tasks[index].second = _construct_access(sys.required_components());
+		uint64_t t1 = psi_prof::now_ns();
+		callback(sys, *tasks[index].second);
+		uint64_t t2 = psi_prof::now_ns();
+
+		construct_ns += t1 - t0;
+		systems_ns += t2 - t1;
+	};
+
+	for (size_t index = 0; index < _systems.size(); ++index) {
+		if (_systems[index]->requires_main_thread())
+			tasks[index].first = psi_thread::INVALID_TASK;
+		else
+			tasks[index].first = _tasks.submit_task([&run, index] { run(index); });
+	}
+	// main thread systems overlap with the workers
+	for (size_t index = 0; index < _systems.size(); ++index) {
+		if (_systems[index]->requires_main_thread())
+			run(index);
 	}
 
 	// wait until all systems are done
+	std::vector<psi_thread::TaskHandle> handles;
+	for (auto const& t : tasks) {
+		handles.push_back(t.first);
+	}
+	_tasks.wait_all(handles);
+
 	std::vector<std::unique_ptr<psi_scene::ISceneDirectAccess>> accesses;
 	for (auto& t : tasks) {
-		_tasks.wait_for_task(t.first);
 		accesses.push_back(std::move(t.second));
 	}
 
+	size_t access_bytes = 0;
+	for (auto const& a : accesses) {
+		for (auto const& store : static_cast<SystemManagerScene*>(a.get())->_scene) {
+			access_bytes += store.second.data.size() + store.second.added.size();
+		}
+	}
+
+	uint64_t sync_start = psi_prof::now_ns();
 	_sync_with_accesses(accesses);
+	uint64_t end = psi_prof::now_ns();
+
+	_stats.total_ns = end - start;
+	_stats.construct_ns = construct_ns;
+	_stats.systems_ns = systems_ns;
+	_stats.sync_ns = end - sync_start;
+	_stats.access_bytes = access_bytes;
+	_stats.scene_bytes = 0;
+	for (auto const& store : _scene) {
+		_stats.scene_bytes += store.second.data.size();
+	}
 }
 
-void SystemManager::shut_scene(void*) {}
-
 std::unique_ptr<psi_scene::ISceneDirectAccess> SystemManager::_construct_access(psi_scene::ComponentTypeIdBitset types) {
+	PSI_PROFILE_ZONE("SystemManager::_construct_access", types);
+
 	SystemManagerScene* access = new SystemManagerScene;
 	for (auto const& map : _scene) {
 		auto const& store = map.second;
@@ -246,30 +276,70 @@ std::unique_ptr<psi_scene::ISceneDirectAccess> SystemManager::_construct_access(
 }
 
 void SystemManager::_sync_with_accesses(std::vector<std::unique_ptr<psi_scene::ISceneDirectAccess>>& accesses) {
-	// one sync operation per component type
+	PSI_PROFILE_ZONE("SystemManager::_sync_with_accesses");
+
+	// component counts from before this sync, ids at or above them refer to added components
+	std::unordered_map<psi_scene::ComponentTypeId, size_t> stored_n;
 	for (auto const& type : _scene) {
+		stored_n[type.first] = type.second.stored_n;
+	}
+
+	// added components are appended access by access, so find out where each access's additions will land
+	// before syncing any type, references between added components of different types depend on it
+	std::vector<std::unordered_map<psi_scene::ComponentTypeId, size_t>> added_base(accesses.size());
+	std::unordered_map<psi_scene::ComponentTypeId, size_t> new_n = stored_n;
+	for (size_t i_acc = 0; i_acc < accesses.size(); ++i_acc) {
+		SystemManagerScene* sc = static_cast<SystemManagerScene*>(accesses[i_acc].get());
+		for (auto const& store : sc->_scene) {
+			added_base[i_acc][store.first] = new_n[store.first];
+			new_n[store.first] += store.second.added_n;
+		}
+	}
+
+	// points references to components added by the given access at their post-sync ids
+	auto remap_refs = [&] (size_t i_acc, psi_scene::ComponentTypeInfo const& info, char* comp) {
+		for (auto const& rel : info.relations) {
+			// unused relation slots are zeroed
+			if (rel.ref_comp_type == 0)
+				continue;
+
+			auto& ref = *reinterpret_cast<psi_scene::ComponentHandle*>(comp + rel.offset);
+			if (ref == psi_scene::NO_COMPONENT || size_t(ref) < stored_n[rel.ref_comp_type])
+				continue;
+
+			// the access could only have added the referenced component if it required its type
+			ASSERT(added_base[i_acc].count(rel.ref_comp_type));
+			ref = psi_scene::ComponentHandle(added_base[i_acc][rel.ref_comp_type] + size_t(ref) - stored_n[rel.ref_comp_type]);
+		}
+	};
+
+	// one sync operation per component type
+	for (auto& type : _scene) {
+		auto& scene_store = type.second;
+		size_t const type_size = scene_store.info.size;
+
 		// make a list of all storages of accesses which requested the given type
-		std::vector<SystemManagerScene::ComponentTypeStorage*> storage;
-		for (auto& a : accesses) {
-			SystemManagerScene* sc = static_cast<SystemManagerScene*>(a.get());
+		std::vector<std::pair<size_t, SystemManagerScene::ComponentTypeStorage*>> storage;
+		for (size_t i_acc = 0; i_acc < accesses.size(); ++i_acc) {
+			SystemManagerScene* sc = static_cast<SystemManagerScene*>(accesses[i_acc].get());
 			if (sc->_scene.count(type.first)) {
-				storage.push_back(&sc->_scene[type.first]);
+				storage.emplace_back(i_acc, &sc->_scene[type.first]);
 			}
 		}
 
 		// aggregate indices of components which are to be removed
 		std::set<size_t> to_remove;
 		for (auto s : storage) {
-			to_remove.insert(s->to_remove.begin(), s->to_remove.end());
+			to_remove.insert(s.second->to_remove.begin(), s.second->to_remove.end());
 		}
 
 
 		// aggregate indices of components which underwent changes
 		std::vector<size_t> changed;
 		for (auto s : storage) {
-			for (size_t id : s->changed) {
+			for (size_t id : s.second->changed) {
 				// discard changes to components which will be removed
-				if (std::find(to_remove.cbegin(), to_remove.cend(), id) != to_remove.cend())
+				if (to_remove.count(id))
 					continue;
 
 				if (std::find(changed.cbegin(), changed.cend(), id) != changed.cend()) {
@@ -281,17 +351,14 @@ void SystemManager::_sync_with_accesses(std::vector<std::unique_ptr<psi_scene::I
 				else {
 					changed.push_back(id);
 
-					size_t type_size = type.second.info.size;
-					char* data = &s->data[id];
-
+					char* data = &s.second->data[id * type_size];
 
 					// do different things based on what kind of change happened
 					// first handle owning references
 					//
 					// normal refs need only be handled in removal
-
-
-					// TODO sync change here
+					remap_refs(s.first, scene_store.info, data);
+					memcpy(&scene_store.data[id * type_size], data, type_size);
 				}
 			}
 		}
@@ -302,20 +369,122 @@ void SystemManager::_sync_with_accesses(std::vector<std::unique_ptr<psi_scene::I
 		// just copy data
 		// and for types which hold references update the references
 		for (auto s : storage) {
-			for (size_t i_a = 0; i_a < s->added_n; ++i_a) {
-				size_t len = type.second.info.size;
-				char* data = &s->added[i_a * len];
-
-				// have to update refs!
+			for (size_t i_a = 0; i_a < s.second->added_n; ++i_a) {
+				char* data = &s.second->added[i_a * type_size];
 
+				remap_refs(s.first, scene_store.info, data);
+			}
 
+			scene_store.data.insert(scene_store.data.end(), s.second->added.begin(), s.second->added.end());
+			scene_store.stored_n += s.second->added_n;
+		}
+	}
 
+	// removals go last, once every type's additions have their final ids;
+	// marks are by the ids accesses saw, which for their own additions differ from the final ones
+	std::unordered_map<psi_scene::ComponentTypeId, std::vector<bool>> removed;
+	bool any_removed = false;
+	for (size_t i_acc = 0; i_acc < accesses.size(); ++i_acc) {
+		SystemManagerScene* sc = static_cast<SystemManagerScene*>(accesses[i_acc].get());
+		for (auto const& store : sc->_scene) {
+			auto& marks = removed[store.first];
+			marks.resize(_scene[store.first].stored_n);
+			for (size_t id : store.second.to_remove) {
+				size_t old_n = stored_n[store.first];
+				marks[id < old_n ? id : added_base[i_acc][store.first] + id - old_n] = true;
+				any_removed = true;
 			}
+		}
+	}
+	if (!any_removed)
+		return;
 
+	for (auto& type : _scene) {
+		removed[type.first].resize(type.second.stored_n);
+	}
 
+	// owned components go with the last of their owners, components go with what they necessarily reference
+	for (bool cascaded = true; cascaded; ) {
+		cascaded = false;
 
+		// per component: 0 if nothing owns it, 1 if only removed components do, 2 if an owner stays
+		std::unordered_map<psi_scene::ComponentTypeId, std::vector<char>> owners;
+		for (auto& type : _scene) {
+			owners[type.first].assign(type.second.stored_n, 0);
+		}
 
+		for (auto& type : _scene) {
+			auto& marks = removed[type.first];
+			for (size_t id = 0; id < type.second.stored_n; ++id) {
+				char const* comp = &type.second.data[id * type.second.info.size];
+				for (auto const& rel : type.second.info.relations) {
+					if (rel.ref_comp_type == 0)
+						continue;
+
+					auto ref = *reinterpret_cast<psi_scene::ComponentHandle const*>(comp + rel.offset);
+					if (ref == psi_scene::NO_COMPONENT)
+						continue;
+
+					ASSERT(size_t(ref) < removed[rel.ref_comp_type].size());
+					if (rel.type == psi_scene::ComponentRelationship::Type::OWNERSHIP) {
+						auto& owned = owners[rel.ref_comp_type][ref];
+						owned = marks[id] ? std::max<char>(owned, 1) : 2;
+					}
+					else if (rel.type == psi_scene::ComponentRelationship::Type::NECESSARY_REFERENCE
+						&& removed[rel.ref_comp_type][ref] && !marks[id]) {
+						marks[id] = true;
+						cascaded = true;
+					}
+				}
+			}
+		}
 
+		for (auto& type : owners) {
+			auto& marks = removed[type.first];
+			for (size_t id = 0; id < type.second.size(); ++id) {
+				if (type.second[id] == 1 && !marks[id]) {
+					marks[id] = true;
+					cascaded = true;
+				}
+			}
+		}
+	}
+
+	// compact each type's storage, remembering where the remaining components moved
+	std::unordered_map<psi_scene::ComponentTypeId, std::vector<psi_scene::ComponentHandle>> moved;
+	for (auto& type : _scene) {
+		auto& scene_store = type.second;
+		size_t const type_size = scene_store.info.size;
+		auto const& marks = removed[type.first];
+		auto& to = moved[type.first];
+		to.resize(scene_store.stored_n, psi_scene::NO_COMPONENT);
+
+		size_t kept = 0;
+		for (size_t id = 0; id < scene_store.stored_n; ++id) {
+			if (marks[id])
+				continue;
+
+			if (kept != id)
+				memmove(&scene_store.data[kept * type_size], &scene_store.data[id * type_size], type_size);
+			to[id] = psi_scene::ComponentHandle(kept++);
+		}
+		scene_store.stored_n = kept;
+		scene_store.data.resize(kept * type_size);
+	}
+
+	// references follow the components they point at, those to removed ones are cleared
+	for (auto& type : _scene) {
+		auto& scene_store = type.second;
+		for (size_t id = 0; id < scene_store.stored_n; ++id) {
+			char* comp = &scene_store.data[id * scene_store.info.size];
+			for (auto const& rel : scene_store.info.relations) {
+				if (rel.ref_comp_type == 0)
+					continue;
+
+				auto& ref = *reinterpret_cast<psi_scene::ComponentHandle*>(comp + rel.offset);
+				if (ref != psi_scene::NO_COMPONENT)
+					ref = moved[rel.ref_comp_type][ref];
+			}
 		}
 	}
 }
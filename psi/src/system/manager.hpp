@@ -23,6 +23,7 @@
 #include <vector>
 #include <unordered_map>
 #include <cstdint>
+#include <functional>
 
 #include "system.hpp"
 #include "../thread/manager.hpp"
@@ -47,9 +48,29 @@ public:
 
 	void shut_scene(void*);
 
+	/// Timings and memory use of the last load_scene, update_scene or save_scene call.
+	struct FrameStats {
+		/// Wall time of the whole call.
+		uint64_t total_ns = 0;
+		/// Time spent in _construct_access, summed over all systems.
+		uint64_t construct_ns = 0;
+		/// Time spent in system callbacks, summed over all systems.
+		uint64_t systems_ns = 0;
+		/// Wall time of _sync_with_accesses.
+		uint64_t sync_ns = 0;
+		/// Bytes of component data stored in the scene after syncing.
+		size_t scene_bytes = 0;
+		/// Bytes of component data copied into or added to accesses.
+		size_t access_bytes = 0;
+	};
+
+	FrameStats const& last_frame_stats() const;
+
 private:
 	psi_thread::TaskManager const& _tasks;
 
+	FrameStats _stats;
+
 	struct ComponentTypeStorage {
 		std::vector<char> data;
 		size_t stored_n = 0;
@@ -60,6 +81,10 @@ private:
 
 	std::vector<std::unique_ptr<ISystem>> _systems;
 
+	/// Runs the callback for every system, each with its own access, then syncs the accesses.
+	/// @param[in] zone profiling zone name for a single system callback
+	void _run_systems(char const* zone, std::function<void(ISystem&, psi_scene::ISceneDirectAccess&)> const&);
+
 	std::unique_ptr<psi_scene::ISceneDirectAccess> _construct_access(psi_scene::ComponentTypeIdBitset);
 	void _sync_with_accesses(std::vector<std::unique_ptr<psi_scene::ISceneDirectAccess>>&);
 };
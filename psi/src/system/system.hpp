@@ -40,5 +40,9 @@ public:
 	virtual void on_scene_update(psi_scene::ISceneDirectAccess&) = 0;
 	virtual void on_scene_save(psi_scene::ISceneDirectAccess&, void* replace_with_save_file) = 0;
 	virtual void on_scene_shutdown(psi_scene::ISceneDirectAccess&) = 0;
+
+	/// Systems which use thread-affine APIs, such as the GL context, return true here
+	/// and are run on the thread calling SystemManager rather than on a worker.
+	virtual bool requires_main_thread() const { return false; }
 };
 } // namespace psi_sys
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "epoch.hpp"
+
+#include <thread>
+#include <functional>
+#include <algorithm>
+
+#include "../util/assert.hpp"
+
+
+/// Retirements between attempts to advance the epoch and delete garbage.
+static constexpr size_t COLLECT_INTERVAL = 64;
+
+psi_thread::EpochManager::EpochManager(size_t max_readers)
+	: _records(new Record[max_readers])
+	, _record_count(max_readers)
+	, _epoch(1) {
+	ASSERT(max_readers > 0);
+
+	for (size_t i = 0; i < max_readers; ++i) {
+		_records[i].epoch.store(0, std::memory_order_relaxed);
+	}
+}
+
+psi_thread::EpochManager::~EpochManager() {
+	for (auto const& r : _retired) {
+		r.deleter(r.ptr);
+	}
+}
+
+psi_thread::EpochManager::Guard psi_thread::EpochManager::pin() const {
+	// start at a thread-specific record, so that threads rarely contend for one
+	size_t start = std::hash<std::thread::id>()(std::this_thread::get_id()) % _record_count;
+	while (true) {
+		for (size_t i = 0; i < _record_count; ++i) {
+			auto& rec = _records[(start + i) % _record_count].epoch;
+			uint64_t free = 0;
+			// seq_cst orders publishing the epoch before any load the reader does afterwards,
+			// so a stale epoch only delays reclamation and never allows a premature one
+			if (rec.load(std::memory_order_relaxed) == 0
+			&& rec.compare_exchange_strong(free, _epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst))
+				return Guard(&rec);
+		}
+		std::this_thread::yield();
+	}
+}
+
+void psi_thread::EpochManager::_retire(void* ptr, void (*deleter)(void*)) const {
+	std::lock_guard<std::mutex> lock(_retired_mut);
+	_retired.push_back({_epoch.load(std::memory_order_seq_cst), ptr, deleter});
+
+	if (_retired.size() % COLLECT_INTERVAL == 0) {
+		_try_advance();
+		_collect();
+	}
+}
+
+void psi_thread::EpochManager::_try_advance() const {
+	uint64_t epoch = _epoch.load(std::memory_order_seq_cst);
+	for (size_t i = 0; i < _record_count; ++i) {
+		uint64_t e = _records[i].epoch.load(std::memory_order_seq_cst);
+		if (e != 0 && e != epoch)
+			return;
+	}
+
+	_epoch.compare_exchange_strong(epoch, epoch + 1, std::memory_order_seq_cst);
+}
+
+void psi_thread::EpochManager::_collect() const {
+	// readers pinned at most one epoch behind the current one, what was retired before that is unreachable
+	uint64_t safe = _epoch.load(std::memory_order_seq_cst);
+	auto end = std::partition(_retired.begin(), _retired.end(), [safe] (Retired const& r) {
+		return r.epoch + 2 > safe;
+	});
+	for (auto it = end; it != _retired.end(); ++it) {
+		it->deleter(it->ptr);
+	}
+	_retired.erase(end, _retired.end());
+}
+
+size_t psi_thread::EpochManager::pending() const {
+	std::lock_guard<std::mutex> lock(_retired_mut);
+	return _retired.size();
+}
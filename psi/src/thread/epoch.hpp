@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_thread {
+/// Epoch-based memory reclamation for lock-free data structures.
+/// Readers pin the current epoch while they hold raw pointers into a structure. Writers unlink nodes
+/// and retire them, and retired nodes are deleted once every reader which could still see them unpinned.
+/// Pinning never blocks and never allocates.
+class EpochManager : psi_mark::Threadsafe {
+public:
+	/// Keeps the epoch pinned while alive, pointers loaded meanwhile stay valid.
+	class Guard : psi_mark::NonThreadsafe {
+	public:
+		Guard(Guard&& other)
+			: _record(other._record) {
+			other._record = nullptr;
+		}
+
+		~Guard() {
+			if (_record)
+				_record->store(0, std::memory_order_release);
+		}
+
+		Guard(Guard const&) = delete;
+		Guard& operator=(Guard const&) = delete;
+		Guard& operator=(Guard&&) = delete;
+
+	private:
+		friend class EpochManager;
+
+		explicit Guard(std::atomic<uint64_t>* record)
+			: _record(record) {}
+
+		std::atomic<uint64_t>* _record;
+	};
+
+	/// @param[in] max_readers number of guards which may exist at once
+	explicit EpochManager(size_t max_readers = 256);
+	/// Deletes everything retired. No guards may exist anymore.
+	~EpochManager();
+
+	/// Pins the current epoch.
+	/// @warning Spins if max_readers guards exist already.
+	Guard pin() const;
+
+	/// Deletes the object once no reader can reference it anymore.
+	/// Must only be called after the object was made unreachable for new readers.
+	template <typename T>
+	void retire(T* ptr) const {
+		_retire(ptr, [] (void* p) { delete static_cast<T*>(p); });
+	}
+
+	/// Returns the number of retired objects waiting to be deleted.
+	size_t pending() const;
+
+private:
+	struct Retired {
+		uint64_t epoch;
+		void* ptr;
+		void (*deleter)(void*);
+	};
+
+	/// The epoch a reader pinned, or 0 if unused. Padded to avoid false sharing between readers.
+	struct alignas(64) Record {
+		std::atomic<uint64_t> epoch;
+	};
+
+	void _retire(void* ptr, void (*deleter)(void*)) const;
+	/// Advances the global epoch if all pinned readers have seen the current one.
+	void _try_advance() const;
+	/// Deletes objects retired at least two epochs ago. Requires _retired_mut.
+	void _collect() const;
+
+	std::unique_ptr<Record[]> _records;
+	size_t _record_count;
+	/// Starts at 1, 0 marks unused records.
+	mutable std::atomic<uint64_t> _epoch;
+
+	mutable std::mutex _retired_mut;
+	mutable std::vector<Retired> _retired;
+};
+} // namespace psi_thread
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+#include "../util/assert.hpp"
+
+
+namespace psi_thread {
+template <typename Signature, size_t Capacity>
+class InplaceFunction;
+
+/// A move-only replacement for std::function which stores the callable in a fixed-size
+/// internal buffer and therefore never allocates. Callables which do not fit fail to compile.
+template <typename R, typename... Args, size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+public:
+	InplaceFunction() noexcept
+		: _ops(nullptr) {}
+
+	template <typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, InplaceFunction>::value>>
+	InplaceFunction(F&& f)
+		: _ops(_ops_for<std::decay_t<F>>()) {
+		using Fn = std::decay_t<F>;
+		static_assert(sizeof(Fn) <= Capacity, "Callable is too large for this InplaceFunction, capture less by value.");
+		static_assert(alignof(Fn) <= alignof(std::max_align_t), "Callable is over-aligned.");
+
+		new (&_storage) Fn(std::forward<F>(f));
+	}
+
+	InplaceFunction(InplaceFunction&& other) noexcept
+		: _ops(other._ops) {
+		if (_ops) {
+			_ops->move(&_storage, &other._storage);
+			other._ops = nullptr;
+		}
+	}
+
+	InplaceFunction& operator=(InplaceFunction&& other) noexcept {
+		if (this != &other) {
+			reset();
+			_ops = other._ops;
+			if (_ops) {
+				_ops->move(&_storage, &other._storage);
+				other._ops = nullptr;
+			}
+		}
+		return *this;
+	}
+
+	InplaceFunction(InplaceFunction const&) = delete;
+	InplaceFunction& operator=(InplaceFunction const&) = delete;
+
+	~InplaceFunction() {
+		reset();
+	}
+
+	/// Destroys the stored callable, if any.
+	void reset() noexcept {
+		if (_ops) {
+			_ops->destroy(&_storage);
+			_ops = nullptr;
+		}
+	}
+
+	explicit operator bool() const noexcept {
+		return _ops != nullptr;
+	}
+
+	R operator()(Args... args) {
+		ASSERT(_ops);
+		return _ops->invoke(&_storage, std::forward<Args>(args)...);
+	}
+
+private:
+	struct Ops {
+		R (*invoke)(void*, Args&&...);
+		/// Move-constructs into dst and destroys src.
+		void (*move)(void* dst, void* src);
+		void (*destroy)(void*);
+	};
+
+	template <typename Fn>
+	static R _invoke(void* f, Args&&... args) {
+		return (*static_cast<Fn*>(f))(std::forward<Args>(args)...);
+	}
+
+	template <typename Fn>
+	static void _move(void* dst, void* src) {
+		new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+		static_cast<Fn*>(src)->~Fn();
+	}
+
+	template <typename Fn>
+	static void _destroy(void* f) {
+		static_cast<Fn*>(f)->~Fn();
+	}
+
+	template <typename Fn>
+	static Ops const* _ops_for() {
+		static Ops const ops = {
+			&_invoke<Fn>,
+			&_move<Fn>,
+			&_destroy<Fn>,
+		};
+		return &ops;
+	}
+
+	std::aligned_storage_t<Capacity, alignof(std::max_align_t)> _storage;
+	Ops const* _ops;
+};
+} // namespace psi_thread
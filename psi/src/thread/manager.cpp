@@ -20,19 +20,397 @@
 
 #include "manager.hpp"
 
+#include <algorithm>
+#include <cstdlib>
+#include <string>
 
-uint64_t psi_thread::TaskManager::submit_task(std::function<void()> f) const {
-	// such threading
-	// much concurrency
-	// wow
-	f();
-	return 0;
+#include "topology.hpp"
+#include "../profile/counters.hpp"
+#include "../util/assert.hpp"
+
+
+static constexpr uint64_t pack_state(uint32_t generation, uint32_t status) {
+	return uint64_t(generation) << 32 | status;
+}
+
+static constexpr uint32_t state_generation(uint64_t state) {
+	return uint32_t(state >> 32);
+}
+
+static constexpr uint32_t state_status(uint64_t state) {
+	return uint32_t(state);
+}
+
+/// Reads an integer environment variable.
+/// @return false if unset or not a number
+static bool env_int(char const* name, long& out) {
+	char const* val = std::getenv(name);
+	if (!val || !*val)
+		return false;
+
+	char* end;
+	long l = std::strtol(val, &end, 10);
+	if (*end != '\0')
+		return false;
+
+	out = l;
+	return true;
+}
+
+static std::vector<psi_thread::PhysicalCore> cores_on_node(psi_thread::CpuTopology const& topo, int32_t node) {
+	auto cores = topo.physical_cores();
+	if (node < 0)
+		return cores;
+
+	std::vector<psi_thread::PhysicalCore> on_node;
+	std::copy_if(cores.begin(), cores.end(), std::back_inserter(on_node), [node](psi_thread::PhysicalCore const& c) {
+		return c.front().node == uint32_t(node);
+	});
+	// a node without CPUs available to us is as good as no restriction
+	return on_node.empty() ? cores : on_node;
+}
+
+/// Sizes the threads for the final NUMA node, see auto_task_manager_args.
+static psi_thread::TaskManagerArgs auto_args_on_node(psi_thread::CpuTopology const& topo, int32_t numa_node) {
+	psi_thread::TaskManagerArgs args;
+	args.pin_threads = true;
+	args.numa_node = numa_node;
+
+	size_t cores = cores_on_node(topo, numa_node).size();
+	// the main thread keeps a core for itself
+	args.workers = std::max<size_t>(cores, 2) - 1;
+	args.io_workers = 2;
+
+	long l;
+	if (env_int("PSI_WORKER_THREADS", l) && l >= 0)
+		args.workers = size_t(l);
+	if (env_int("PSI_IO_THREADS", l) && l >= 0)
+		args.io_workers = size_t(l);
+	if (env_int("PSI_PIN_THREADS", l))
+		args.pin_threads = l != 0;
+
+	return args;
+}
+
+psi_thread::TaskManagerArgs psi_thread::auto_task_manager_args() {
+	auto topo = detect_topology();
+
+	// crossing sockets costs more in cache traffic than the extra cores win us
+	int32_t node = topo.node_count() > 1 ? int32_t(current_node(topo)) : -1;
+	long l;
+	if (env_int("PSI_NUMA_NODE", l))
+		node = int32_t(l);
+
+	return auto_args_on_node(topo, node);
 }
 
-bool psi_thread::TaskManager::wait_for_task(uint64_t) const {
-	return false;
+psi_thread::TaskManagerArgs psi_thread::auto_task_manager_args(int32_t numa_node) {
+	return auto_args_on_node(detect_topology(), numa_node);
 }
 
-bool psi_thread::TaskManager::is_task_running(uint64_t) const {
-	return false;
+psi_thread::TaskManager::TaskManager(TaskManagerArgs args)
+	: _slots(new Slot[args.max_tasks])
+	, _slot_count(args.max_tasks)
+	, _free_head(0)
+	, _worker_count(args.workers)
+	, _io_worker_count(args.io_workers)
+	, _waiters(0)
+	, _stop(false) {
+	ASSERT(args.max_tasks > 0 && args.max_tasks < NO_SLOT);
+
+	// all slots start out free, linked in order
+	for (size_t i = 0; i < args.max_tasks; ++i) {
+		_slots[i].state.store(pack_state(0, FREE), std::memory_order_relaxed);
+		_slots[i].next_free.store(i + 1 < args.max_tasks ? uint32_t(i + 1) : NO_SLOT, std::memory_order_relaxed);
+	}
+
+	std::vector<std::vector<uint32_t>> worker_cpus(args.workers);
+	std::vector<uint32_t> io_cpus;
+	if (args.pin_threads) {
+		auto cores = cores_on_node(detect_topology(), args.numa_node);
+
+		// the main thread gets the first core with all its hardware threads
+		std::vector<uint32_t> main_cpus;
+		for (auto const& cpu : cores.front())
+			main_cpus.push_back(cpu.id);
+		pin_current_thread(main_cpus);
+
+		// workers go on the primary hardware thread of each other core, wrapping around to siblings
+		// and finally sharing cores when there are more workers than hardware threads
+		size_t other = cores.size() > 1 ? cores.size() - 1 : 1;
+		size_t first = cores.size() > 1 ? 1 : 0;
+		for (size_t i = 0; i < args.workers; ++i) {
+			auto const& core = cores[first + i % other];
+			worker_cpus[i].push_back(core[(i / other) % core.size()].id);
+		}
+
+		// I/O threads mostly sleep, so they float over the hyperthread siblings the workers leave idle
+		for (size_t c = first; c < cores.size(); ++c) {
+			for (size_t t = 1; t < cores[c].size(); ++t)
+				io_cpus.push_back(cores[c][t].id);
+		}
+		if (io_cpus.empty()) {
+			for (size_t c = first; c < cores.size(); ++c)
+				io_cpus.push_back(cores[c].front().id);
+		}
+	}
+
+	for (size_t i = 0; i < args.workers; ++i) {
+		auto cpus = worker_cpus[i];
+		_threads.emplace_back([this, cpus]{ _work(TaskQueue::WORKER, cpus); });
+	}
+	for (size_t i = 0; i < args.io_workers; ++i) {
+		_threads.emplace_back([this, io_cpus]{ _work(TaskQueue::IO, io_cpus); });
+	}
+}
+
+psi_thread::TaskManager::~TaskManager() {
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_stop = true;
+	}
+	for (auto& q : _queued) {
+		q.notify_all();
+	}
+
+	for (auto& t : _threads) {
+		t.join();
+	}
+}
+
+uint32_t psi_thread::TaskManager::_acquire_slot() const {
+	uint64_t head = _free_head.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t index = uint32_t(head);
+		if (index == NO_SLOT)
+			return NO_SLOT;
+
+		// may read a stale link if another thread popped this slot meanwhile, the tag makes the CAS fail then
+		uint32_t next = _slots[index].next_free.load(std::memory_order_relaxed);
+		uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+		if (_free_head.compare_exchange_weak(head, new_head, std::memory_order_acq_rel, std::memory_order_acquire))
+			return index;
+	}
+}
+
+void psi_thread::TaskManager::_release_slot(uint32_t index) const {
+	uint64_t head = _free_head.load(std::memory_order_relaxed);
+	while (true) {
+		_slots[index].next_free.store(uint32_t(head), std::memory_order_relaxed);
+		uint64_t new_head = ((head >> 32) + 1) << 32 | index;
+		if (_free_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed))
+			return;
+	}
+}
+
+psi_thread::TaskHandle psi_thread::TaskManager::submit_task(Task task, TaskCallback on_complete, CancellationToken const* token, TaskQueue queue) const {
+	uint32_t index = _acquire_slot();
+	if (index == NO_SLOT) {
+		// all slots are taken, help finishing tasks until one frees up
+		_wait_until([&]{
+			index = _acquire_slot();
+			return index != NO_SLOT;
+		});
+	}
+
+	// the slot is exclusively ours until it is queued
+	auto& slot = _slots[index];
+	slot.task = std::move(task);
+	slot.on_complete = std::move(on_complete);
+	if (token)
+		slot.cancelled = token->_cancelled;
+
+	uint32_t generation = state_generation(slot.state.load(std::memory_order_relaxed));
+	slot.state.store(pack_state(generation, QUEUED), std::memory_order_release);
+	TaskHandle handle = {index, generation};
+
+	if (queue == TaskQueue::IO && _io_worker_count == 0)
+		queue = TaskQueue::WORKER;
+
+	if (queue == TaskQueue::WORKER && _worker_count == 0) {
+		// such threading
+		// much concurrency
+		// wow
+		_execute(index);
+		return handle;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		_queues[size_t(queue)].push_back(index);
+	}
+	_queued[size_t(queue)].notify_one();
+
+	// threads waiting for tasks help out with worker tasks, see _wait_until
+	if (queue == TaskQueue::WORKER && _waiters.load(std::memory_order_seq_cst) > 0) {
+		std::lock_guard<std::mutex> lock(_mut);
+		_finished.notify_all();
+	}
+
+	return handle;
+}
+
+void psi_thread::TaskManager::_execute(uint32_t index) const {
+	auto& slot = _slots[index];
+	uint32_t generation = state_generation(slot.state.load(std::memory_order_relaxed));
+
+	TaskStatus status = TaskStatus::CANCELLED;
+	if (!slot.cancelled || !slot.cancelled->load(std::memory_order_relaxed)) {
+		slot.state.store(pack_state(generation, RUNNING), std::memory_order_relaxed);
+		{
+			PSI_PROFILE_COUNTERS("TaskManager::task");
+			slot.task();
+		}
+		status = TaskStatus::DONE;
+	}
+
+	if (slot.on_complete)
+		slot.on_complete(status);
+
+	slot.task.reset();
+	slot.on_complete.reset();
+	slot.cancelled.reset();
+
+	// bumping the generation invalidates all handles to this task, it is finished now
+	slot.state.store(pack_state(generation + 1, FREE), std::memory_order_seq_cst);
+	_release_slot(index);
+
+	if (_waiters.load(std::memory_order_seq_cst) > 0) {
+		// taking the lock ensures waiters are either before their check or already waiting
+		std::lock_guard<std::mutex> lock(_mut);
+		_finished.notify_all();
+	}
+}
+
+bool psi_thread::TaskManager::_run_queued(TaskQueue q) const {
+	uint32_t index;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		auto& queue = _queues[size_t(q)];
+		if (queue.empty())
+			return false;
+
+		index = queue.front();
+		queue.pop_front();
+	}
+
+	_execute(index);
+	return true;
+}
+
+template <typename Pred>
+void psi_thread::TaskManager::_wait_until(Pred pred) const {
+	while (!pred()) {
+		// help out instead of idling, this also prevents deadlocks when waiting from a worker;
+		// I/O tasks are left alone, they could block the waiter for long
+		if (_run_queued())
+			continue;
+
+		_waiters.fetch_add(1, std::memory_order_seq_cst);
+		{
+			std::unique_lock<std::mutex> lock(_mut);
+			_finished.wait(lock, [&]{ return !_queues[size_t(TaskQueue::WORKER)].empty() || pred(); });
+		}
+		_waiters.fetch_sub(1, std::memory_order_relaxed);
+	}
+}
+
+bool psi_thread::TaskManager::wait_for_task(TaskHandle h) const {
+	if (h.index >= _slot_count)
+		return false;
+
+	auto& slot = _slots[h.index];
+	uint64_t state = slot.state.load(std::memory_order_acquire);
+	uint32_t generation = state_generation(state);
+	// handles from the future or to a slot which was never submitted with this generation
+	if (generation < h.generation || (generation == h.generation && state_status(state) == FREE))
+		return false;
+
+	_wait_until([&]{
+		return state_generation(slot.state.load(std::memory_order_acquire)) != h.generation;
+	});
+
+	return true;
+}
+
+size_t psi_thread::TaskManager::wait_any(std::vector<TaskHandle> const& handles) const {
+	if (handles.empty())
+		return 0;
+
+	size_t done = handles.size();
+	_wait_until([&]{
+		for (size_t i = 0; i < handles.size(); ++i) {
+			if (!is_task_running(handles[i])) {
+				done = i;
+				return true;
+			}
+		}
+		return false;
+	});
+
+	return done;
+}
+
+void psi_thread::TaskManager::wait_all(std::vector<TaskHandle> const& handles) const {
+	_wait_until([&]{
+		for (auto h : handles) {
+			if (is_task_running(h))
+				return false;
+		}
+		return true;
+	});
+}
+
+bool psi_thread::TaskManager::is_task_running(TaskHandle h) const {
+	if (h.index >= _slot_count)
+		return false;
+
+	uint64_t state = _slots[h.index].state.load(std::memory_order_acquire);
+	return state_generation(state) == h.generation && state_status(state) != FREE;
+}
+
+size_t psi_thread::TaskManager::run_main_tasks() const {
+	// tasks queued by the ones we run wait for the next call, so that this returns
+	size_t count;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		count = _queues[size_t(TaskQueue::MAIN)].size();
+	}
+
+	size_t ran = 0;
+	while (ran < count && _run_queued(TaskQueue::MAIN)) {
+		++ran;
+	}
+	return ran;
+}
+
+size_t psi_thread::TaskManager::worker_count() const {
+	return _worker_count;
+}
+
+size_t psi_thread::TaskManager::io_worker_count() const {
+	return _io_worker_count;
+}
+
+void psi_thread::TaskManager::_work(TaskQueue q, std::vector<uint32_t> cpus) {
+	if (!cpus.empty())
+		pin_current_thread(cpus);
+
+	auto& queue = _queues[size_t(q)];
+	auto& queued = _queued[size_t(q)];
+	while (true) {
+		uint32_t index;
+		{
+			std::unique_lock<std::mutex> lock(_mut);
+			queued.wait(lock, [&]{ return _stop || !queue.empty(); });
+			// finish queued tasks before stopping
+			if (queue.empty())
+				return;
+
+			index = queue.front();
+			queue.pop_front();
+		}
+
+		_execute(index);
+	}
 }
@@ -21,23 +21,203 @@
 #pragma once
 
 #include <cstdint>
-#include <functional>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
+#include "inplace_function.hpp"
 #include "../marker/thread_safety.hpp"
 
 
 namespace psi_thread {
+/// Identifies a task submitted to TaskManager.
+/// Task slots are reused, the generation tells apart different tasks which used the same slot,
+/// so a handle of a finished task stays cheap to query and can never refer to a newer task.
+struct TaskHandle {
+	uint32_t index;
+	uint32_t generation;
+
+	bool operator==(TaskHandle const& o) const {
+		return index == o.index && generation == o.generation;
+	}
+	bool operator!=(TaskHandle const& o) const {
+		return !(*this == o);
+	}
+};
+
+/// A handle which never refers to any task.
+constexpr TaskHandle INVALID_TASK = {UINT32_MAX, 0};
+
+/// How a task ended, passed to its completion callback.
+enum class TaskStatus {
+	/// The task ran to completion.
+	DONE,
+	/// The task was cancelled before it started and was not run.
+	CANCELLED,
+};
+
+/// A flag shared between any number of tasks which tells them to stop.
+/// Queued tasks with a cancelled token are skipped, running tasks may poll is_cancelled().
+/// Copies refer to the same flag.
+class CancellationToken : psi_mark::Threadsafe {
+public:
+	CancellationToken()
+		: _cancelled(std::make_shared<std::atomic<bool>>(false)) {}
+
+	void cancel() const {
+		_cancelled->store(true, std::memory_order_relaxed);
+	}
+
+	bool is_cancelled() const {
+		return _cancelled->load(std::memory_order_relaxed);
+	}
+
+private:
+	friend class TaskManager;
+
+	std::shared_ptr<std::atomic<bool>> _cancelled;
+};
+
+/// Work submitted to TaskManager. Stored inline, never allocates.
+using Task = InplaceFunction<void(), 64>;
+/// Called after a task finishes or is cancelled. Stored inline, never allocates.
+using TaskCallback = InplaceFunction<void(TaskStatus), 32>;
+
+/// Which pool of threads a task is run by.
+enum class TaskQueue {
+	/// CPU-bound work, run by the worker threads.
+	WORKER,
+	/// Work which mostly blocks on I/O, run by a small separate pool so it does not occupy workers.
+	IO,
+	/// Work which must happen on the main thread, e.g. GL calls. Only run by run_main_tasks.
+	MAIN,
+};
+
+/// Arguments required to construct a TaskManager.
+struct TaskManagerArgs {
+	/// Number of worker threads. With 0, worker tasks run synchronously in submit_task.
+	size_t workers = 0;
+	/// Number of I/O threads. With 0, I/O tasks are treated as worker tasks.
+	size_t io_workers = 0;
+	/// Number of tasks which may be queued or running at once.
+	size_t max_tasks = 4096;
+	/// Pins the constructing (main) thread to its own physical core, each worker to one of the other cores
+	/// and the I/O threads to hyperthread siblings of the worker cores.
+	bool pin_threads = false;
+	/// Keeps all threads on this NUMA node, -1 allows all nodes.
+	int32_t numa_node = -1;
+};
+
+/// Sizes a TaskManager for this machine: all threads on the NUMA node the calling thread runs on if there
+/// are several, one worker per physical core of it except the main thread's, two I/O threads, pinning enabled.
+/// Each value can be overridden by the environment variables PSI_WORKER_THREADS, PSI_IO_THREADS,
+/// PSI_PIN_THREADS (0 or 1) and PSI_NUMA_NODE (-1 for all nodes). Workers are counted on the overriding node.
+TaskManagerArgs auto_task_manager_args();
+/// Like auto_task_manager_args, but on the given NUMA node regardless of PSI_NUMA_NODE, -1 for all nodes.
+TaskManagerArgs auto_task_manager_args(int32_t numa_node);
+
 /// An interface which  accepts tasks and manages them. They might potentially run in parallel.
 class TaskManager : psi_mark::ConstThreadsafe {
 public:
+	/// Spawns the worker threads and, if requested, pins them and the calling thread.
+	explicit TaskManager(TaskManagerArgs args = TaskManagerArgs());
+	~TaskManager();
+
+	TaskManager(TaskManager const&) = delete;
+	TaskManager& operator=(TaskManager const&) = delete;
+
 	/// Starts a task which will potentially be run asynchronously.
-	/// @return the task ID
-	uint64_t submit_task(std::function<void()>) const;
+	/// If max_tasks tasks are already in flight, runs queued tasks until a slot frees up.
+	/// @param[in] task        the work to do
+	/// @param[in] on_complete called on the executing thread once the task finished or was cancelled
+	/// @param[in] token       if cancelled before the task starts, the task is skipped
+	/// @param[in] queue       pool of threads to run the task on
+	/// @return the task handle
+	TaskHandle submit_task(Task task, TaskCallback on_complete = TaskCallback(), CancellationToken const* token = nullptr, TaskQueue queue = TaskQueue::WORKER) const;
 	/// Blocks until subtask is done and returns status.
+	/// Runs other queued tasks while waiting, so it may be called from within a task.
 	/// @return true if task was done, false if ID is invalid; superego is ignored
-	bool wait_for_task(uint64_t) const;
-	/// Checks the status of the given task.
-	/// @return true if the task is currently running, false if it is done or the ID is invalid
-	bool is_task_running(uint64_t) const;
+	bool wait_for_task(TaskHandle) const;
+	/// Blocks until at least one of the tasks is done.
+	/// @return the index of a finished task in the given vector, or the vector size if it is empty
+	size_t wait_any(std::vector<TaskHandle> const&) const;
+	/// Blocks until all of the tasks are done.
+	void wait_all(std::vector<TaskHandle> const&) const;
+	/// Checks the status of the given task. Lock-free, cheap enough to poll every frame.
+	/// @return true if the task is queued or running, false if it is done or the ID is invalid
+	bool is_task_running(TaskHandle) const;
+
+	/// Runs the main queue tasks which were queued when called. Must only be called from the main thread.
+	/// Main queue tasks still queued when the TaskManager is destroyed are never run.
+	/// @warning Waiting for a main queue task on the main thread deadlocks.
+	/// @return number of tasks run
+	size_t run_main_tasks() const;
+
+	/// Returns the number of worker threads.
+	size_t worker_count() const;
+	/// Returns the number of I/O threads.
+	size_t io_worker_count() const;
+
+private:
+	enum SlotStatus : uint32_t {
+		FREE,
+		QUEUED,
+		RUNNING,
+	};
+
+	struct alignas(64) Slot {
+		/// generation << 32 | SlotStatus
+		std::atomic<uint64_t> state;
+		/// Next slot in the free list.
+		std::atomic<uint32_t> next_free;
+
+		Task task;
+		TaskCallback on_complete;
+		/// Flag of the task's cancellation token, null if it has none.
+		std::shared_ptr<std::atomic<bool>> cancelled;
+	};
+
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	/// Lock-free pop from the free slot stack.
+	/// @return a slot index or NO_SLOT if all slots are in use
+	uint32_t _acquire_slot() const;
+	/// Lock-free push to the free slot stack.
+	void _release_slot(uint32_t) const;
+
+	/// Runs or cancels the task in the given slot and frees the slot.
+	void _execute(uint32_t) const;
+	/// Pops and executes one task from the queue if there is one.
+	/// @return false if the queue was empty
+	bool _run_queued(TaskQueue = TaskQueue::WORKER) const;
+	/// Thread body, optionally pins itself to the given CPUs first.
+	void _work(TaskQueue, std::vector<uint32_t> cpus);
+
+	/// Blocks until the predicate is true, running queued tasks meanwhile.
+	template <typename Pred>
+	void _wait_until(Pred) const;
+
+	std::unique_ptr<Slot[]> _slots;
+	size_t _slot_count;
+	/// tag << 32 | slot index, the tag prevents ABA on concurrent pops
+	mutable std::atomic<uint64_t> _free_head;
+
+	std::vector<std::thread> _threads;
+	size_t _worker_count;
+	size_t _io_worker_count;
+
+	mutable std::mutex _mut;
+	/// Per TaskQueue.
+	mutable std::condition_variable _queued[3];
+	mutable std::condition_variable _finished;
+	/// Slots of tasks waiting for a thread, per TaskQueue.
+	mutable std::deque<uint32_t> _queues[3];
+	/// Number of threads blocked in _wait_until, completions only notify if there are any.
+	mutable std::atomic<size_t> _waiters;
+	bool _stop;
 };
 } // namespace psi_thread
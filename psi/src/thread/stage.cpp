@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "stage.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "../util/assert.hpp"
+
+
+psi_thread::PipelineStage::PipelineStage(TaskManager const& tasks, TaskQueue queue, size_t limit)
+	: _tasks(tasks)
+	, _queue(queue)
+	, _limit(limit)
+	, _upstream(nullptr)
+	, _downstream(nullptr)
+	, _next_seq(0)
+	, _unsorted(false)
+	, _waiting_count(0)
+	, _running(0) {
+	ASSERT(limit > 0);
+}
+
+void psi_thread::PipelineStage::set_downstream(PipelineStage& downstream) {
+	_downstream = &downstream;
+	downstream._upstream = this;
+}
+
+void psi_thread::PipelineStage::push(StageTask task, CancellationToken token, std::shared_ptr<TaskPriority const> priority) {
+	_push({std::move(task), AsyncStageTask(), std::move(token), std::move(priority), 0.0f, 0, 0});
+}
+
+void psi_thread::PipelineStage::push_async(AsyncStageTask task, CancellationToken token, std::shared_ptr<TaskPriority const> priority) {
+	_push({StageTask(), std::move(task), std::move(token), std::move(priority), 0.0f, 0, 0});
+}
+
+void psi_thread::PipelineStage::priorities_changed() {
+	// sorted once by the next pump, however many priorities changed until then
+	_unsorted.store(true, std::memory_order_relaxed);
+}
+
+bool psi_thread::PipelineStage::_after(Waiting const& a, Waiting const& b) {
+	if (a.order_priority != b.order_priority)
+		return a.order_priority < b.order_priority;
+	if (a.order_deadline != b.order_deadline)
+		return a.order_deadline > b.order_deadline;
+	return a.seq > b.seq;
+}
+
+void psi_thread::PipelineStage::_push(Waiting w) {
+	TaskPriority const none;
+	auto const& p = w.priority ? *w.priority : none;
+	w.order_priority = p.priority();
+	w.order_deadline = p.deadline().time_since_epoch().count();
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		w.seq = _next_seq++;
+		_waiting.insert(std::upper_bound(_waiting.begin(), _waiting.end(), w, _after), std::move(w));
+		_waiting_count.store(_waiting.size(), std::memory_order_relaxed);
+	}
+	_pump();
+}
+
+void psi_thread::PipelineStage::_resort(std::vector<Waiting>& dropped) {
+	auto cancelled = std::stable_partition(_waiting.begin(), _waiting.end(), [] (Waiting const& w) {
+		return !w.token.is_cancelled();
+	});
+	std::move(cancelled, _waiting.end(), std::back_inserter(dropped));
+	_waiting.erase(cancelled, _waiting.end());
+
+	for (auto& w : _waiting) {
+		if (!w.priority)
+			continue;
+		w.order_priority = w.priority->priority();
+		w.order_deadline = w.priority->deadline().time_since_epoch().count();
+	}
+	std::sort(_waiting.begin(), _waiting.end(), _after);
+}
+
+void psi_thread::PipelineStage::_pump() {
+	std::vector<Waiting> start;
+	// destroyed without the lock, they may own anything
+	std::vector<Waiting> dropped;
+	{
+		std::lock_guard<std::mutex> lock(_mut);
+		if (_unsorted.exchange(false, std::memory_order_relaxed))
+			_resort(dropped);
+
+		while (!_waiting.empty() && _running.load(std::memory_order_relaxed) < _limit) {
+			// hold back while the next stage is saturated, our outputs would only pile up there
+			if (_downstream && _downstream->_waiting_count.load(std::memory_order_relaxed) >= _downstream->_limit)
+				break;
+
+			Waiting w = std::move(_waiting.back());
+			_waiting.pop_back();
+			// tasks cancelled while waiting do not take up capacity
+			if (w.token.is_cancelled()) {
+				dropped.push_back(std::move(w));
+				continue;
+			}
+
+			start.push_back(std::move(w));
+			_running.fetch_add(1, std::memory_order_relaxed);
+		}
+		_waiting_count.store(_waiting.size(), std::memory_order_relaxed);
+	}
+
+	// submitted without the lock, tasks may run synchronously and push to this stage again
+	for (auto& w : start) {
+		if (w.async_task) {
+			_tasks.submit_task(
+				[this, task = std::move(w.async_task)] () mutable { task([this] { _finish(); }); },
+				// a task which ran calls done itself
+				[this] (TaskStatus status) {
+					if (status == TaskStatus::CANCELLED)
+						_finish();
+				},
+				&w.token,
+				_queue
+			);
+		}
+		else {
+			_tasks.submit_task(
+				[task = std::move(w.task)] () mutable { task(); },
+				[this] (TaskStatus) { _finish(); },
+				&w.token,
+				_queue
+			);
+		}
+	}
+
+	// our queue shrank, the stage feeding us may have been held back
+	if ((!start.empty() || !dropped.empty()) && _upstream)
+		_upstream->_pump();
+}
+
+void psi_thread::PipelineStage::_finish() {
+	_running.fetch_sub(1, std::memory_order_relaxed);
+	_pump();
+}
+
+size_t psi_thread::PipelineStage::running() const {
+	return _running.load(std::memory_order_relaxed);
+}
+
+size_t psi_thread::PipelineStage::waiting() const {
+	return _waiting_count.load(std::memory_order_relaxed);
+}
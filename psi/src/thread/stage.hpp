@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "manager.hpp"
+#include "inplace_function.hpp"
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_thread {
+/// The priority of a task waiting in a PipelineStage. It may be changed while the task waits,
+/// the stage picks changes up once told about them with PipelineStage::priorities_changed.
+class TaskPriority : psi_mark::Threadsafe {
+public:
+	using Deadline = std::chrono::steady_clock::time_point;
+
+	explicit TaskPriority(float priority = 0.0f, Deadline deadline = Deadline::max())
+		: _priority(priority)
+		, _deadline(deadline.time_since_epoch().count()) {}
+
+	/// Tasks with a higher priority start first.
+	float priority() const {
+		return _priority.load(std::memory_order_relaxed);
+	}
+	void set_priority(float priority) {
+		_priority.store(priority, std::memory_order_relaxed);
+	}
+
+	/// A hint of when the task's result is needed. Among tasks of equal priority, those
+	/// with an earlier deadline start first. Deadline::max() means there is none.
+	Deadline deadline() const {
+		return Deadline(Deadline::duration(_deadline.load(std::memory_order_relaxed)));
+	}
+	void set_deadline(Deadline deadline) {
+		_deadline.store(deadline.time_since_epoch().count(), std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<float> _priority;
+	std::atomic<Deadline::rep> _deadline;
+};
+
+/// One stage of a pipeline of tasks, e.g. reading files followed by decoding them.
+/// At most a fixed number of the stage's tasks run at once, the rest wait in the stage.
+/// A stage with a downstream stage only starts tasks while fewer than the downstream limit
+/// wait there, so a fast stage cannot flood a slow one. That back-pressure propagates upwards.
+/// Waiting tasks start in order of priority, then deadline, then submission. Cancelled ones are dropped.
+class PipelineStage : psi_mark::Threadsafe {
+public:
+	/// @param[in] tasks task manager to run the tasks on
+	/// @param[in] queue queue the tasks are submitted to
+	/// @param[in] limit maximum number of this stage's tasks running at once
+	PipelineStage(TaskManager const& tasks, TaskQueue queue, size_t limit);
+
+	/// Links a stage which receives the outputs of this one.
+	/// Must be called before any tasks are pushed.
+	void set_downstream(PipelineStage& downstream);
+
+	/// Called by an asynchronous task once its work completes.
+	using Done = std::function<void()>;
+
+	/// Work pushed to a stage. Stored inline, never allocates, and small enough that the stage
+	/// can wrap it in a Task.
+	using StageTask = InplaceFunction<void(), 32>;
+	using AsyncStageTask = InplaceFunction<void(Done), 32>;
+
+	/// Runs the task once there is capacity, queues it otherwise.
+	/// @param[in] task     the task, which may push to the downstream stage
+	/// @param[in] token    if cancelled before the task starts, it is skipped
+	/// @param[in] priority orders the task among waiting ones, the default priority if null
+	void push(StageTask task, CancellationToken token = CancellationToken(), std::shared_ptr<TaskPriority const> priority = nullptr);
+
+	/// Like push, but the task only starts asynchronous work, e.g. a file read, and counts
+	/// as running until it calls done. It must call done exactly once.
+	void push_async(AsyncStageTask task, CancellationToken token = CancellationToken(), std::shared_ptr<TaskPriority const> priority = nullptr);
+
+	/// Makes the stage re-read the priorities of waiting tasks, and drop cancelled ones, before it starts the next one.
+	void priorities_changed();
+
+	/// Returns the number of tasks submitted to the TaskManager and not yet finished.
+	size_t running() const;
+	/// Returns the number of tasks waiting for capacity.
+	size_t waiting() const;
+
+private:
+	struct Waiting {
+		/// One of these is set.
+		StageTask task;
+		AsyncStageTask async_task;
+		CancellationToken token;
+		std::shared_ptr<TaskPriority const> priority;
+
+		/// Snapshot of the priority the waiting tasks are sorted by.
+		float order_priority;
+		TaskPriority::Deadline::rep order_deadline;
+		uint64_t seq;
+	};
+
+	/// Whether a starts after b.
+	static bool _after(Waiting const& a, Waiting const& b);
+
+	void _push(Waiting w);
+	/// Refreshes the priority snapshots, drops cancelled tasks and sorts. Requires _mut.
+	void _resort(std::vector<Waiting>& dropped);
+	/// Starts waiting tasks while there is capacity.
+	void _pump();
+	void _finish();
+
+	TaskManager const& _tasks;
+	TaskQueue const _queue;
+	size_t const _limit;
+
+	PipelineStage* _upstream;
+	PipelineStage* _downstream;
+
+	std::mutex _mut;
+	/// Sorted so that the task which starts next is at the back.
+	std::vector<Waiting> _waiting;
+	uint64_t _next_seq;
+	std::atomic<bool> _unsorted;
+	/// Mirrors _waiting.size() for upstream stages, which read it without the lock.
+	std::atomic<size_t> _waiting_count;
+	std::atomic<size_t> _running;
+};
+} // namespace psi_thread
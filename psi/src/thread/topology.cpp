@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "topology.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <map>
+#include <cctype>
+#include <tuple>
+
+#include <sched.h>
+#include <pthread.h>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+
+
+/// Reads a single unsigned integer from a sysfs file.
+static bool read_uint(fs::path const& file, uint32_t& out) {
+	std::ifstream in(file.c_str());
+	long long v;
+	if (!(in >> v) || v < 0)
+		return false;
+
+	out = uint32_t(v);
+	return true;
+}
+
+/// Parses a sysfs CPU list like "0-3,8,10-11".
+static std::vector<uint32_t> read_cpu_list(fs::path const& file) {
+	std::vector<uint32_t> cpus;
+	std::ifstream in(file.c_str());
+	std::string list;
+	if (!std::getline(in, list))
+		return cpus;
+
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ',')) {
+		if (range.empty())
+			continue;
+
+		auto dash = range.find('-');
+		try {
+			uint32_t first = uint32_t(std::stoul(range.substr(0, dash)));
+			uint32_t last = dash == std::string::npos ? first : uint32_t(std::stoul(range.substr(dash + 1)));
+			for (uint32_t c = first; c <= last; ++c)
+				cpus.push_back(c);
+		}
+		catch (std::exception const&) {
+			return {};
+		}
+	}
+
+	return cpus;
+}
+
+std::vector<psi_thread::PhysicalCore> psi_thread::CpuTopology::physical_cores() const {
+	std::map<std::tuple<uint32_t, uint32_t, uint32_t>, PhysicalCore> by_core;
+	for (auto const& cpu : cpus) {
+		by_core[std::make_tuple(cpu.node, cpu.package, cpu.core)].push_back(cpu);
+	}
+
+	std::vector<PhysicalCore> cores;
+	for (auto& c : by_core) {
+		cores.push_back(std::move(c.second));
+	}
+
+	// keep cores of a node together, but in CPU number order within it
+	std::stable_sort(cores.begin(), cores.end(), [] (PhysicalCore const& a, PhysicalCore const& b) {
+		return std::make_pair(a[0].node, a[0].id) < std::make_pair(b[0].node, b[0].id);
+	});
+
+	return cores;
+}
+
+size_t psi_thread::CpuTopology::node_count() const {
+	std::vector<uint32_t> nodes;
+	for (auto const& cpu : cpus) {
+		if (std::find(nodes.begin(), nodes.end(), cpu.node) == nodes.end())
+			nodes.push_back(cpu.node);
+	}
+	return nodes.size();
+}
+
+psi_thread::CpuTopology psi_thread::detect_topology() {
+	CpuTopology topo;
+
+	// only consider CPUs this process may actually run on
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	fs::path const cpu_dir("/sys/devices/system/cpu");
+	std::vector<uint32_t> online = read_cpu_list(cpu_dir / "online");
+
+	for (uint32_t id : online) {
+		if (have_mask && id < CPU_SETSIZE && !CPU_ISSET(id, &allowed))
+			continue;
+
+		fs::path topo_dir = cpu_dir / ("cpu" + std::to_string(id)) / "topology";
+		LogicalCpu cpu = {id, id, 0, 0};
+		read_uint(topo_dir / "core_id", cpu.core);
+		read_uint(topo_dir / "physical_package_id", cpu.package);
+		topo.cpus.push_back(cpu);
+	}
+
+	if (topo.cpus.empty()) {
+		// no sysfs, assume a flat topology
+		uint32_t n = std::max(1u, std::thread::hardware_concurrency());
+		for (uint32_t id = 0; id < n; ++id)
+			topo.cpus.push_back(LogicalCpu{id, id, 0, 0});
+		return topo;
+	}
+
+	// a missing node directory means the kernel has no NUMA support, everything is node 0
+	fs::path const node_dir("/sys/devices/system/node");
+	boost::system::error_code ec;
+	for (fs::directory_iterator it(node_dir, ec), end; !ec && it != end; it.increment(ec)) {
+		auto name = it->path().filename().string();
+		if (name.compare(0, 4, "node") != 0 || name.size() == 4 || !std::isdigit(name[4]))
+			continue;
+
+		uint32_t node = uint32_t(std::stoul(name.substr(4)));
+		for (uint32_t id : read_cpu_list(it->path() / "cpulist")) {
+			for (auto& cpu : topo.cpus) {
+				if (cpu.id == id)
+					cpu.node = node;
+			}
+		}
+	}
+
+	return topo;
+}
+
+uint32_t psi_thread::current_node(CpuTopology const& topo) {
+	int cpu = sched_getcpu();
+	for (auto const& c : topo.cpus) {
+		if (cpu >= 0 && c.id == uint32_t(cpu))
+			return c.node;
+	}
+
+	auto cores = topo.physical_cores();
+	return cores.empty() ? 0 : cores.front().front().node;
+}
+
+bool psi_thread::pin_current_thread(std::vector<uint32_t> const& cpus) {
+	if (cpus.empty())
+		return false;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (uint32_t id : cpus) {
+		if (id < CPU_SETSIZE)
+			CPU_SET(id, &set);
+	}
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
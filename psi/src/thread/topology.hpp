@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace psi_thread {
+/// A logical CPU, i.e. a hardware thread, as seen by the OS scheduler.
+struct LogicalCpu {
+	/// OS CPU number, as used in affinity masks.
+	uint32_t id;
+	/// Physical core id, unique within a package. Hyperthread siblings share it.
+	uint32_t core;
+	/// Physical package (socket) id.
+	uint32_t package;
+	/// NUMA node id.
+	uint32_t node;
+};
+
+/// Logical CPUs which share a physical core, the first one is the core's primary hardware thread.
+using PhysicalCore = std::vector<LogicalCpu>;
+
+struct CpuTopology {
+	/// Logical CPUs available to this process, sorted by OS CPU number.
+	std::vector<LogicalCpu> cpus;
+
+	/// Groups the logical CPUs by physical core, ordered by NUMA node and then by CPU number.
+	std::vector<PhysicalCore> physical_cores() const;
+
+	/// Returns the number of distinct NUMA nodes.
+	size_t node_count() const;
+};
+
+/// Reads the CPU topology from /sys/devices/system/cpu and /sys/devices/system/node.
+/// Falls back to one core per logical CPU on a single node if sysfs is unavailable.
+CpuTopology detect_topology();
+
+/// Returns the NUMA node of the logical CPU the calling thread runs on right now,
+/// or that of the first physical core if the OS cannot tell.
+uint32_t current_node(CpuTopology const& topo);
+
+/// Restricts the calling thread to run only on the given logical CPUs.
+/// @return false if the OS refused or pinning is unsupported
+bool pin_current_thread(std::vector<uint32_t> const& cpus);
+} // namespace psi_thread
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+#include "hash.hpp"
+
+
+psi_util::Archive::Archive(boost::filesystem::path const& file)
+	: _file(std::make_shared<MappedFile const>(file))
+	, _index(nullptr)
+	, _count(0) {
+	if (_file->size() < sizeof(ArchiveHeader))
+		throw std::runtime_error("Archive " + file.string() + " is truncated.");
+
+	auto header = reinterpret_cast<ArchiveHeader const*>(_file->data());
+	if (std::memcmp(header->magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+		throw std::runtime_error(file.string() + " is not a Psi Archive.");
+	if (header->version != ARCHIVE_VERSION)
+		throw std::runtime_error("Archive " + file.string() + " has unsupported version " + std::to_string(header->version) + ".");
+
+	if (header->index_offset % alignof(ArchiveEntry) != 0
+	 || header->index_offset > _file->size()
+	 || header->entry_count > (_file->size() - header->index_offset) / sizeof(ArchiveEntry))
+		throw std::runtime_error("Archive " + file.string() + " has an invalid index.");
+
+	_index = reinterpret_cast<ArchiveEntry const*>(_file->data() + header->index_offset);
+	_count = header->entry_count;
+
+	// checked once here, so lookups can trust the index
+	for (size_t i = 0; i < _count; ++i) {
+		auto const& e = _index[i];
+		if (e.offset > _file->size() || e.stored_size > _file->size() - e.offset)
+			throw std::runtime_error("Archive " + file.string() + " has a blob past its end.");
+		if (i > 0 && _index[i - 1].name_hash >= e.name_hash)
+			throw std::runtime_error("Archive " + file.string() + " has an unsorted index.");
+		if (e.compression != ArchiveCompression::NONE && e.compression != ArchiveCompression::ZLIB)
+			throw std::runtime_error("Archive " + file.string() + " uses an unknown compression.");
+		if (e.compression == ArchiveCompression::NONE && e.stored_size != e.size)
+			throw std::runtime_error("Archive " + file.string() + " has an uncompressed blob with two sizes.");
+	}
+}
+
+psi_util::ArchiveEntry const* psi_util::Archive::find(std::string const& name) const {
+	uint64_t hash = fnv1a_64(name);
+	auto end = _index + _count;
+	auto it = std::lower_bound(_index, end, hash, [] (ArchiveEntry const& e, uint64_t h) {
+		return e.name_hash < h;
+	});
+	return it != end && it->name_hash == hash ? it : nullptr;
+}
+
+psi_util::SharedBytes psi_util::Archive::open(std::string const& name) const {
+	auto entry = find(name);
+	if (!entry)
+		throw std::runtime_error("Archive does not contain " + name + ".");
+
+	char const* stored = _file->data() + entry->offset;
+	if (entry->compression == ArchiveCompression::NONE) {
+		// blobs are page-aligned, so this covers exactly their pages
+		if (entry->stored_size > 0)
+			madvise(const_cast<char*>(stored), entry->stored_size, MADV_WILLNEED);
+		return SharedBytes{_file, stored, entry->stored_size};
+	}
+
+	auto out = std::make_shared<std::vector<char>>(entry->size);
+	uLongf out_size = uLongf(entry->size);
+	int res = uncompress(reinterpret_cast<Bytef*>(out->data()), &out_size, reinterpret_cast<Bytef const*>(stored), uLong(entry->stored_size));
+	if (res != Z_OK || out_size != entry->size)
+		throw std::runtime_error("Archive blob " + name + " failed to decompress.");
+
+	return SharedBytes{out, out->data(), out->size()};
+}
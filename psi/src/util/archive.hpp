@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+#include "mapped_file.hpp"
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_util {
+/// How a blob is stored in an archive.
+enum class ArchiveCompression : uint32_t {
+	NONE = 0,
+	/// zlib stream, as written by compress2
+	ZLIB = 1,
+};
+
+/// Header at the start of a Psi Archive (.pak). All integers are little-endian.
+struct ArchiveHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_count;
+	/// Offset of the index, entry_count entries sorted by name hash.
+	uint64_t index_offset;
+	uint64_t reserved;
+};
+
+/// An index entry describing one blob.
+struct ArchiveEntry {
+	/// fnv1a_64 of the name, a path relative to the packed directory with '/' separators.
+	uint64_t name_hash;
+	/// Offset of the blob from the start of the archive, a multiple of ARCHIVE_ALIGNMENT.
+	uint64_t offset;
+	/// Size of the blob as stored.
+	uint64_t stored_size;
+	/// Size of the blob once decompressed.
+	uint64_t size;
+	ArchiveCompression compression;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(ArchiveHeader) == 32 && sizeof(ArchiveEntry) == 40, "Archive structures must be packed.");
+
+constexpr char ARCHIVE_MAGIC[8] = {'P', 'S', 'I', 'A', 'R', 'C', 'H', '\0'};
+constexpr uint32_t ARCHIVE_VERSION = 1;
+/// Blobs start on page boundaries, so they can be mapped and read with O_DIRECT.
+constexpr size_t ARCHIVE_ALIGNMENT = 4096;
+
+/// Bytes kept alive by a shared owner, e.g. a mapped file.
+struct SharedBytes {
+	std::shared_ptr<void const> owner;
+	char const* data = nullptr;
+	size_t size = 0;
+};
+
+/// A Psi Archive mapped into memory. Opening it takes a single open call, after which
+/// names are resolved through its sorted index without touching the file system.
+class Archive : psi_mark::ConstThreadsafe {
+public:
+	/// Maps the archive and checks its header and index.
+	/// @throws if the file does not exist or is not a valid archive
+	explicit Archive(boost::filesystem::path const& file);
+
+	/// @return the entry of the blob with this name, or nullptr if there is none
+	ArchiveEntry const* find(std::string const& name) const;
+
+	/// Returns the contents of the blob. They point into the mapping if the blob is stored uncompressed,
+	/// the kernel is then asked to start reading them in. Compressed blobs are decompressed into new memory.
+	/// @throws if there is no blob with this name or it fails to decompress
+	SharedBytes open(std::string const& name) const;
+
+	/// Returns the number of blobs in the archive.
+	size_t size() const {
+		return _count;
+	}
+
+private:
+	std::shared_ptr<MappedFile const> _file;
+	ArchiveEntry const* _index;
+	size_t _count;
+};
+} // namespace psi_util
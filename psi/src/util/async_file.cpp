@@ -0,0 +1,627 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "async_file.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "assert.hpp"
+#include "../log/log.hpp"
+
+
+/// O_DIRECT offsets, lengths and buffers must be aligned to the logical block size, which never exceeds a page.
+static constexpr size_t DIRECT_ALIGNMENT = 4096;
+/// io_uring takes 32-bit lengths, larger files are read in several parts.
+static constexpr size_t MAX_READ = size_t(1) << 30;
+
+/// A file being read.
+struct PendingRead {
+	~PendingRead() {
+		if (fd >= 0)
+			close(fd);
+	}
+
+	psi_util::FileRead request;
+	int fd = -1;
+	/// Whether fd was opened with O_DIRECT.
+	bool direct = false;
+	std::vector<char> data;
+	/// Bytes read so far.
+	size_t done = 0;
+	/// Registered buffer the direct read goes through, or -1.
+	int buffer = -1;
+	std::exception_ptr error;
+};
+
+static std::runtime_error errno_error(std::string const& what, int err) {
+	return std::runtime_error(what + ": " + std::strerror(err) + ".");
+}
+
+/// Opens the file and sizes the read's buffer to fit it.
+static void open_file(PendingRead& r, bool allow_direct) {
+	auto const& path = r.request.file;
+	if (allow_direct && r.request.direct) {
+		r.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+		// not every file system supports it
+		r.direct = r.fd >= 0;
+	}
+	if (r.fd < 0)
+		r.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (r.fd < 0)
+		throw errno_error("Failed to open binary file " + path.string(), errno);
+
+	struct stat st;
+	if (fstat(r.fd, &st) != 0)
+		throw errno_error("Failed to stat binary file " + path.string(), errno);
+	r.data.resize(size_t(st.st_size));
+}
+
+/// Closes the file and hands the contents or the error to the callback.
+static void complete(PendingRead& r) {
+	if (r.fd >= 0) {
+		close(r.fd);
+		r.fd = -1;
+	}
+
+	// destroyed before returning, the callback may hold things its owner waits for
+	auto callback = std::move(r.request.callback);
+	try {
+		if (r.error)
+			callback({}, r.error);
+		else
+			callback(std::move(r.data), nullptr);
+	}
+	catch (std::exception const& e) {
+		psi_log::error("AsyncFileReader") << "Read callback for " << r.request.file.string() << " threw: " << e.what() << "\n";
+	}
+}
+
+class psi_util::AsyncFileReader::Backend : psi_mark::Threadsafe {
+public:
+	virtual ~Backend() {}
+
+	virtual void read_all(std::vector<FileRead>) = 0;
+	virtual bool uses_io_uring() const = 0;
+};
+
+/// Blocking reads on a small pool of threads.
+class ThreadBackend : public psi_util::AsyncFileReader::Backend {
+public:
+	explicit ThreadBackend(size_t threads)
+		: _stop(false) {
+		for (size_t i = 0; i < threads; ++i) {
+			_threads.emplace_back([this] { _work(); });
+		}
+	}
+
+	~ThreadBackend() {
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			_stop = true;
+		}
+		_cv.notify_all();
+
+		// the queue is drained first
+		for (auto& t : _threads) {
+			t.join();
+		}
+	}
+
+	void read_all(std::vector<psi_util::FileRead> reads) override {
+		{
+			std::lock_guard<std::mutex> lock(_mut);
+			for (auto& r : reads) {
+				_queue.push_back(std::move(r));
+			}
+		}
+		_cv.notify_all();
+	}
+
+	bool uses_io_uring() const override {
+		return false;
+	}
+
+private:
+	void _work() {
+		while (true) {
+			PendingRead r;
+			{
+				std::unique_lock<std::mutex> lock(_mut);
+				_cv.wait(lock, [this]{ return _stop || !_queue.empty(); });
+				if (_queue.empty())
+					return;
+				r.request = std::move(_queue.front());
+				_queue.pop_front();
+			}
+
+			try {
+				open_file(r, false);
+				while (r.done < r.data.size()) {
+					ssize_t n = pread(r.fd, r.data.data() + r.done, r.data.size() - r.done, off_t(r.done));
+					if (n < 0 && errno == EINTR)
+						continue;
+					if (n < 0)
+						throw errno_error("Failed to read binary file " + r.request.file.string(), errno);
+					if (n == 0)
+						throw std::runtime_error("Binary file " + r.request.file.string() + " shrank while being read.");
+					r.done += size_t(n);
+				}
+
+				// the closest a buffered read gets to O_DIRECT, keeps the file from crowding others out of the cache
+				if (r.request.direct)
+					posix_fadvise(r.fd, 0, 0, POSIX_FADV_DONTNEED);
+			}
+			catch (...) {
+				r.error = std::current_exception();
+			}
+
+			complete(r);
+		}
+	}
+
+	std::mutex _mut;
+	std::condition_variable _cv;
+	std::deque<psi_util::FileRead> _queue;
+	bool _stop;
+	std::vector<std::thread> _threads;
+};
+
+/// Reads through an io_uring instance, set up with raw system calls. A single thread reaps completions,
+/// resubmits the remainder of short reads and calls the callbacks.
+class UringBackend : public psi_util::AsyncFileReader::Backend {
+public:
+	/// @throw std::runtime_error if the kernel does not support io_uring reads
+	explicit UringBackend(psi_util::AsyncFileReaderArgs const& args)
+		: _buffer_size(0)
+		, _in_ring(0)
+		, _unsubmitted(0)
+		, _outstanding(0) {
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		_ring = int(syscall(__NR_io_uring_setup, args.queue_depth, &params));
+		if (_ring < 0)
+			throw errno_error("io_uring_setup failed", errno);
+
+		try {
+			_map(params);
+			_probe();
+			_register_buffers(args);
+		}
+		catch (...) {
+			_unmap();
+			close(_ring);
+			throw;
+		}
+
+		_completer = std::thread([this] { _complete_loop(); });
+	}
+
+	~UringBackend() {
+		{
+			std::unique_lock<std::mutex> lock(_mut);
+			_idle.wait(lock, [this]{ return _outstanding == 0; });
+
+			// a no-op without a read tells the completion thread to exit
+			io_uring_sqe& sqe = _next_sqe();
+			sqe.opcode = IORING_OP_NOP;
+			sqe.user_data = 0;
+			_push_sqe();
+			_flush();
+		}
+		_completer.join();
+
+		_unmap();
+		close(_ring);
+	}
+
+	void read_all(std::vector<psi_util::FileRead> reads) override {
+		// opening is a blocking system call, but a short one
+		std::vector<std::unique_ptr<PendingRead>> opened;
+		for (auto& req : reads) {
+			auto r = std::make_unique<PendingRead>();
+			r->request = std::move(req);
+			try {
+				open_file(*r, _buffers != nullptr);
+			}
+			catch (...) {
+				r->error = std::current_exception();
+				complete(*r);
+				continue;
+			}
+
+			if (r->data.empty())
+				complete(*r);
+			else
+				opened.push_back(std::move(r));
+		}
+
+		if (opened.empty())
+			return;
+
+		// one system call submits the whole batch
+		std::lock_guard<std::mutex> lock(_mut);
+		_outstanding += opened.size();
+		for (auto& r : opened) {
+			_submit(r.release());
+		}
+		_flush();
+	}
+
+	bool uses_io_uring() const override {
+		return true;
+	}
+
+private:
+	void _map(io_uring_params const& params) {
+		_sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		_cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+		bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+		if (single)
+			_sq_map_size = _cq_map_size = std::max(_sq_map_size, _cq_map_size);
+
+		_sq_map = _mmap(_sq_map_size, IORING_OFF_SQ_RING);
+		_cq_map = single ? _sq_map : _mmap(_cq_map_size, IORING_OFF_CQ_RING);
+		_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+		_sqes = static_cast<io_uring_sqe*>(_mmap(_sqes_size, IORING_OFF_SQES));
+
+		auto sq = static_cast<char*>(_sq_map);
+		_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		_sq_entries = params.sq_entries;
+
+		auto cq = static_cast<char*>(_cq_map);
+		_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	}
+
+	void* _mmap(size_t size, off_t offset) {
+		void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, offset);
+		if (ptr == MAP_FAILED)
+			throw errno_error("Mapping the io_uring failed", errno);
+		return ptr;
+	}
+
+	void _unmap() {
+		if (_sqes)
+			munmap(_sqes, _sqes_size);
+		if (_cq_map && _cq_map != _sq_map)
+			munmap(_cq_map, _cq_map_size);
+		if (_sq_map)
+			munmap(_sq_map, _sq_map_size);
+		_sqes = nullptr;
+		_cq_map = _sq_map = nullptr;
+	}
+
+	void _probe() {
+		// the probe and plain reads both arrived in Linux 5.6, older kernels fail here
+		size_t const ops = 256;
+		std::unique_ptr<char[]> mem(new char[sizeof(io_uring_probe) + ops * sizeof(io_uring_probe_op)]());
+		auto probe = reinterpret_cast<io_uring_probe*>(mem.get());
+		if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_PROBE, probe, ops) < 0)
+			throw errno_error("Probing io_uring failed", errno);
+
+		for (unsigned op : {IORING_OP_READ, IORING_OP_READ_FIXED}) {
+			if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				throw std::runtime_error("io_uring does not support reads.");
+		}
+	}
+
+	void _register_buffers(psi_util::AsyncFileReaderArgs const& args) {
+		if (args.direct_buffers == 0)
+			return;
+		ASSERT(args.direct_buffer_size > 0 && args.direct_buffer_size % DIRECT_ALIGNMENT == 0);
+
+		void* mem = nullptr;
+		if (posix_memalign(&mem, DIRECT_ALIGNMENT, args.direct_buffers * args.direct_buffer_size) != 0)
+			throw std::bad_alloc();
+		_buffers.reset(static_cast<char*>(mem));
+
+		std::vector<iovec> iovs(args.direct_buffers);
+		for (size_t i = 0; i < iovs.size(); ++i) {
+			iovs[i].iov_base = _buffers.get() + i * args.direct_buffer_size;
+			iovs[i].iov_len = args.direct_buffer_size;
+		}
+
+		// registered once, so the kernel does not have to pin the pages for every read
+		if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS, iovs.data(), unsigned(iovs.size())) < 0) {
+			// usually RLIMIT_MEMLOCK, direct reads then go through the page cache
+			psi_log::warning("AsyncFileReader") << "Registering direct read buffers failed: " << std::strerror(errno) << "\n";
+			_buffers.reset();
+			return;
+		}
+
+		_buffer_size = args.direct_buffer_size;
+		for (size_t i = 0; i < iovs.size(); ++i) {
+			_free_buffers.push_back(int(i));
+		}
+	}
+
+	char* _buffer(int i) const {
+		return _buffers.get() + size_t(i) * _buffer_size;
+	}
+
+	/// Returns the next free submission queue entry, zeroed. Requires _mut and a free ring slot.
+	io_uring_sqe& _next_sqe() {
+		ASSERT(_in_ring < _sq_entries);
+		// only written by us, under _mut
+		unsigned index = *_sq_tail & _sq_mask;
+		io_uring_sqe& sqe = _sqes[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		return sqe;
+	}
+
+	/// Publishes the entry returned by _next_sqe to the kernel. Requires _mut.
+	void _push_sqe() {
+		unsigned tail = *_sq_tail;
+		_sq_array[tail & _sq_mask] = tail & _sq_mask;
+		__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++_in_ring;
+		++_unsubmitted;
+	}
+
+	/// Queues the next part of a read, or holds it back until a ring slot or buffer frees up. Requires _mut.
+	void _submit(PendingRead* r) {
+		// reads in the ring are limited, so the completion queue, twice as large, never overflows
+		if (_in_ring == _sq_entries) {
+			_backlog.push_back(r);
+			return;
+		}
+
+		if (r->direct && r->buffer < 0) {
+			if (_free_buffers.empty()) {
+				_buffer_waiters.push_back(r);
+				return;
+			}
+			r->buffer = _free_buffers.back();
+			_free_buffers.pop_back();
+		}
+
+		io_uring_sqe& sqe = _next_sqe();
+		sqe.fd = r->fd;
+		sqe.off = r->done;
+		sqe.user_data = reinterpret_cast<uint64_t>(r);
+		if (r->direct) {
+			// always whole buffers, the kernel stops at the end of the file
+			sqe.opcode = IORING_OP_READ_FIXED;
+			sqe.addr = reinterpret_cast<uint64_t>(_buffer(r->buffer));
+			sqe.len = unsigned(_buffer_size);
+			sqe.buf_index = uint16_t(r->buffer);
+		}
+		else {
+			sqe.opcode = IORING_OP_READ;
+			sqe.addr = reinterpret_cast<uint64_t>(r->data.data() + r->done);
+			sqe.len = unsigned(std::min(r->data.size() - r->done, MAX_READ));
+		}
+		_push_sqe();
+	}
+
+	/// Hands all published entries to the kernel. Requires _mut.
+	void _flush() {
+		while (_unsubmitted > 0) {
+			int n = int(syscall(__NR_io_uring_enter, _ring, _unsubmitted, 0, 0, nullptr, 0));
+			if (n < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			if (n < 0)
+				throw errno_error("io_uring_enter failed", errno);
+			_unsubmitted -= unsigned(n);
+		}
+	}
+
+	void _release_buffer(PendingRead& r) {
+		if (r.buffer < 0)
+			return;
+		_free_buffers.push_back(r.buffer);
+		r.buffer = -1;
+	}
+
+	/// Accounts for a completed part of a read. Requires _mut.
+	/// @return whether the read is finished, successfully or not
+	bool _advance(PendingRead& r, int res) {
+		if (res == -EINTR || res == -EAGAIN)
+			return false;
+
+		if (res <= 0) {
+			r.error = std::make_exception_ptr(res < 0
+				? errno_error("Failed to read binary file " + r.request.file.string(), -res)
+				: std::runtime_error("Binary file " + r.request.file.string() + " shrank while being read."));
+			_release_buffer(r);
+			return true;
+		}
+
+		size_t n = size_t(res);
+		if (r.direct) {
+			n = std::min(n, r.data.size() - r.done);
+			std::memcpy(r.data.data() + r.done, _buffer(r.buffer), n);
+		}
+		r.done += n;
+
+		if (r.done >= r.data.size()) {
+			_release_buffer(r);
+			return true;
+		}
+
+		if (r.direct && r.done % DIRECT_ALIGNMENT != 0) {
+			// a short read in the middle, O_DIRECT cannot continue from an unaligned offset
+			fcntl(r.fd, F_SETFL, fcntl(r.fd, F_GETFL) & ~O_DIRECT);
+			r.direct = false;
+			_release_buffer(r);
+		}
+		return false;
+	}
+
+	void _complete_loop() {
+		bool stop = false;
+		while (!stop) {
+			if (syscall(__NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+				psi_log::error("AsyncFileReader") << "Waiting for completions failed: " << std::strerror(errno) << "\n";
+
+			std::vector<PendingRead*> finished;
+			{
+				std::lock_guard<std::mutex> lock(_mut);
+
+				// only this thread consumes completions
+				unsigned head = *_cq_head;
+				unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+				for (; head != tail; ++head) {
+					io_uring_cqe const& cqe = _cqes[head & _cq_mask];
+					--_in_ring;
+					if (cqe.user_data == 0) {
+						stop = true;
+						continue;
+					}
+
+					auto r = reinterpret_cast<PendingRead*>(cqe.user_data);
+					if (_advance(*r, cqe.res))
+						finished.push_back(r);
+					else
+						_submit(r);
+				}
+				__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+				// freed slots and buffers go to the reads waiting for them
+				while (!_backlog.empty() && _in_ring < _sq_entries) {
+					auto r = _backlog.front();
+					_backlog.pop_front();
+					_submit(r);
+				}
+				while (!_buffer_waiters.empty() && !_free_buffers.empty() && _in_ring < _sq_entries) {
+					auto r = _buffer_waiters.front();
+					_buffer_waiters.pop_front();
+					_submit(r);
+				}
+				_flush();
+			}
+
+			for (auto r : finished) {
+				std::unique_ptr<PendingRead> owned(r);
+				complete(*owned);
+				owned.reset();
+
+				std::lock_guard<std::mutex> lock(_mut);
+				if (--_outstanding == 0)
+					_idle.notify_all();
+			}
+		}
+	}
+
+	struct FreeDeleter {
+		void operator()(char* ptr) const {
+			std::free(ptr);
+		}
+	};
+
+	int _ring;
+
+	void* _sq_map = nullptr;
+	size_t _sq_map_size;
+	unsigned* _sq_tail;
+	unsigned _sq_mask;
+	unsigned* _sq_array;
+	unsigned _sq_entries;
+	io_uring_sqe* _sqes = nullptr;
+	size_t _sqes_size;
+
+	void* _cq_map = nullptr;
+	size_t _cq_map_size;
+	unsigned* _cq_head;
+	unsigned* _cq_tail;
+	unsigned _cq_mask;
+	io_uring_cqe* _cqes;
+
+	/// Registered buffers for direct reads, all in one aligned block.
+	std::unique_ptr<char, FreeDeleter> _buffers;
+	size_t _buffer_size;
+	std::vector<int> _free_buffers;
+
+	std::mutex _mut;
+	/// Reads waiting for a ring slot.
+	std::deque<PendingRead*> _backlog;
+	/// Direct reads waiting for a buffer.
+	std::deque<PendingRead*> _buffer_waiters;
+	unsigned _in_ring;
+	unsigned _unsubmitted;
+	/// Reads accepted and not yet called back.
+	size_t _outstanding;
+	std::condition_variable _idle;
+
+	std::thread _completer;
+};
+
+psi_util::AsyncFileReader::AsyncFileReader(AsyncFileReaderArgs args) {
+	if (!args.force_fallback) {
+		try {
+			_backend = std::make_unique<UringBackend>(args);
+		}
+		catch (std::exception const& e) {
+			psi_log::info("AsyncFileReader") << "io_uring is unavailable (" << e.what() << "), reading with "
+				<< args.fallback_threads << " threads.\n";
+		}
+	}
+
+	if (!_backend)
+		_backend = std::make_unique<ThreadBackend>(std::max<size_t>(args.fallback_threads, 1));
+}
+
+psi_util::AsyncFileReader::~AsyncFileReader() = default;
+
+void psi_util::AsyncFileReader::read(FileRead r) {
+	std::vector<FileRead> reads;
+	reads.push_back(std::move(r));
+	_backend->read_all(std::move(reads));
+}
+
+void psi_util::AsyncFileReader::read_all(std::vector<FileRead> reads) {
+	_backend->read_all(std::move(reads));
+}
+
+std::future<std::vector<char>> psi_util::AsyncFileReader::read(boost::filesystem::path const& file, bool direct) {
+	auto promise = std::make_shared<std::promise<std::vector<char>>>();
+	auto future = promise->get_future();
+	read(FileRead{file, direct, [promise] (std::vector<char> data, std::exception_ptr error) {
+		if (error)
+			promise->set_exception(error);
+		else
+			promise->set_value(std::move(data));
+	}});
+	return future;
+}
+
+bool psi_util::AsyncFileReader::uses_io_uring() const {
+	return _backend->uses_io_uring();
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_util {
+/// Receives the contents of a file, or the error which stopped it from being read.
+using ReadCallback = std::function<void(std::vector<char> data, std::exception_ptr error)>;
+
+/// A request to read a whole file.
+struct FileRead {
+	boost::filesystem::path file;
+	/// Bypass the page cache, for large files which are read once. Only a hint.
+	bool direct = false;
+	/// Called on the reader's completion thread, so it should be quick.
+	/// May be called inside read or read_all if the file cannot be opened.
+	ReadCallback callback;
+};
+
+/// Arguments required to construct an AsyncFileReader.
+struct AsyncFileReaderArgs {
+	/// Maximum number of reads submitted to the kernel at once, more wait in the reader.
+	unsigned queue_depth = 256;
+	/// Number of threads doing blocking reads when io_uring is not available.
+	size_t fallback_threads = 2;
+	/// Number of registered, aligned buffers which direct reads go through. 0 disables direct reads.
+	size_t direct_buffers = 8;
+	/// Size of each direct read buffer, a multiple of 4096.
+	size_t direct_buffer_size = 1 << 20;
+	/// Use the fallback threads even if io_uring is available.
+	bool force_fallback = false;
+};
+
+/// Reads whole files asynchronously, so that many reads can be in flight without a thread each.
+/// Uses io_uring where the kernel supports it and a small pool of blocking threads otherwise.
+class AsyncFileReader : psi_mark::Threadsafe {
+public:
+	explicit AsyncFileReader(AsyncFileReaderArgs = {});
+	/// Waits for all reads to complete.
+	~AsyncFileReader();
+
+	AsyncFileReader(AsyncFileReader const&) = delete;
+	AsyncFileReader& operator=(AsyncFileReader const&) = delete;
+
+	/// Starts reading a file.
+	void read(FileRead);
+
+	/// Starts reading many files. They are submitted to the kernel together.
+	void read_all(std::vector<FileRead>);
+
+	/// Starts reading a file.
+	/// @return the contents, or the error which stopped it from being read
+	std::future<std::vector<char>> read(boost::filesystem::path const& file, bool direct = false);
+
+	/// Returns whether reads go through io_uring rather than the fallback threads.
+	bool uses_io_uring() const;
+
+	class Backend;
+
+private:
+	std::unique_ptr<Backend> _backend;
+};
+} // namespace psi_util
@@ -20,7 +20,11 @@
 
 #include "file.hpp"
 
+#include <algorithm>
 #include <fstream>
+#include <future>
+
+#include "async_file.hpp"
 
 // "libpng 1.4 dropped definitions of png_infopp_NULL and int_p_NULL. So add
 #define png_infopp_NULL (png_infopp)NULL
@@ -56,26 +60,44 @@ std::vector<std::string> psi_util::load_text(fs::path const& file) {
 	return contents;
 }
 
+std::vector<std::string> psi_util::split_lines(char const* data, size_t size) {
+	std::vector<std::string> contents;
+	char const* end = data + size;
+	while (true) {
+		char const* eol = std::find(data, end, '\n');
+		contents.push_back(std::string(data, eol) + "\n");
+		if (eol == end)
+			break;
+		data = eol + 1;
+	}
+	return contents;
+}
+
+/// Shared by all blocking loads, so that concurrent ones are in flight together.
+static psi_util::AsyncFileReader& file_reader() {
+	static psi_util::AsyncFileReader reader;
+	return reader;
+}
+
 std::vector<char> psi_util::load_binary(fs::path const& file) {
 	// might throw, pass exception if it does
-	auto size = fs::file_size(file);
-
-	// allocate memory of file size
-	std::vector<char> bin(size);
+	return file_reader().read(file).get();
+}
 
-	// try to open binary input stream
-	std::ifstream in_file(file.c_str(), std::ios::in | std::ios::binary);
-	if (!in_file.good()) {
-		in_file.close();
-		throw std::runtime_error("Failed to open binary file " + file.string() + ".");
+std::vector<std::vector<char>> psi_util::load_binaries(std::vector<fs::path> const& files) {
+	// submit all reads before waiting for any
+	std::vector<std::future<std::vector<char>>> reads;
+	reads.reserve(files.size());
+	for (auto const& f : files) {
+		reads.push_back(file_reader().read(f));
 	}
 
-	// copy whole file into vector
-	in_file.read(bin.data(), size);
-
-	// close file and return contents
-	in_file.close();
-	return bin;
+	std::vector<std::vector<char>> bins;
+	bins.reserve(files.size());
+	for (auto& r : reads) {
+		bins.push_back(r.get());
+	}
+	return bins;
 }
 
 gil::any_image<psi_util::ImagePixelFormats> psi_util::load_image(boost::filesystem::path const& file, ImageFormat format) {
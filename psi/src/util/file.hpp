@@ -33,11 +33,20 @@ namespace psi_util {
 	/// @returns a vector of lines from this file
 	std::vector<std::string> load_text(boost::filesystem::path const& file);
 
+	/// Splits text into lines like load_text, e.g. for text files read from an archive.
+	/// @returns a vector of lines from the text
+	std::vector<std::string> split_lines(char const* data, size_t size);
+
 	/// Tries to load a binary file from the specified path.
 	/// @throws if the file does not exist, is invalid, or otherwise occupied
 	/// @returns a vector containing the data from this file
 	std::vector<char> load_binary(boost::filesystem::path const& file);
 
+	/// Tries to load many binary files at once. The reads are all in flight together.
+	/// @throws if any file does not exist, is invalid, or otherwise occupied
+	/// @returns the data from each file, in order
+	std::vector<std::vector<char>> load_binaries(std::vector<boost::filesystem::path> const& files);
+
 	/// Valid pixel types for an image file.
 	using ImagePixelFormats = boost::mpl::vector<
 		boost::gil::rgb8_image_t,
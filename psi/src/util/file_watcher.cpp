@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "file_watcher.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "../log/log.hpp"
+
+
+namespace fs = boost::filesystem;
+
+class psi_util::FileWatcher::Impl {
+public:
+	Impl(FilesChangedCallback callback, unsigned settle_ms)
+		: _callback(std::move(callback))
+		, _settle_ms(int(settle_ms)) {
+		_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_inotify < 0)
+			throw std::runtime_error(std::string("Failed to initialize inotify: ") + std::strerror(errno) + ".");
+
+		_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (_wake < 0) {
+			int err = errno;
+			close(_inotify);
+			throw std::runtime_error(std::string("Failed to create an eventfd: ") + std::strerror(err) + ".");
+		}
+
+		_thread = std::thread([this] { _run(); });
+	}
+
+	~Impl() {
+		uint64_t one = 1;
+		// only fails if the counter overflows, which it cannot with a single write
+		(void)!write(_wake, &one, sizeof(one));
+		_thread.join();
+
+		close(_wake);
+		close(_inotify);
+	}
+
+	void watch(fs::path const& file) {
+		auto normal = normalize(file);
+		auto dir = normal.parent_path();
+
+		std::lock_guard<std::mutex> lock(_mut);
+		if (!_files.insert(normal.string()).second)
+			return;
+
+		auto watched = _dirs.find(dir.string());
+		if (watched != _dirs.end()) {
+			++watched->second.files;
+			return;
+		}
+
+		int wd = inotify_add_watch(_inotify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd < 0) {
+			int err = errno;
+			_files.erase(normal.string());
+			throw std::runtime_error("Failed to watch directory " + dir.string() + ": " + std::strerror(err) + ".");
+		}
+		_dirs.emplace(dir.string(), Directory{wd, 1});
+		_watches[wd] = dir;
+	}
+
+	void unwatch(fs::path const& file) {
+		auto normal = normalize(file);
+
+		std::lock_guard<std::mutex> lock(_mut);
+		if (!_files.erase(normal.string()))
+			return;
+
+		auto dir = _dirs.find(normal.parent_path().string());
+		if (--dir->second.files > 0)
+			return;
+
+		// events still queued for the watch are dropped by _drain, it no longer knows the descriptor
+		inotify_rm_watch(_inotify, dir->second.wd);
+		_watches.erase(dir->second.wd);
+		_dirs.erase(dir);
+	}
+
+private:
+	/// A watched directory and how many watched files are in it.
+	struct Directory {
+		int wd;
+		size_t files;
+	};
+
+	void _run() {
+		std::set<std::string> changed;
+		pollfd fds[2] = {
+			{ _inotify, POLLIN, 0 },
+			{ _wake, POLLIN, 0 },
+		};
+
+		while (true) {
+			// sleep until something happens, or until the changes so far have settled
+			int ready = poll(fds, 2, changed.empty() ? -1 : _settle_ms);
+			if (ready < 0) {
+				if (errno == EINTR)
+					continue;
+				psi_log::error("FileWatcher") << "Polling inotify failed: " << std::strerror(errno) << "\n";
+				return;
+			}
+
+			if (fds[1].revents & POLLIN)
+				return;
+
+			if (ready == 0) {
+				_report(changed);
+				continue;
+			}
+
+			if (fds[0].revents & POLLIN)
+				_drain(changed);
+		}
+	}
+
+	/// Reads all queued events, collecting the watched files they are about.
+	void _drain(std::set<std::string>& changed) {
+		alignas(inotify_event) char buf[4096];
+		while (true) {
+			ssize_t len = read(_inotify, buf, sizeof(buf));
+			if (len <= 0)
+				return;
+
+			std::lock_guard<std::mutex> lock(_mut);
+			for (char* p = buf; p < buf + len; ) {
+				auto ev = reinterpret_cast<inotify_event const*>(p);
+				p += sizeof(inotify_event) + ev->len;
+
+				if (ev->mask & IN_Q_OVERFLOW) {
+					// events were lost, anything may have changed
+					psi_log::warning("FileWatcher") << "inotify queue overflowed, reporting all watched files.\n";
+					changed.insert(_files.begin(), _files.end());
+					continue;
+				}
+
+				auto dir = _watches.find(ev->wd);
+				if (dir == _watches.end() || ev->len == 0)
+					continue;
+
+				auto file = (dir->second / ev->name).string();
+				if (_files.count(file))
+					changed.insert(std::move(file));
+			}
+		}
+	}
+
+	void _report(std::set<std::string>& changed) {
+		std::vector<fs::path> files(changed.begin(), changed.end());
+		changed.clear();
+
+		try {
+			_callback(files);
+		}
+		catch (std::exception const& e) {
+			psi_log::error("FileWatcher") << "Change callback threw: " << e.what() << "\n";
+		}
+	}
+
+	FilesChangedCallback _callback;
+	int const _settle_ms;
+
+	int _inotify;
+	/// Written to on destruction to stop the thread.
+	int _wake;
+
+	/// Guards the watch lists, which are read by the thread and written by watch and unwatch.
+	std::mutex _mut;
+	std::set<std::string> _files;
+	std::unordered_map<std::string, Directory> _dirs;
+	std::unordered_map<int, fs::path> _watches;
+
+	std::thread _thread;
+};
+
+psi_util::FileWatcher::FileWatcher(FilesChangedCallback callback, unsigned settle_ms)
+	: _impl(std::make_unique<Impl>(std::move(callback), settle_ms)) {}
+
+psi_util::FileWatcher::~FileWatcher() {}
+
+void psi_util::FileWatcher::watch(fs::path const& file) {
+	_impl->watch(file);
+}
+
+void psi_util::FileWatcher::unwatch(fs::path const& file) {
+	_impl->unwatch(file);
+}
+
+fs::path psi_util::FileWatcher::normalize(fs::path const& file) {
+	return fs::absolute(file).lexically_normal();
+}
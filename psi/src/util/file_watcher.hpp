@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_util {
+/// Receives files which changed since the last call, each once.
+using FilesChangedCallback = std::function<void(std::vector<boost::filesystem::path> const& files)>;
+
+/// Watches files for changes with inotify on a thread of its own.
+/// Directories are watched rather than the files themselves, so that files replaced by a rename,
+/// as most editors and exporters save them, are still noticed.
+class FileWatcher : psi_mark::Threadsafe {
+public:
+	/// @param[in] callback called on the watcher's thread
+	/// @param[in] settle_ms changes are reported once no more arrive for this long, so that a file written
+	///                      in several steps is reported once
+	/// @throw std::runtime_error if inotify is unavailable
+	explicit FileWatcher(FilesChangedCallback callback, unsigned settle_ms = 50);
+	/// Waits for the callback to return if it is running.
+	~FileWatcher();
+
+	FileWatcher(FileWatcher const&) = delete;
+	FileWatcher& operator=(FileWatcher const&) = delete;
+
+	/// Starts watching a file. Watching it again does nothing. The file does not have to exist yet.
+	/// @throw std::runtime_error if its directory cannot be watched
+	void watch(boost::filesystem::path const& file);
+	/// Stops watching a file, and its directory once no watched file is left in it. Does nothing if the file is not watched.
+	void unwatch(boost::filesystem::path const& file);
+
+	/// Returns the absolute, normalized form of a path, as files are reported in.
+	static boost::filesystem::path normalize(boost::filesystem::path const& file);
+
+	class Impl;
+
+private:
+	std::unique_ptr<Impl> _impl;
+};
+} // namespace psi_util
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "hash.hpp"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "assert.hpp"
+#include "../log/log.hpp"
+
+
+namespace {
+uint64_t const XXH_P1 = 11400714785074694791ull;
+uint64_t const XXH_P2 = 14029467366897019727ull;
+uint64_t const XXH_P3 = 1609587929392839161ull;
+uint64_t const XXH_P4 = 9650029242287828579ull;
+uint64_t const XXH_P5 = 2870177450012600261ull;
+
+inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// little-endian reads, as the reference implementation does on x86
+inline uint64_t read64(unsigned char const* p) {
+	uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint32_t read32(unsigned char const* p) {
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+	acc += input * XXH_P2;
+	acc = rotl(acc, 31);
+	return acc * XXH_P1;
+}
+
+inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+	acc ^= xxh_round(0, val);
+	return acc * XXH_P1 + XXH_P4;
+}
+} // namespace
+
+uint64_t psi_util::xxh64(void const* data, size_t size, uint64_t seed) {
+	auto p = static_cast<unsigned char const*>(data);
+	auto const end = p + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		// four independent lanes, so that the multiplications pipeline
+		uint64_t v1 = seed + XXH_P1 + XXH_P2;
+		uint64_t v2 = seed + XXH_P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_P1;
+		for (auto limit = end - 32; p <= limit; p += 32) {
+			v1 = xxh_round(v1, read64(p));
+			v2 = xxh_round(v2, read64(p + 8));
+			v3 = xxh_round(v3, read64(p + 16));
+			v4 = xxh_round(v4, read64(p + 24));
+		}
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else {
+		h = seed + XXH_P5;
+	}
+
+	h += size;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, read64(p));
+		h = rotl(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= end) {
+		h ^= uint64_t(read32(p)) * XXH_P1;
+		h = rotl(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; ++p) {
+		h ^= *p * XXH_P5;
+		h = rotl(h, 11) * XXH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+void psi_util::register_hash(uint64_t hash, char const* data, size_t size) {
+#ifndef NDEBUG
+	static std::mutex mut;
+	static std::unordered_map<uint64_t, std::string> seen;
+
+	std::lock_guard<std::mutex> lock(mut);
+	auto it = seen.emplace(hash, std::string(data, size)).first;
+	if (it->second.compare(0, std::string::npos, data, size) != 0) {
+		psi_log::error("Hash") << "\"" << it->second << "\" and \"" << std::string(data, size)
+			<< "\" have the same hash " << hash << ", please rename one.\n";
+		ASSERT(false);
+	}
+#else
+	(void)hash;
+	(void)data;
+	(void)size;
+#endif
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+namespace psi_util {
+/// 64-bit FNV-1a hash of the bytes. Unlike std::hash it is the same on every platform and run,
+/// so it can be stored in files. Computed at compile time when the bytes are a constant.
+constexpr uint64_t fnv1a_64(char const* data, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= uint8_t(data[i]);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+inline uint64_t fnv1a_64(std::string const& s) {
+	return fnv1a_64(s.data(), s.size());
+}
+
+/// 64-bit xxHash (XXH64) of the bytes. Many times faster than fnv1a_64 on large inputs,
+/// meant for hashing file contents.
+uint64_t xxh64(void const* data, size_t size, uint64_t seed = 0);
+
+/// Remembers which bytes a hash was computed from and fails an assertion if different bytes
+/// had the same hash before. Does nothing in release builds.
+void register_hash(uint64_t hash, char const* data, size_t size);
+} // namespace psi_util
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <limits>
+
+
+namespace psi_util {
+/// A histogram of unsigned values with power-of-two bucket boundaries.
+/// Bucket i counts values in [2^(i-1), 2^i), bucket 0 counts zeroes.
+/// Cheap enough to be updated every frame and small enough to be copied around.
+class Histogram {
+public:
+	static constexpr size_t BUCKETS = 65;
+
+	void add(uint64_t v) {
+		size_t bucket = 0;
+		if (v != 0)
+			bucket = 64 - size_t(__builtin_clzll(v));
+		++_buckets[bucket];
+
+		++_count;
+		_sum += v;
+		_min = v < _min ? v : _min;
+		_max = v > _max ? v : _max;
+	}
+
+	void merge(Histogram const& other) {
+		for (size_t i = 0; i < BUCKETS; ++i)
+			_buckets[i] += other._buckets[i];
+
+		_count += other._count;
+		_sum += other._sum;
+		_min = other._min < _min ? other._min : _min;
+		_max = other._max > _max ? other._max : _max;
+	}
+
+	uint64_t count() const { return _count; }
+	uint64_t sum() const { return _sum; }
+	uint64_t min() const { return _count ? _min : 0; }
+	uint64_t max() const { return _max; }
+	double mean() const { return _count ? double(_sum) / double(_count) : 0.0; }
+
+	/// Returns the upper bound of the bucket containing the given percentile.
+	/// @param[in] p percentile in [0, 1]
+	uint64_t percentile(double p) const {
+		if (_count == 0)
+			return 0;
+
+		uint64_t target = uint64_t(p * double(_count));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; ++i) {
+			seen += _buckets[i];
+			if (seen > target) {
+				if (i == 0)
+					return 0;
+				uint64_t upper = i == 64 ? _max : (uint64_t(1) << i) - 1;
+				return upper < _max ? upper : _max;
+			}
+		}
+		return _max;
+	}
+
+	std::array<uint64_t, BUCKETS> const& buckets() const { return _buckets; }
+
+private:
+	std::array<uint64_t, BUCKETS> _buckets = {{}};
+	uint64_t _count = 0;
+	uint64_t _sum = 0;
+	uint64_t _min = std::numeric_limits<uint64_t>::max();
+	uint64_t _max = 0;
+};
+} // namespace psi_util
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+psi_util::MappedFile::MappedFile(boost::filesystem::path const& file)
+	: _data(nullptr)
+	, _size(0) {
+	int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("Failed to open file " + file.string() + ": " + std::strerror(errno) + ".");
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		int err = errno;
+		close(fd);
+		throw std::runtime_error("Failed to stat file " + file.string() + ": " + std::strerror(err) + ".");
+	}
+	_size = size_t(st.st_size);
+
+	// empty mappings are invalid, an empty file maps to nothing
+	if (_size > 0) {
+		void* ptr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+		int err = errno;
+		close(fd);
+		if (ptr == MAP_FAILED)
+			throw std::runtime_error("Failed to map file " + file.string() + ": " + std::strerror(err) + ".");
+
+		// the file is about to be read front to back
+		madvise(ptr, _size, MADV_WILLNEED);
+		_data = static_cast<char const*>(ptr);
+	}
+	else {
+		close(fd);
+	}
+}
+
+psi_util::MappedFile::~MappedFile() {
+	if (_data)
+		munmap(const_cast<char*>(_data), _size);
+}
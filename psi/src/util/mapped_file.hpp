@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This file is part of Psi Engine.
+ *
+ * Psi Engine is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Psi Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Psi Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+
+#include <boost/filesystem.hpp>
+
+#include "../marker/thread_safety.hpp"
+
+
+namespace psi_util {
+/// A whole file mapped read-only into memory. Pages are read in by the kernel on first access
+/// and shared with the page cache, so the contents are never copied.
+/// @warning Mapped files must be replaced, e.g. by writing a new file and rename()ing it over the old one,
+/// never rewritten in place. Truncating a mapped file makes accessing the mapping raise SIGBUS, and
+/// other writes change its contents under the reader.
+class MappedFile : psi_mark::ConstThreadsafe {
+public:
+	/// @throws if the file does not exist or cannot be mapped
+	explicit MappedFile(boost::filesystem::path const& file);
+	~MappedFile();
+
+	MappedFile(MappedFile const&) = delete;
+	MappedFile& operator=(MappedFile const&) = delete;
+
+	/// Returns the start of the mapping, aligned to a page.
+	char const* data() const {
+		return _data;
+	}
+
+	size_t size() const {
+		return _size;
+	}
+
+private:
+	char const* _data;
+	size_t _size;
+};
+} // namespace psi_util
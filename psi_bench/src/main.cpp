@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2016 Wojciech Nawrocki
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include <boost/filesystem.hpp>
+namespace fs = boost::filesystem;
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <system/manager.hpp>
+#include <thread/manager.hpp>
+#include <impl/scene/default_components.hpp>
+#include <profile/profiler.hpp>
+#include <util/histogram.hpp>
+
+
+/// Keeps reads from being optimized out.
+static volatile uint64_t SINK;
+
+/// Populates the scene with entities, each owning a transform and sharing a model, on load.
+/// Requires no components afterwards, so it does not influence the measured frames.
+class SceneSpawner : public psi_sys::ISystem {
+public:
+	SceneSpawner(size_t entities, size_t entities_per_model)
+		: _entities(entities)
+		, _entities_per_model(entities_per_model) {}
+
+	psi_scene::ComponentTypeIdBitset required_components() const override {
+		if (_spawned)
+			return 0;
+
+		return psi_scene::ComponentEntity::type | psi_scene::ComponentTransform::type | psi_scene::ComponentModel::type;
+	}
+
+	void on_scene_loaded(psi_scene::ISceneDirectAccess& acc) override {
+		size_t models = (_entities + _entities_per_model - 1) / _entities_per_model;
+		for (size_t i = 0; i < models; ++i) {
+			psi_scene::ComponentModel model;
+			model.mesh_name.fill(0);
+			model.albedo_tex.fill(0);
+			model.reflectiveness_roughness_tex.fill(0);
+			model.normal_tex.fill(0);
+			acc.add_component(model);
+		}
+
+		for (size_t i = 0; i < _entities; ++i) {
+			psi_scene::ComponentTransform transform;
+			transform.pos = {{float(i), 0.0f, 0.0f}};
+			transform.scale = {{1.0f, 1.0f, 1.0f}};
+			transform.orientation = {{1.0f, 0.0f, 0.0f, 0.0f}};
+
+			psi_scene::ComponentEntity ent;
+			ent.transform = psi_scene::ComponentHandle(acc.add_component(transform));
+			ent.model = psi_scene::ComponentHandle(i / _entities_per_model);
+			acc.add_component(ent);
+		}
+
+		_spawned = true;
+	}
+
+	void on_scene_update(psi_scene::ISceneDirectAccess&) override {}
+	void on_scene_save(psi_scene::ISceneDirectAccess&, void*) override {}
+	void on_scene_shutdown(psi_scene::ISceneDirectAccess&) override {}
+
+private:
+	size_t _entities;
+	size_t _entities_per_model;
+	bool _spawned = false;
+};
+
+static void mutate(psi_scene::ComponentEntity& c) {
+	c.experiences_causality = !c.experiences_causality;
+}
+
+static void mutate(psi_scene::ComponentTransform& c) {
+	c.pos[1] += 1.0f;
+}
+
+static void mutate(psi_scene::ComponentModel& c) {
+	++c.mesh_name[0];
+}
+
+template <typename T>
+static void read_all(psi_scene::ISceneDirectAccess& acc) {
+	uint64_t sum = 0;
+	size_t count = acc.component_count<T>();
+	for (size_t i = 0; i < count; ++i) {
+		sum += *reinterpret_cast<uint8_t const*>(&acc.read_component<T>(i));
+	}
+	SINK = sum;
+}
+
+template <typename T>
+static void write_every(psi_scene::ISceneDirectAccess& acc, size_t stride) {
+	size_t count = acc.component_count<T>();
+	for (size_t i = 0; i < count; i += stride) {
+		mutate(acc.write_component<T>(i));
+	}
+}
+
+/// A system which reads all components of some types and writes every n-th component of others.
+class DummySystem : public psi_sys::ISystem {
+public:
+	DummySystem(psi_scene::ComponentTypeIdBitset reads, psi_scene::ComponentTypeIdBitset writes, size_t write_stride)
+		: _reads(reads)
+		, _writes(writes)
+		, _stride(write_stride) {}
+
+	psi_scene::ComponentTypeIdBitset required_components() const override {
+		return _reads | _writes;
+	}
+
+	void on_scene_loaded(psi_scene::ISceneDirectAccess&) override {}
+
+	void on_scene_update(psi_scene::ISceneDirectAccess& acc) override {
+		if (_reads & psi_scene::ComponentEntity::type)
+			read_all<psi_scene::ComponentEntity>(acc);
+		if (_reads & psi_scene::ComponentTransform::type)
+			read_all<psi_scene::ComponentTransform>(acc);
+		if (_reads & psi_scene::ComponentModel::type)
+			read_all<psi_scene::ComponentModel>(acc);
+
+		if (_writes & psi_scene::ComponentEntity::type)
+			write_every<psi_scene::ComponentEntity>(acc, _stride);
+		if (_writes & psi_scene::ComponentTransform::type)
+			write_every<psi_scene::ComponentTransform>(acc, _stride);
+		if (_writes & psi_scene::ComponentModel::type)
+			write_every<psi_scene::ComponentModel>(acc, _stride);
+	}
+
+	void on_scene_save(psi_scene::ISceneDirectAccess&, void*) override {}
+	void on_scene_shutdown(psi_scene::ISceneDirectAccess&) override {}
+
+private:
+	psi_scene::ComponentTypeIdBitset _reads;
+	psi_scene::ComponentTypeIdBitset _writes;
+	size_t _stride;
+};
+
+/// Read/write pattern of a single dummy system.
+struct SystemPattern {
+	psi_scene::ComponentTypeIdBitset reads;
+	psi_scene::ComponentTypeIdBitset writes;
+};
+
+struct Environment {
+	std::vector<size_t> entities;
+	std::vector<size_t> threads;
+	std::vector<SystemPattern> systems;
+	size_t entities_per_model;
+	size_t write_stride;
+	size_t frames;
+	size_t warmup;
+	bool pin;
+	bool csv;
+	fs::path output;
+};
+
+struct Result {
+	size_t entities;
+	size_t threads;
+	uint64_t load_ns;
+	psi_util::Histogram total_ns;
+	psi_util::Histogram construct_ns;
+	psi_util::Histogram systems_ns;
+	psi_util::Histogram sync_ns;
+	size_t scene_bytes;
+	size_t access_bytes;
+	size_t rss_bytes;
+};
+
+/// Parses a comma-separated list of component names into a type bitset.
+/// @throw on unknown component names
+static psi_scene::ComponentTypeIdBitset parse_types(std::string const& list) {
+	psi_scene::ComponentTypeIdBitset types = 0;
+	std::stringstream ss(list);
+	std::string name;
+	while (std::getline(ss, name, ',')) {
+		if (name == "entity")
+			types |= psi_scene::ComponentEntity::type;
+		else if (name == "transform")
+			types |= psi_scene::ComponentTransform::type;
+		else if (name == "model")
+			types |= psi_scene::ComponentModel::type;
+		else if (!name.empty())
+			throw std::runtime_error("Unknown component type " + name + ".");
+	}
+	return types;
+}
+
+static size_t resident_bytes() {
+	std::ifstream statm("/proc/self/statm");
+	size_t pages = 0, resident = 0;
+	statm >> pages >> resident;
+	return resident * size_t(sysconf(_SC_PAGESIZE));
+}
+
+static Result run(Environment const& env, size_t entities, size_t threads) {
+	Result res;
+	res.entities = entities;
+	res.threads = threads;
+
+	psi_thread::TaskManagerArgs args;
+	args.workers = threads;
+	args.pin_threads = env.pin;
+	psi_thread::TaskManager tasks(args);
+	psi_sys::SystemManager systems(tasks);
+	systems.register_component_type(psi_scene::component_type_entity_info);
+	systems.register_component_type(psi_scene::component_type_model_info);
+	systems.register_component_type(psi_scene::component_type_transform_info);
+
+	systems.register_system(std::make_unique<SceneSpawner>(entities, env.entities_per_model));
+	for (auto const& p : env.systems) {
+		systems.register_system(std::make_unique<DummySystem>(p.reads, p.writes, env.write_stride));
+	}
+
+	systems.load_scene(nullptr);
+	res.load_ns = systems.last_frame_stats().total_ns;
+
+	for (size_t i = 0; i < env.warmup; ++i) {
+		systems.update_scene();
+	}
+
+	for (size_t i = 0; i < env.frames; ++i) {
+		systems.update_scene();
+
+		auto const& stats = systems.last_frame_stats();
+		res.total_ns.add(stats.total_ns);
+		res.construct_ns.add(stats.construct_ns);
+		res.systems_ns.add(stats.systems_ns);
+		res.sync_ns.add(stats.sync_ns);
+	}
+
+	res.scene_bytes = systems.last_frame_stats().scene_bytes;
+	res.access_bytes = systems.last_frame_stats().access_bytes;
+	res.rss_bytes = resident_bytes();
+
+	return res;
+}
+
+static double entities_per_second(Result const& r) {
+	if (r.total_ns.sum() == 0)
+		return 0.0;
+	return double(r.entities) * double(r.total_ns.count()) * 1e9 / double(r.total_ns.sum());
+}
+
+static void write_csv(std::ostream& out, std::vector<Result> const& results) {
+	out << "entities,threads,load_ns,frames,update_mean_ns,update_p50_ns,update_p99_ns,update_max_ns,"
+		<< "construct_mean_ns,systems_mean_ns,sync_mean_ns,entities_per_second,scene_bytes,access_bytes,rss_bytes\n";
+	for (auto const& r : results) {
+		out << r.entities << "," << r.threads << "," << r.load_ns << "," << r.total_ns.count() << ","
+			<< uint64_t(r.total_ns.mean()) << "," << r.total_ns.percentile(0.5) << "," << r.total_ns.percentile(0.99) << "," << r.total_ns.max() << ","
+			<< uint64_t(r.construct_ns.mean()) << "," << uint64_t(r.systems_ns.mean()) << "," << uint64_t(r.sync_ns.mean()) << ","
+			<< uint64_t(entities_per_second(r)) << "," << r.scene_bytes << "," << r.access_bytes << "," << r.rss_bytes << "\n";
+	}
+}
+
+static void write_json(std::ostream& out, std::vector<Result> const& results) {
+	out << "{\n\t\"benchmark\": \"SystemManager::update_scene\",\n\t\"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		auto const& r = results[i];
+		out << "\t\t{"
+			<< "\"entities\": " << r.entities
+			<< ", \"threads\": " << r.threads
+			<< ", \"load_ns\": " << r.load_ns
+			<< ", \"frames\": " << r.total_ns.count()
+			<< ", \"update_ns\": {\"mean\": " << uint64_t(r.total_ns.mean())
+				<< ", \"p50\": " << r.total_ns.percentile(0.5)
+				<< ", \"p99\": " << r.total_ns.percentile(0.99)
+				<< ", \"max\": " << r.total_ns.max() << "}"
+			<< ", \"construct_access_mean_ns\": " << uint64_t(r.construct_ns.mean())
+			<< ", \"systems_mean_ns\": " << uint64_t(r.systems_ns.mean())
+			<< ", \"sync_with_accesses_mean_ns\": " << uint64_t(r.sync_ns.mean())
+			<< ", \"entities_per_second\": " << uint64_t(entities_per_second(r))
+			<< ", \"scene_bytes\": " << r.scene_bytes
+			<< ", \"access_bytes\": " << r.access_bytes
+			<< ", \"rss_bytes\": " << r.rss_bytes
+			<< "}" << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "\t]\n}\n";
+}
+
+constexpr int NO_EXIT = 1337;
+/// Parses the given command line arguments into the specified environment.
+/// @return exit code if program should exit, NO_EXIT otherwise
+int parse_command_line(int argc, char** argv, Environment& env) {
+	std::vector<size_t> default_threads = {0, 1};
+	for (size_t n = 2; n <= std::thread::hardware_concurrency(); n *= 2) {
+		default_threads.push_back(n);
+	}
+
+	po::options_description options("Options");
+	options.add_options()
+		("help,h", "Display this help message and quit.")
+		("version,v", "Display the program version and quit.")
+		("entities,e", po::value<std::vector<size_t>>()->multitoken(), "Entity counts to benchmark. Defaults to 1000 10000 100000 1000000.")
+		("threads,t", po::value<std::vector<size_t>>()->multitoken(), "Worker thread counts to benchmark, 0 runs systems synchronously. Defaults to powers of two up to the core count.")
+		("system,s", po::value<std::vector<std::string>>(), "Add a dummy system as READS:WRITES, both comma-separated lists of entity, transform, model.")
+		("entities-per-model", po::value<size_t>()->default_value(100), "Number of entities sharing a single model component.")
+		("write-stride", po::value<size_t>()->default_value(16), "Writing systems modify every n-th component.")
+		("frames,f", po::value<size_t>()->default_value(50), "Number of measured frames per run.")
+		("warmup", po::value<size_t>()->default_value(5), "Number of unmeasured frames before measuring.")
+		("pin", "Pin the main and worker threads to physical cores.")
+		("format", po::value<std::string>()->default_value("json"), "Output format, json or csv.")
+		("output,o", po::value<fs::path>(), "File to write results to. Defaults to stdout.")
+	;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, options), vm);
+		po::notify(vm);
+	}
+	catch (std::exception const& e) {
+		std::cerr
+			<< "Invalid option:\n"
+			<< e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (vm.count("help")) {
+		std::cout
+			<< "----- Psi Engine Benchmark 1.0.0 -----\n"
+			<< "Copyright (C) 2016 Wojciech Nawrocki\n"
+			<< "Measures SystemManager throughput on synthetic scenes.\n"
+			<< "\n"
+			<< options << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	if (vm.count("version")) {
+		std::cout << "1.0.0" << std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	env.entities = vm.count("entities") ? vm["entities"].as<std::vector<size_t>>() : std::vector<size_t>{1000, 10000, 100000, 1000000};
+	env.threads = vm.count("threads") ? vm["threads"].as<std::vector<size_t>>() : default_threads;
+	env.pin = vm.count("pin");
+
+	std::vector<std::string> patterns = {
+		"entity,transform:",
+		"transform:transform",
+		"entity,model:",
+		"transform,model:model",
+	};
+	if (vm.count("system"))
+		patterns = vm["system"].as<std::vector<std::string>>();
+
+	for (auto const& p : patterns) {
+		auto colon = p.find(':');
+		try {
+			if (colon == std::string::npos)
+				env.systems.push_back(SystemPattern{parse_types(p), 0});
+			else
+				env.systems.push_back(SystemPattern{parse_types(p.substr(0, colon)), parse_types(p.substr(colon + 1))});
+		}
+		catch (std::exception const& e) {
+			std::cerr << "Invalid system " << p << ": " << e.what() << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	env.entities_per_model = vm["entities-per-model"].as<size_t>();
+	env.write_stride = vm["write-stride"].as<size_t>();
+	if (env.entities_per_model == 0 || env.write_stride == 0) {
+		std::cerr << "Entities per model and write stride must be positive." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	env.frames = vm["frames"].as<size_t>();
+	env.warmup = vm["warmup"].as<size_t>();
+
+	auto format = vm["format"].as<std::string>();
+	if (format != "json" && format != "csv") {
+		std::cerr << "Invalid output format " << format << "." << std::endl;
+		return EXIT_FAILURE;
+	}
+	env.csv = format == "csv";
+
+	if (vm.count("output"))
+		env.output = vm["output"].as<fs::path>();
+
+	return NO_EXIT;
+}
+
+int main(int argc, char** argv) {
+	Environment env;
+	auto code = parse_command_line(argc, argv, env);
+	if (code != NO_EXIT)
+		return code;
+
+	std::vector<Result> results;
+	for (size_t entities : env.entities) {
+		for (size_t threads : env.threads) {
+			std::cerr << "Benchmarking " << entities << " entities on " << threads << " worker threads.." << std::endl;
+			results.push_back(run(env, entities, threads));
+		}
+	}
+
+	std::ofstream file;
+	if (!env.output.empty()) {
+		file.open(env.output.string());
+		if (!file.good()) {
+			std::cerr << "Could not write to file " << env.output << "." << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	std::ostream& out = env.output.empty() ? std::cout : file;
+
+	if (env.csv)
+		write_csv(out, results);
+	else
+		write_json(out, results);
+
+	return EXIT_SUCCESS;
+}
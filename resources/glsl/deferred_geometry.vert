@@ -20,21 +20,48 @@
 
 #version 430
 
-layout(location = 0) in vec3 pos_model_vec3;
-layout(location = 1) in vec3 norm_model_vec3;
-layout(location = 2) in vec3 tan_model_vec3;
+// in the quantized vertex layout positions are fractions of the bounding box,
+// normals and tangents are octahedral-encoded in xy
+layout(location = 0) in vec3 pos_attrib_vec3;
+layout(location = 1) in vec3 norm_attrib_vec3;
+layout(location = 2) in vec3 tan_attrib_vec3;
 layout(location = 3) in vec2 uv_tan_vec2;
 
 #map LOCAL_TO_WORLD
 uniform mat4 model_to_world_mat4;
 #map LOCAL_TO_CLIP
 uniform mat4 model_to_clip_mat4;
+#map MESH_VERTEX_LAYOUT
+uniform uint vertex_layout_uint;
+#map MESH_MIN_POS
+uniform vec3 min_pos_model_vec3;
+#map MESH_MAX_POS
+uniform vec3 max_pos_model_vec3;
+
+const uint VERTEX_LAYOUT_QUANTIZED = 1u;
+
+/// Inverse of psi_rndr's octahedral encoding.
+vec3 oct_decode(vec2 e) {
+	vec3 v = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	float t = max(-v.z, 0.0);
+	v.xy += vec2(v.x >= 0.0 ? -t : t, v.y >= 0.0 ? -t : t);
+	return normalize(v);
+}
 
 smooth out vec3 pos_world_vec3;
 smooth out vec2 uv_tan_vec2_out;
 smooth out mat3 tan_to_world_mat3;
 
 void main() {
+	vec3 pos_model_vec3 = pos_attrib_vec3;
+	vec3 norm_model_vec3 = norm_attrib_vec3;
+	vec3 tan_model_vec3 = tan_attrib_vec3;
+	if (vertex_layout_uint == VERTEX_LAYOUT_QUANTIZED) {
+		pos_model_vec3 = mix(min_pos_model_vec3, max_pos_model_vec3, pos_attrib_vec3);
+		norm_model_vec3 = oct_decode(norm_attrib_vec3.xy);
+		tan_model_vec3 = oct_decode(tan_attrib_vec3.xy);
+	}
+
 	pos_world_vec3 = vec3(model_to_world_mat4 * vec4(pos_model_vec3, 1.0));
 
 	uv_tan_vec2_out = uv_tan_vec2;